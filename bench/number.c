@@ -0,0 +1,120 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "number.h"
+
+// Times number.c against the C library on random doubles, and checks on
+// the way that it gives the same answers: format_number() the same text as
+// printf("%g"), parse_number() the same bits as strtod(), and
+// format_shortest() text that reads back as the number it came from.
+
+#define COUNT 1000000
+
+static uint64_t state = 88172645463325252ull;
+
+static uint64_t next_random() {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// Finite doubles with every exponent equally likely, and some short ones
+// as scripts tend to have.
+static double random_double() {
+    for (;;) {
+        uint64_t bits = next_random();
+        double value;
+        if (bits % 4 == 0)
+            value = (double)(int64_t)(next_random() % 2000001 - 1000000)
+                    / 1000;
+        else
+            memcpy(&value, &bits, sizeof(value));
+        if (value - value == 0)
+            return value;
+    }
+}
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1e9 + time.tv_nsec;
+}
+
+static void report(const char* name, double ours, double theirs) {
+    printf("%-16s %7.1f ns %7.1f ns  %5.2fx\n", name, ours / COUNT,
+           theirs / COUNT, theirs / ours);
+}
+
+int main() {
+    double* values = malloc(sizeof(double) * COUNT);
+    char (*texts)[NUMBER_MAX_LENGTH] = malloc(NUMBER_MAX_LENGTH * COUNT);
+    if (values == NULL || texts == NULL)
+        return 1;
+    for (int i = 0; i < COUNT; i++)
+        values[i] = random_double();
+
+    long mismatches = 0;
+    char text[NUMBER_MAX_LENGTH];
+    for (int i = 0; i < COUNT; i++) {
+        format_number(texts[i], values[i]);
+        snprintf(text, sizeof(text), "%g", values[i]);
+        if (strcmp(texts[i], text) != 0)
+            mismatches++;
+
+        double parsed;
+        int length = format_shortest(texts[i], values[i]);
+        if (!parse_number(texts[i], length, &parsed)
+            || memcmp(&parsed, &values[i], sizeof(double)) != 0
+            || parsed != strtod(texts[i], NULL))
+            mismatches++;
+
+        snprintf(text, sizeof(text), "%.17g", values[i]);
+        if (!parse_number(text, (int)strlen(text), &parsed)
+            || parsed != strtod(text, NULL))
+            mismatches++;
+    }
+    printf("%ld mismatches in %d numbers\n\n", mismatches, COUNT);
+    printf("%-16s %10s %10s %7s\n", "", "number.c", "libc", "speedup");
+
+    double start = now();
+    for (int i = 0; i < COUNT; i++)
+        format_number(text, values[i]);
+    double ours = now() - start;
+    start = now();
+    for (int i = 0; i < COUNT; i++)
+        snprintf(text, sizeof(text), "%g", values[i]);
+    report("print (%g)", ours, now() - start);
+
+    start = now();
+    for (int i = 0; i < COUNT; i++)
+        format_shortest(text, values[i]);
+    ours = now() - start;
+    start = now();
+    for (int i = 0; i < COUNT; i++)
+        snprintf(text, sizeof(text), "%.17g", values[i]);
+    report("str (%.17g)", ours, now() - start);
+
+    for (int i = 0; i < COUNT; i++)
+        format_shortest(texts[i], values[i]);
+    volatile double sink = 0;
+    start = now();
+    for (int i = 0; i < COUNT; i++) {
+        double parsed;
+        parse_number(texts[i], (int)strlen(texts[i]), &parsed);
+        sink += parsed;
+    }
+    ours = now() - start;
+    start = now();
+    for (int i = 0; i < COUNT; i++)
+        sink += strtod(texts[i], NULL);
+    report("num (strtod)", ours, now() - start);
+
+    free(values);
+    free(texts);
+    return mismatches == 0 ? 0 : 1;
+}
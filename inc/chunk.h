@@ -19,6 +19,8 @@ typedef enum {
     OP_SET_UPVALUE,
     OP_GET_PROPERTY,
     OP_SET_PROPERTY,
+    OP_GET_INDEX,
+    OP_SET_INDEX,
     OP_EQUAL,
     OP_GREATER,
     OP_LESS,
@@ -31,16 +33,22 @@ typedef enum {
     OP_PRINT,
     OP_JUMP,
     OP_JUMP_IF_FALSE,
+    OP_JUMP_IF_TRUE,
     OP_LOOP,
     OP_CALL,
+    OP_TAIL_CALL,
     OP_INVOKE,
+    OP_TAIL_INVOKE,
     OP_CLOSURE,
     OP_CLOSE_UPVALUE,
     OP_RETURN,
     OP_CLASS,
-    OP_METHOD
+    OP_METHOD,
+    OP_BUILD_LIST
 } Op_code;
 
+// A chunk with code but no capacity borrows its code and lines from a
+// mapped image.
 typedef struct {
     int count;
     int capacity;
@@ -50,8 +58,11 @@ typedef struct {
 } Chunk;
 
 void init_chunk(Chunk* chunk);
-void write_chunk(Chunk* chunk, uint8_t byte, int line);
-void free_chunk(Chunk* chunk);
-int add_constant(Chunk* chunk, Value value);
+void write_chunk(VM* vm, Chunk* chunk, uint8_t byte, int line);
+void free_chunk(VM* vm, Chunk* chunk);
+int add_constant(VM* vm, Chunk* chunk, Value value);
+int fixed_instruction_length(uint8_t instruction);
+int instruction_length(Chunk* chunk, int offset);
+void stack_effect(const uint8_t* code, int* pops, int* pushes);
 
 #endif // __CHUNK_h
@@ -13,4 +13,8 @@
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// All of an interpreter's state lives in its VM, which is passed to
+// everything that allocates or runs code.
+typedef struct VM VM;
+
 #endif // __COMMON_H
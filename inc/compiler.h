@@ -4,7 +4,7 @@
 #include "object.h"
 #include "vm.h"
 
-Obj_function* compile(const char* source);
-void mark_compiler_roots();
+Obj_function* compile(VM* vm, const char* source);
+void mark_compiler_roots(VM* vm);
 
 #endif
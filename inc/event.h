@@ -0,0 +1,11 @@
+#ifndef __EVENT_H
+#define __EVENT_H
+
+#include "common.h"
+
+void define_event_natives(VM* vm);
+bool run_event_loop(VM* vm);
+void mark_event_loop(VM* vm);
+void free_event_loop(VM* vm);
+
+#endif // __EVENT_H
@@ -0,0 +1,8 @@
+#ifndef __FLOAT_ARRAY_H
+#define __FLOAT_ARRAY_H
+
+#include "common.h"
+
+void define_float_array_natives(VM* vm);
+
+#endif // __FLOAT_ARRAY_H
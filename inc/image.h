@@ -0,0 +1,26 @@
+#ifndef __IMAGE_H
+#define __IMAGE_H
+
+#include "common.h"
+#include "object.h"
+
+// Bump whenever the layout of an image or the instruction set changes, or
+// the message format that snapshots are written in.
+#define IMAGE_VERSION 7
+
+typedef struct Mapped_image {
+    struct Mapped_image* next;
+    uint8_t* base;
+    size_t size;
+} Mapped_image;
+
+bool write_image(VM* vm, Obj_function* function, const char* path);
+// With same_options, an image compiled with other optimizer settings than
+// the VM's is turned away. One that inlined calls to globals always is when
+// the VM doesn't allow it.
+Obj_function* read_image(VM* vm, const char* path, bool same_options);
+bool link_image_function(VM* vm, Obj_function* function);
+void free_images(VM* vm);
+void unmap_images(Mapped_image* images);
+
+#endif // __IMAGE_H
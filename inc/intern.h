@@ -0,0 +1,24 @@
+#ifndef __INTERN_H
+#define __INTERN_H
+
+#include "common.h"
+#include "value.h"
+
+// Weak set of interned strings. Only the string pointers are stored; the
+// hash lives in the Obj_string itself.
+typedef struct {
+    int count;
+    int capacity;
+    Obj_string** keys;
+} Intern_set;
+
+void init_intern_set(Intern_set* set);
+void free_intern_set(VM* vm, Intern_set* set);
+void intern_set_reserve(VM* vm, Intern_set* set, int count);
+Obj_string* intern_set_find(VM* vm, Intern_set* set, const char* chars,
+                            int length, uint32_t hash, int* insert_index);
+void intern_set_insert(Intern_set* set, int index, Obj_string* string);
+
+void intern_set_remove_white(Intern_set* set);
+
+#endif // __INTERN_H
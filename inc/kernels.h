@@ -0,0 +1,26 @@
+#ifndef __KERNELS_H
+#define __KERNELS_H
+
+#include "common.h"
+
+// Loops over arrays of doubles, in the widest vector instructions the CPU
+// has. Outputs may be the same array as an input but mustn't overlap one
+// otherwise. Vector sums add in a different order than a plain loop, so
+// their last bits can differ from it. Min and max give the first NaN in
+// the array if there is one, and order -0 below 0, on every path.
+typedef struct {
+    void (*add)(double* out, const double* a, const double* b, int count);
+    void (*mul)(double* out, const double* a, const double* b, int count);
+    void (*scale)(double* out, const double* a, double factor, int count);
+    void (*fill)(double* out, double value, int count);
+    void (*prefix_sum)(double* out, const double* a, int count);
+    double (*dot)(const double* a, const double* b, int count);
+    double (*sum)(const double* a, int count);
+    // These two need at least one element.
+    double (*min)(const double* a, int count);
+    double (*max)(const double* a, int count);
+} Kernels;
+
+const Kernels* kernels(void);
+
+#endif // __KERNELS_H
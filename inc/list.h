@@ -0,0 +1,8 @@
+#ifndef __LIST_H
+#define __LIST_H
+
+#include "common.h"
+
+void define_list_natives(VM* vm);
+
+#endif // __LIST_H
@@ -0,0 +1,13 @@
+#ifndef __MAP_H
+#define __MAP_H
+
+#include "common.h"
+#include "object.h"
+
+bool map_get(Obj_map* map, Value key, Value* value);
+bool map_set(VM* vm, Obj_map* map, Value key, Value value);
+bool map_delete(Obj_map* map, Value key);
+void mark_map(VM* vm, Obj_map* map);
+void define_map_natives(VM* vm);
+
+#endif // __MAP_H
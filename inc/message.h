@@ -0,0 +1,32 @@
+#ifndef __MESSAGE_H
+#define __MESSAGE_H
+
+#include "common.h"
+#include "value.h"
+
+// Values copied out of one VM's heap into a flat buffer that points into
+// no heap, so that they can cross to another thread and be rebuilt in a
+// different VM. The globals used by any function in the message travel
+// with it.
+typedef struct {
+    size_t count;
+    size_t capacity;
+    uint8_t* bytes;
+    int value_count;
+
+    // Channels named in the message, and the segment of any shared
+    // functions in it, kept alive until it is freed.
+    int channel_count;
+    int channel_capacity;
+    struct Channel** channels;
+    struct Segment* segment;
+} Message;
+
+void init_message(Message* message);
+void free_message(Message* message);
+bool write_message(VM* vm, Message* message, int count);
+bool write_globals(VM* vm, Message* message);
+void read_message(VM* vm, const Message* message);
+void read_globals(VM* vm, const Message* message);
+
+#endif // __MESSAGE_H
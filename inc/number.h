@@ -0,0 +1,22 @@
+#ifndef __NUMBER_H
+#define __NUMBER_H
+
+#include "common.h"
+
+// Room for any number formatted here, with its terminator.
+#define NUMBER_MAX_LENGTH 32
+
+// Writes the number the way printf("%g") does, terminated, and returns its
+// length. The digits come from the shortest decimal that reads back as the
+// same double, so a printf is needed only for the rare number that sits
+// exactly halfway between two six digit ones.
+int format_number(char* buffer, double value);
+// Writes the shortest decimal that reads back as the same double, the way
+// JavaScript lays it out, and returns its length.
+int format_shortest(char* buffer, double value);
+// Reads a whole string as a decimal number, which may have a sign, a
+// fraction and an exponent, or be inf or nan. Rounds correctly, and fails
+// on anything else.
+bool parse_number(const char* chars, int length, double* value);
+
+#endif // __NUMBER_H
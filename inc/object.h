@@ -9,29 +9,43 @@
 #define OBJ_TYPE(value)         (AS_OBJ(value)->type)
 
 #define IS_BOUND_METHOD(value)  is_obj_type(value, OBJ_BOUND_METHOD)
+#define IS_CHANNEL(value)       is_obj_type(value, OBJ_CHANNEL)
 #define IS_CLASS(value)         is_obj_type(value, OBJ_CLASS)
 #define IS_CLOSURE(value)       is_obj_type(value, OBJ_CLOSURE)
+#define IS_FIBER(value)         is_obj_type(value, OBJ_FIBER)
+#define IS_FLOAT_ARRAY(value)   is_obj_type(value, OBJ_FLOAT_ARRAY)
 #define IS_FUNCTION(value)      is_obj_type(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)      is_obj_type(value, OBJ_INSTANCE)
+#define IS_LIST(value)          is_obj_type(value, OBJ_LIST)
+#define IS_MAP(value)           is_obj_type(value, OBJ_MAP)
 #define IS_NATIVE(value)        is_obj_type(value, OBJ_NATIVE)
 #define IS_STRING(value)        is_obj_type(value, OBJ_STRING)
 
 #define AS_BOUND_METHOD(value)  ((Obj_bound_method*)AS_OBJ(value))
+#define AS_CHANNEL(value)       ((Obj_channel*)AS_OBJ(value))
 #define AS_CLASS(value)         ((Obj_class*)AS_OBJ(value))
 #define AS_CLOSURE(value)       ((Obj_closure*)AS_OBJ(value))
+#define AS_FIBER(value)         ((Obj_fiber*)AS_OBJ(value))
+#define AS_FLOAT_ARRAY(value)   ((Obj_float_array*)AS_OBJ(value))
 #define AS_FUNCTION(value)      ((Obj_function*)AS_OBJ(value))
 #define AS_INSTANCE(value)      ((Obj_instance*)AS_OBJ(value))
-#define AS_NATIVE(value) \
-    (((Obj_native*)AS_OBJ(value))->function)
+#define AS_LIST(value)          ((Obj_list*)AS_OBJ(value))
+#define AS_MAP(value)           ((Obj_map*)AS_OBJ(value))
+#define AS_NATIVE(value)        ((Obj_native*)AS_OBJ(value))
 #define AS_STRING(value)        ((Obj_string*)AS_OBJ(value))
 #define AS_CSTRING(value)       (((Obj_string*)AS_OBJ(value))->chars)
 
 typedef enum {
     OBJ_BOUND_METHOD,
+    OBJ_CHANNEL,
     OBJ_CLASS,
     OBJ_CLOSURE,
+    OBJ_FIBER,
+    OBJ_FLOAT_ARRAY,
     OBJ_FUNCTION,
     OBJ_INSTANCE,
+    OBJ_LIST,
+    OBJ_MAP,
     OBJ_NATIVE,
     OBJ_STRING,
     OBJ_UPVALUE
@@ -40,6 +54,7 @@ typedef enum {
 struct Obj {
     Obj_type type;
     bool is_marked;
+    bool is_shared;     // Lives in a segment rather than a VM's heap.
     struct Obj* next;
 };
 
@@ -49,12 +64,27 @@ typedef struct {
     int upvalue_count;
     Chunk chunk;
     Obj_string* name;
+
+    // Mapped image the constants still have to be linked from, if any.
+    const uint8_t* image;
+    uint32_t image_index;
 } Obj_function;
 
-typedef Value (*Native_fn)(int arg_count, Value* args);
+// Natives store their result and return true, or report a runtime error
+// and return false.
+typedef bool (*Native_fn)(VM* vm, int arg_count, Value* args, Value* result);
+
+// Natives of this arity take any number of arguments and check them
+// themselves.
+#define NATIVE_VARIADIC -1
 
+// The name is the global a native was defined as, by which a snapshot
+// finds it again in another process. Calls with the wrong number of
+// arguments fail before the function is reached.
 typedef struct {
     Obj obj;
+    Obj_string* name;
+    int arity;
     Native_fn function;
 } Obj_native;
 
@@ -65,11 +95,13 @@ struct Obj_string {
     uint32_t hash;
 };
 
+// An open upvalue keeps the fiber whose stack it points into alive.
 typedef struct Obj_upvalue {
     Obj obj;
     Value* location;
     Value closed;
     struct Obj_upvalue* next;
+    struct Obj_fiber* fiber;    // NULL for the VM's own stack.
 } Obj_upvalue;
 
 typedef struct {
@@ -91,22 +123,98 @@ typedef struct {
     Table fields;
 } Obj_instance;
 
+typedef struct {
+    Obj_closure* closure;
+    uint8_t* ip;
+    Value* slots;
+} Call_frame;
+
+typedef enum {
+    FIBER_NEW,
+    FIBER_SUSPENDED,
+    FIBER_RUNNING,      // Running, or waiting on a fiber it resumed.
+    FIBER_DONE
+} Fiber_status;
+
+// A function running on call frames and a stack of its own, which it and
+// the VM trade on every switch. While the fiber runs, its fields hold the
+// stacks of the fiber that resumed it instead. A finished fiber has none.
+typedef struct Obj_fiber {
+    Obj obj;
+    Fiber_status status;
+    Obj_closure* closure;
+    struct Obj_fiber* caller;   // Fiber that resumed it, NULL for the VM.
+    int native_depth;           // Natives deep that resume() was called.
+
+    Call_frame* frames;
+    int frame_count;
+    int frame_capacity;
+    Value* stack;
+    Value* stack_top;
+    int stack_capacity;
+    Obj_upvalue* open_upvalues;
+} Obj_fiber;
+
 typedef struct {
     Obj obj;
     Value receiver;
     Obj_closure* method;
 } Obj_bound_method;
 
-Obj_bound_method* new_bound_method(Value receiver, Obj_closure* method);
-Obj_class* new_class(Obj_string* name);
-Obj_closure* new_closure(Obj_function* function);
-Obj_function* new_function();
-Obj_instance* new_instance(Obj_class* klass);
-Obj_native* new_native(Native_fn function);
-Obj_string* take_string(char* chars, int length);
-Obj_string* copy_string(const char* chars, int length);
-Obj_upvalue* new_upvalue(Value* slot);
-void print_object(Value value);
+typedef struct {
+    Obj obj;
+    Value_array items;
+} Obj_list;
+
+typedef struct {
+    Value key;
+    Value value;
+} Map_entry;
+
+// A hash table keyed by any value but NaN: strings by content, numbers and
+// the like by value, and other objects by identity.
+typedef struct {
+    Obj obj;
+    int count;          // Entries in use, tombstones included.
+    int live;           // Entries holding a key.
+    int capacity;
+    Map_entry* entries;
+} Obj_map;
+
+// A fixed length array of unboxed numbers, which the bulk natives work on
+// a vector at a time. A slice is a view onto part of another array's
+// values, and keeps the array that owns them alive.
+typedef struct Obj_float_array {
+    Obj obj;
+    int count;
+    double* values;
+    struct Obj_float_array* base;   // Owner of a view's values, or NULL.
+} Obj_float_array;
+
+// A VM's handle on a channel, which is shared by every VM holding one.
+typedef struct {
+    Obj obj;
+    struct Channel* channel;
+} Obj_channel;
+
+Obj_bound_method* new_bound_method(VM* vm, Value receiver, Obj_closure* method);
+Obj_channel* new_channel(VM* vm, struct Channel* channel);
+Obj_class* new_class(VM* vm, Obj_string* name);
+Obj_closure* new_closure(VM* vm, Obj_function* function);
+Obj_fiber* new_fiber(VM* vm, Obj_closure* closure);
+Obj_float_array* new_float_array(VM* vm, int count);
+Obj_float_array* new_float_view(VM* vm, Obj_float_array* array, int start,
+                                int count);
+Obj_function* new_function(VM* vm);
+Obj_instance* new_instance(VM* vm, Obj_class* klass);
+Obj_list* new_list(VM* vm);
+Obj_map* new_map(VM* vm);
+Obj_native* new_native(VM* vm, Obj_string* name, int arity,
+                       Native_fn function);
+Obj_string* take_string(VM* vm, char* chars, int length);
+Obj_string* copy_string(VM* vm, const char* chars, int length);
+Obj_upvalue* new_upvalue(VM* vm, Value* slot);
+void output_object(Output* output, Value value);
 
 static inline bool is_obj_type(Value value, Obj_type type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
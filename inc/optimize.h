@@ -0,0 +1,19 @@
+#ifndef __OPTIMIZE_H
+#define __OPTIMIZE_H
+
+#include "object.h"
+
+// Peephole rewrites, each of which can be turned on by itself.
+typedef enum {
+    PEEPHOLE_JUMPS = 1 << 0,        // Jumps to jumps and returns.
+    PEEPHOLE_NOT_JUMP = 1 << 1,     // OP_NOT before a conditional jump.
+    PEEPHOLE_PUSH_POP = 1 << 2,     // Pure pushes that are popped.
+    PEEPHOLE_LOCALS = 1 << 3,       // Redundant local loads and stores.
+    PEEPHOLE_ALL = (1 << 4) - 1
+} Peephole_rewrite;
+
+void optimize_function(VM* vm, Obj_function* function);
+void peephole_function(VM* vm, Obj_function* function, int rewrites);
+void inline_functions(VM* vm, Obj_function* script);
+
+#endif // __OPTIMIZE_H
@@ -0,0 +1,38 @@
+#ifndef __OUTPUT_H
+#define __OUTPUT_H
+
+#include "common.h"
+
+#define OUTPUT_DEFAULT_CAPACITY 8192
+
+// When buffered output goes out to stdout, besides whenever the buffer
+// fills up or is flushed by hand.
+typedef enum {
+    FLUSH_LINE,     // At the end of every print.
+    FLUSH_FULL      // Only then.
+} Flush_mode;
+
+// What a VM prints collects here and reaches stdout in one write per
+// flush. Anything else printed to stdout has to flush it first to come
+// out in order.
+typedef struct {
+    char* chars;
+    int count;
+    int capacity;
+    Flush_mode mode;
+} Output;
+
+// Line flushing when stdout is a terminal and full buffering otherwise,
+// as stdio does.
+void init_output(Output* output);
+void free_output(Output* output);
+// Flushes what is there and switches to a buffer of the given size.
+void set_output(Output* output, int capacity, Flush_mode mode);
+void flush_output(Output* output);
+void write_chars(Output* output, const char* chars, int length);
+void write_string(Output* output, const char* string);
+void write_number(Output* output, double value);
+// Ends a print, flushing it when lines are.
+void end_line(Output* output);
+
+#endif // __OUTPUT_H
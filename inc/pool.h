@@ -0,0 +1,22 @@
+#ifndef __POOL_H
+#define __POOL_H
+
+#include "common.h"
+#include "message.h"
+
+// A channel is a queue of messages shared by any number of VMs, which
+// may run on different threads. It lives as long as some VM or message
+// still holds it.
+typedef struct Channel Channel;
+
+Channel* create_channel(void);
+void retain_channel(Channel* channel);
+void release_channel(Channel* channel);
+void channel_send(Channel* channel, Message* message);
+bool channel_receive(Channel* channel, Message* message);
+
+void set_pool_size(int threads);
+void define_pool_natives(VM* vm);
+void finish_pool(void);
+
+#endif // __POOL_H
@@ -0,0 +1,33 @@
+#ifndef __PROFILE_H
+#define __PROFILE_H
+
+#include <signal.h>
+
+#include "common.h"
+
+#define PROFILE_DEFAULT_RATE 100
+
+// Set once the samples waiting in the ring buffer need moving out.
+extern volatile sig_atomic_t profile_pending;
+
+// Where the VM drains samples while it runs, besides every collection.
+#define PROFILE_CHECKPOINT() \
+    do { \
+        if (profile_pending) \
+            drain_profile(); \
+    } while (false)
+
+// Samples the VM's call stack `rate` times a second of CPU time, from a
+// SIGPROF handler on the calling thread, until finish_profile() writes
+// the report to path. Fails when a profile is already being taken.
+bool start_profile(VM* vm, const char* path, int rate);
+// Moves samples out of the ring buffer while the functions in them are
+// all still alive, which a collection has to do before it sweeps. Does
+// nothing on any other thread or when no profile is being taken.
+void drain_profile(void);
+// Stops sampling and writes collapsed stacks, one per line with its count
+// as flamegraph.pl reads them, to the path and hits per line to the path
+// with ".lines" added. Says so and fails when they can't be written.
+bool finish_profile(void);
+
+#endif // __PROFILE_H
@@ -5,6 +5,7 @@ typedef enum {
     // Single-character tokens.
     TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
     TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
+    TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
     TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
     TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
 
@@ -34,7 +35,13 @@ typedef struct {
     int line;
 } Token;
 
-void init_scanner(const char* source);
-Token scan_token();
+typedef struct {
+    const char* start;
+    const char* current;
+    int line;
+} Scanner;
+
+void init_scanner(Scanner* scanner, const char* source);
+Token scan_token(Scanner* scanner);
 
 #endif // __SCANNER_H
@@ -0,0 +1,19 @@
+#ifndef __SEGMENT_H
+#define __SEGMENT_H
+
+#include "common.h"
+#include "object.h"
+
+// A compiled program moved out of the heap that compiled it: its functions
+// and the strings they use. Nothing in a segment changes once it is made,
+// so any number of VMs on any threads run straight out of it. No collector
+// marks or frees it; it lives until the last VM or message holding it lets
+// go.
+typedef struct Segment Segment;
+
+Segment* share_function(VM* vm, Obj_function* function);
+void retain_segment(Segment* segment);
+void release_segment(Segment* segment);
+void intern_segment(VM* vm, Segment* segment);
+
+#endif // __SEGMENT_H
@@ -0,0 +1,12 @@
+#ifndef __SERVER_H
+#define __SERVER_H
+
+#include "common.h"
+
+// Serves requests on a Unix socket from worker processes forked off a VM
+// that has already run its script. Each line a client sends is passed to
+// the handler, a global function taking the line as a string, and the
+// string it returns is sent back as a line of its own.
+bool serve(VM* vm, const char* path, int workers, const char* handler);
+
+#endif // __SERVER_H
@@ -0,0 +1,12 @@
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+#include "common.h"
+
+// A snapshot saves everything a program has built up in its globals, so
+// that later runs can start from that heap instead of running the program
+// again.
+bool write_snapshot(VM* vm, const char* path);
+bool read_snapshot(VM* vm, const char* path);
+
+#endif // __SNAPSHOT_H
@@ -0,0 +1,8 @@
+#ifndef __TIMING_H
+#define __TIMING_H
+
+#include "common.h"
+
+void define_timing_natives(VM* vm);
+
+#endif // __TIMING_H
@@ -2,6 +2,7 @@
 #define __VALUE_H
 
 #include "common.h"
+#include "output.h"
 
 typedef struct Obj Obj;
 typedef struct Obj_string Obj_string;
@@ -44,8 +45,9 @@ typedef struct {
 
 bool values_equal(Value a, Value b);
 void init_value_array(Value_array* array);
-void write_value_array(Value_array* array, Value value);
-void free_value_array(Value_array* array);
+void write_value_array(VM* vm, Value_array* array, Value value);
+void free_value_array(VM* vm, Value_array* array);
+void output_value(Output* output, Value value);
 void print_value(Value value);
 
 #endif // __VALUE_H
@@ -1,39 +1,74 @@
 #ifndef __VM_H
 #define __VM_H
 
+#include "image.h"
+#include "intern.h"
 #include "object.h"
+#include "output.h"
 #include "table.h"
 #include "value.h"
 
+// The stacks start small and grow as needed, up to vm->max_frames frames.
 #define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+#define FRAMES_INITIAL 8
+#define STACK_INITIAL UINT8_COUNT
 
-typedef struct {
-    Obj_closure* closure;
-    uint8_t* ip;
-    Value* slots;
-} Call_frame;
+// Fibers start smaller still, since there may be a great many of them.
+#define FIBER_FRAMES_INITIAL 4
+#define FIBER_STACK_INITIAL 32
 
-typedef struct {
-    Call_frame frames[FRAMES_MAX];
+// Slots free above a native's arguments when it is called. It can push
+// that many values to keep them from being collected without moving the
+// arguments.
+#define NATIVE_STACK_SLOTS 8
+
+struct VM {
+    Call_frame* frames;
     int frame_count;
+    int frame_capacity;
+    int max_frames;
 
-    Value stack[STACK_MAX];
+    Value* stack;
     Value* stack_top;
-    Table strings;
+    int stack_capacity;
+    Intern_set strings;
     Table globals;
+    Output output;      // Where print goes.
 
     Obj_string* init_string;
     Obj_upvalue* open_upvalues;
 
+    // Fiber whose stacks the VM is running on, or NULL for its own, and
+    // how many native calls deep it is.
+    Obj_fiber* fiber;
+    int native_depth;
+
+    // Tasks, timers and descriptors being waited on, once a script uses
+    // them.
+    struct Event_loop* loop;
+
     size_t bytes_allocated;
     size_t next_GC;
 
     Obj* objects;
+    Obj* frozen;        // Objects no collection frees or writes to.
+    Mapped_image* images;
+    struct Segment* segment;
     int gray_count;
     int gray_capacity;
     Obj** gray_stack;
-} VM;
+
+    bool optimize;      // Run compiled functions through the optimizer.
+    int peephole;       // Peephole rewrites to apply to compiled functions.
+    // Set when nothing but the next script compiled can rebind the globals
+    // it declares: no other script, snapshot or host. The optimizer then
+    // inlines calls to them, and an inlined call keeps the body it was
+    // compiled with whatever the global later holds.
+    bool inline_globals;
+
+    // Innermost function being compiled, whose chain is kept alive.
+    struct Compiler* compiler;
+};
 
 typedef enum {
     INTERPRET_OK,
@@ -41,12 +76,38 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR
 } Interpret_result;
 
-extern VM vm;
+void init_VM(VM* vm);
+void init_shared_VM(VM* vm, struct Segment* segment);
+void free_VM(VM* vm);
+Interpret_result interpret(VM* vm, const char* source);
+Interpret_result interpret_function(VM* vm, Obj_function* function);
 
-void init_VM();
-void free_VM();
-Interpret_result interpret(const char* source);
-void push(Value value);
-Value pop();
+// Embedding. A host runs its script once, looks up the functions it wants
+// with get_global() and then calls them as often as it likes without
+// compiling anything again: push the function and its arguments, call
+// interpret_call() and pop the result. Values the host holds on to between
+// calls have to stay reachable from the stack or a global. After a runtime
+// error the stack is empty.
+bool get_global(VM* vm, const char* name, Value* value);
+void set_global(VM* vm, const char* name, Value value);
+// Calls the value below the top arg_count values on the stack with them as
+// arguments and runs it to completion, leaving the result in their place.
+// Natives call back into Lox the same way, but a call can grow the stack
+// and move their arguments, so they read them first. A native that gets a
+// runtime error back returns false straight away.
+Interpret_result interpret_call(VM* vm, int arg_count);
+// Runs a fiber as resume() does, until it yields or returns, and leaves
+// what it yielded or returned on top of the stack.
+Interpret_result resume_fiber(VM* vm, Obj_fiber* fiber, Value value);
+// Suspends the running fiber from inside a native, as yield() does,
+// handing the value to whatever resumed it. The native returns true
+// straight after. Fails with a runtime error outside a fiber or in a
+// native's callback.
+bool yield_fiber(VM* vm, int arg_count, Value value);
+void define_native(VM* vm, const char* name, int arity,
+                   Native_fn function);
+void runtime_error(VM* vm, const char* format, ...);
+void push(VM* vm, Value value);
+Value pop(VM* vm);
 
 #endif // __VM_H
@@ -2,6 +2,7 @@
 
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "vm.h"
 
 void init_chunk(Chunk *chunk) {
@@ -12,13 +13,13 @@ void init_chunk(Chunk *chunk) {
     init_value_array(&chunk->constants);
 }
 
-void write_chunk(Chunk *chunk, uint8_t byte, int line) {
+void write_chunk(VM* vm, Chunk *chunk, uint8_t byte, int line) {
     if (chunk->capacity < chunk->count + 1) {
         int old_capacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(old_capacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, old_capacity,
+        chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code, old_capacity,
                                  chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, old_capacity,
+        chunk->lines = GROW_ARRAY(vm, int, chunk->lines, old_capacity,
                                   chunk->capacity);
     }
 
@@ -27,16 +28,147 @@ void write_chunk(Chunk *chunk, uint8_t byte, int line) {
     chunk->count++;
 }
 
-void free_chunk(Chunk *chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
-    free_value_array(&chunk->constants);
+void free_chunk(VM* vm, Chunk *chunk) {
+    if (chunk->capacity > 0) {
+        FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(vm, int, chunk->lines, chunk->capacity);
+    }
+    free_value_array(vm, &chunk->constants);
     init_chunk(chunk);
 }
 
-int add_constant(Chunk *chunk, Value value) {
-    push(value);
-    write_value_array(&chunk->constants, value);
-    pop();
+int add_constant(VM* vm, Chunk *chunk, Value value) {
+    push(vm, value);
+    write_value_array(vm, &chunk->constants, value);
+    pop(vm);
     return chunk->constants.count - 1;
 }
+
+// Length of the instruction with its operands, or 0 if it doesn't have a
+// fixed one.
+int fixed_instruction_length(uint8_t instruction) {
+    switch (instruction) {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_POP:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+    case OP_GET_INDEX:
+    case OP_SET_INDEX:
+        return 1;
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_BUILD_LIST:
+        return 2;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+    case OP_LOOP:
+    case OP_INVOKE:
+    case OP_TAIL_INVOKE:
+        return 3;
+    default:
+        return 0;
+    }
+}
+
+int instruction_length(Chunk* chunk, int offset) {
+    if (chunk->code[offset] == OP_CLOSURE) {
+        Obj_function* function
+                = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+        return 2 + 2 * function->upvalue_count;
+    }
+
+    return fixed_instruction_length(chunk->code[offset]);
+}
+
+// How many values the instruction at the start of the code pops and
+// pushes.
+void stack_effect(const uint8_t* code, int* pops, int* pushes) {
+    *pops = 0;
+    *pushes = 0;
+
+    switch (code[0]) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_CLOSURE:
+    case OP_CLASS:
+        *pushes = 1;
+        break;
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_METHOD:
+    case OP_RETURN:
+        *pops = 1;
+        break;
+    case OP_GET_PROPERTY:
+    case OP_NOT:
+    case OP_NEGATE:
+        *pops = 1;
+        *pushes = 1;
+        break;
+    case OP_SET_PROPERTY:
+    case OP_GET_INDEX:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+        *pops = 2;
+        *pushes = 1;
+        break;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+        *pops = code[1] + 1;
+        *pushes = 1;
+        break;
+    case OP_INVOKE:
+    case OP_TAIL_INVOKE:
+        *pops = code[2] + 1;
+        *pushes = 1;
+        break;
+    case OP_SET_INDEX:
+        *pops = 3;
+        *pushes = 1;
+        break;
+    case OP_BUILD_LIST:
+        *pops = code[1];
+        *pushes = 1;
+        break;
+    default:
+        // Stores, jumps and upvalue writes leave the stack alone.
+        break;
+    }
+}
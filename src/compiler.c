@@ -5,17 +5,25 @@
 #include "common.h"
 #include "compiler.h"
 #include "memory.h"
+#include "number.h"
+#include "optimize.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
+// Everything about one compilation, so that any number can run at once.
 typedef struct {
+    VM* vm;
+    Scanner scanner;
     Token current;
     Token previous;
     bool had_error;
     bool panic_mode;
+
+    struct Compiler* compiler;
+    struct Class_compiler* class_compiler;
 } Parser;
 
 typedef enum {
@@ -32,7 +40,7 @@ typedef enum {
     PREC_PRIMARY
 } Precedence;
 
-typedef void (*Parse_fn)(bool can_assign);
+typedef void (*Parse_fn)(Parser* parser, bool can_assign);
 
 typedef struct {
     Parse_fn prefix;
@@ -67,6 +75,11 @@ struct Compiler {
     int local_count;
     Upvalue upvalues[UINT8_COUNT];
     int scope_depth;
+
+    // Where the left operand of the infix expression being compiled starts.
+    int operand_start;
+    // Where the last OP_CALL or OP_INVOKE was emitted, -1 if none.
+    int last_call;
 };
 typedef struct Compiler Compiler;
 
@@ -76,22 +89,14 @@ struct Class_compiler {
 };
 typedef struct Class_compiler Class_compiler;
 
-Parser parser;
-
-Compiler* current = NULL;
-
-Class_compiler* current_class = NULL;
-
-Chunk* compiling_chunk;
-
-static Chunk* current_chunk() {
-    return &current->function->chunk;
+static Chunk* current_chunk(Parser* parser) {
+    return &parser->compiler->function->chunk;
 }
 
-static void error_at(Token* token, const char* message) {
-    if (parser.panic_mode)
+static void error_at(Parser* parser, Token* token, const char* message) {
+    if (parser->panic_mode)
         return;
-    parser.panic_mode = true;
+    parser->panic_mode = true;
 
     fprintf(stderr, "[line %d] Error", token->line);
 
@@ -103,123 +108,180 @@ static void error_at(Token* token, const char* message) {
         fprintf(stderr, " at '%.*s'", token->length, token->start);
 
     fprintf(stderr, ": %s\n", message);
-    parser.had_error = true;
+    parser->had_error = true;
 }
 
-static void error(const char* message) {
-    error_at(&parser.previous, message);
+static void error(Parser* parser, const char* message) {
+    error_at(parser, &parser->previous, message);
 }
 
-static void error_at_current(const char* message) {
-    error_at(&parser.current, message);
+static void error_at_current(Parser* parser, const char* message) {
+    error_at(parser, &parser->current, message);
 }
 
-static void advance() {
-    parser.previous = parser.current;
+static void advance(Parser* parser) {
+    parser->previous = parser->current;
 
     for (;;) {
-        parser.current = scan_token();
-        if (parser.current.type != TOKEN_ERROR)
+        parser->current = scan_token(&parser->scanner);
+        if (parser->current.type != TOKEN_ERROR)
             break;
 
-        error_at_current(parser.current.start);
+        error_at_current(parser, parser->current.start);
     }
 }
 
-static void consume(Token_type type, const char* message) {
-    if (parser.current.type == type) {
-        advance();
+static void consume(Parser* parser, Token_type type, const char* message) {
+    if (parser->current.type == type) {
+        advance(parser);
         return;
     }
 
-    error_at_current(message);
+    error_at_current(parser, message);
 }
 
-static bool check(Token_type type) {
-    return parser.current.type == type;
+static bool check(Parser* parser, Token_type type) {
+    return parser->current.type == type;
 }
 
-static bool match(Token_type type) {
-    if (!check(type))
+static bool match(Parser* parser, Token_type type) {
+    if (!check(parser, type))
         return false;
-    advance();
+    advance(parser);
     return true;
 }
 
-static void emit_byte(uint8_t byte) {
-    write_chunk(current_chunk(), byte, parser.previous.line);
+static void emit_byte(Parser* parser, uint8_t byte) {
+    write_chunk(parser->vm, current_chunk(parser), byte, parser->previous.line);
 }
 
-static void emit_bytes(uint8_t byte_1, uint8_t byte_2) {
-    emit_byte(byte_1);
-    emit_byte(byte_2);
+static void emit_bytes(Parser* parser, uint8_t byte_1, uint8_t byte_2) {
+    emit_byte(parser, byte_1);
+    emit_byte(parser, byte_2);
 }
 
-static void emit_loop(int loop_start) {
-    emit_byte(OP_LOOP);
+static void emit_loop(Parser* parser, int loop_start) {
+    emit_byte(parser, OP_LOOP);
 
-    int offset = current_chunk()->count - loop_start + 2;
+    int offset = current_chunk(parser)->count - loop_start + 2;
     if (offset > UINT16_MAX)
-        error("Loop body too large!");
+        error(parser, "Loop body too large!");
 
-    emit_byte((offset >> 8) & 0xff);
-    emit_byte(offset & 0xff);
+    emit_byte(parser, (offset >> 8) & 0xff);
+    emit_byte(parser, offset & 0xff);
 }
 
-static int emit_jump(uint8_t instruction) {
-    emit_byte(instruction);
-    emit_byte(0xFF);
-    emit_byte(0xFF);
-    return current_chunk()->count - 2;
+static int emit_jump(Parser* parser, uint8_t instruction) {
+    emit_byte(parser, instruction);
+    emit_byte(parser, 0xFF);
+    emit_byte(parser, 0xFF);
+    return current_chunk(parser)->count - 2;
 }
 
-static void emit_return() {
-    if (current->type == TYPE_INITIALIZER)
-        emit_bytes(OP_GET_LOCAL, 0);
+static void emit_return(Parser* parser) {
+    if (parser->compiler->type == TYPE_INITIALIZER)
+        emit_bytes(parser, OP_GET_LOCAL, 0);
     else
-        emit_byte(OP_NIL);
-    emit_byte(OP_RETURN);
+        emit_byte(parser, OP_NIL);
+    emit_byte(parser, OP_RETURN);
 }
 
-static uint8_t make_constant(Value value) {
-    int constant = add_constant(current_chunk(), value);
+static uint8_t make_constant(Parser* parser, Value value) {
+    int constant = add_constant(parser->vm, current_chunk(parser), value);
     if (constant > UINT8_MAX) {
-        error("Too many constants in one chunk!");
+        error(parser, "Too many constants in one chunk!");
         return 0;
     }
 
     return (uint8_t)constant;
 }
 
-static void emit_constant(Value value) {
-    emit_bytes(OP_CONSTANT, make_constant(value));
+static void emit_constant(Parser* parser, Value value) {
+    emit_bytes(parser, OP_CONSTANT, make_constant(parser, value));
 }
 
-static void patch_jump(int offset) {
+static void patch_jump(Parser* parser, int offset) {
     // -2 to adjust for the bytecode for the jump offset itself.
-    int jump = current_chunk()->count - offset - 2;
+    int jump = current_chunk(parser)->count - offset - 2;
 
     if (jump > UINT16_MAX)
-        error("Too much code to jump over!");
+        error(parser, "Too much code to jump over!");
+
+    current_chunk(parser)->code[offset] = (jump >> 8) & 0xff;
+    current_chunk(parser)->code[offset + 1] = jump & 0xff;
+}
+
+static void emit_value(Parser* parser, Value value) {
+    if (IS_NIL(value))
+        emit_byte(parser, OP_NIL);
+    else if (IS_BOOL(value))
+        emit_byte(parser, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    else
+        emit_constant(parser, value);
+}
+
+// Checks whether the code from start to the end of the chunk is a single
+// instruction pushing a constant, and decodes it.
+static bool constant_operand(Parser* parser, int start, int end, Value* value) {
+    Chunk* chunk = current_chunk(parser);
+
+    if (end - start == 1) {
+        switch (chunk->code[start]) {
+        case OP_NIL:
+            *value = NIL_VAL;
+            return true;
+        case OP_TRUE:
+            *value = BOOL_VAL(true);
+            return true;
+        case OP_FALSE:
+            *value = BOOL_VAL(false);
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    if (end - start == 2 && chunk->code[start] == OP_CONSTANT) {
+        *value = chunk->constants.values[chunk->code[start + 1]];
+        return true;
+    }
+
+    return false;
+}
+
+// Removes the constant operand at the end of the chunk. Every OP_CONSTANT
+// gets its own constant, so if it was the last one added it can go too.
+static void remove_operand(Parser* parser, int start) {
+    Chunk* chunk = current_chunk(parser);
+    if (chunk->code[start] == OP_CONSTANT
+        && chunk->code[start + 1] == chunk->constants.count - 1)
+        chunk->constants.count--;
+    chunk->count = start;
+}
 
-    current_chunk()->code[offset] = (jump >> 8) & 0xff;
-    current_chunk()->code[offset + 1] = jump & 0xff;
+static bool is_falsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void init_compiler(Compiler* compiler, Function_type type) {
-    compiler->enclosing = current;
+static void init_compiler(Parser* parser, Compiler* compiler,
+                          Function_type type) {
+    compiler->enclosing = parser->compiler;
     compiler->function = NULL;
     compiler->type = type;
     compiler->local_count = 0;
     compiler->scope_depth = 0;
-    compiler->function = new_function();
-    current = compiler;
+    compiler->operand_start = 0;
+    compiler->last_call = -1;
+    compiler->function = new_function(parser->vm);
+    parser->compiler = compiler;
+    parser->vm->compiler = compiler;
 
     if (type != TYPE_SCRIPT)
-        current->function->name = copy_string(parser.previous.start,
-                                              parser.previous.length);
+        parser->compiler->function->name = copy_string(parser->vm,
+                                                       parser->previous.start,
+                                                       parser->previous.length);
 
-    Local* local = &current->locals[current->local_count++];
+    Local* local = &parser->compiler->locals[parser->compiler->local_count++];
     local->depth = 0;
     local->is_captured = false;
     if (type != TYPE_FUNCTION) {
@@ -231,48 +293,55 @@ static void init_compiler(Compiler* compiler, Function_type type) {
     }
 }
 
-static Obj_function* end_compiler() {
-    emit_return();
-    Obj_function* function = current->function;
+static Obj_function* end_compiler(Parser* parser) {
+    emit_return(parser);
+    Obj_function* function = parser->compiler->function;
+    if (parser->vm->optimize && !parser->had_error)
+        optimize_function(parser->vm, function);
+    if (parser->vm->peephole != 0 && !parser->had_error)
+        peephole_function(parser->vm, function, parser->vm->peephole);
+
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.had_error)
-        disassemble_chunk(current_chunk(),
+    if (!parser->had_error)
+        disassemble_chunk(current_chunk(parser),
                           function->name != NULL
                               ? function->name->chars
                               : "<script>");
 #endif
 
-    current = current->enclosing;
+    parser->compiler = parser->compiler->enclosing;
+    parser->vm->compiler = parser->compiler;
     return function;
 }
 
-static void begin_scope() {
-    current->scope_depth++;
+static void begin_scope(Parser* parser) {
+    parser->compiler->scope_depth++;
 }
 
-static void end_scope() {
-    current->scope_depth--;
+static void end_scope(Parser* parser) {
+    Compiler* compiler = parser->compiler;
+    compiler->scope_depth--;
 
-    while (current->local_count > 0
-           && current->locals[current->local_count - 1].depth
-              > current->scope_depth) {
-        if (current->locals[current->local_count - 1].is_captured)
-            emit_byte(OP_CLOSE_UPVALUE);
+    while (compiler->local_count > 0
+           && compiler->locals[compiler->local_count - 1].depth
+              > compiler->scope_depth) {
+        if (compiler->locals[compiler->local_count - 1].is_captured)
+            emit_byte(parser, OP_CLOSE_UPVALUE);
         else
-            emit_byte(OP_POP);
-        current->local_count--;
+            emit_byte(parser, OP_POP);
+        compiler->local_count--;
     }
 }
 
-static void expression();
-static void statement();
-static void declaration();
+static void expression(Parser* parser);
+static void statement(Parser* parser);
+static void declaration(Parser* parser);
 static Parse_rule* get_rule(Token_type type);
-static void parse_precedence(Precedence precedence);
+static void parse_precedence(Parser* parser, Precedence precedence);
 
-static uint8_t identifier_constant(Token* name) {
-    return make_constant(OBJ_VAL(copy_string(name->start,
-                                             name->length)));
+static uint8_t identifier_constant(Parser* parser, Token* name) {
+    return make_constant(parser, OBJ_VAL(copy_string(parser->vm, name->start,
+                                                     name->length)));
 }
 
 static bool identifiers_equal(Token* a, Token* b) {
@@ -282,12 +351,13 @@ static bool identifiers_equal(Token* a, Token* b) {
     return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static int resolve_local(Compiler* compiler, Token* name) {
+static int resolve_local(Parser* parser, Compiler* compiler, Token* name) {
     for (int i = compiler->local_count - 1; i >= 0; i--) {
         Local* local = &compiler->locals[i];
         if (identifiers_equal(name, &local->name)) {
             if (local->depth == -1)
-                error("Can't read local variable in its own initializer!");
+                error(parser,
+                      "Can't read local variable in its own initializer!");
             return i;
         }
     }
@@ -295,7 +365,8 @@ static int resolve_local(Compiler* compiler, Token* name) {
     return -1;
 }
 
-static int add_upvalue(Compiler* compiler, uint8_t index, bool is_local) {
+static int add_upvalue(Parser* parser, Compiler* compiler, uint8_t index,
+                       bool is_local) {
     int upvalue_count = compiler->function->upvalue_count;
 
     for (int i = 0; i < upvalue_count; i++) {
@@ -305,7 +376,7 @@ static int add_upvalue(Compiler* compiler, uint8_t index, bool is_local) {
     }
 
     if (upvalue_count == UINT8_COUNT) {
-        error("Too many closure variables in function!");
+        error(parser, "Too many closure variables in function!");
         return 0;
     }
 
@@ -314,255 +385,398 @@ static int add_upvalue(Compiler* compiler, uint8_t index, bool is_local) {
     return compiler->function->upvalue_count++;
 }
 
-static int resolve_upvalue(Compiler* compiler, Token* name) {
+static int resolve_upvalue(Parser* parser, Compiler* compiler, Token* name) {
     if (compiler->enclosing == NULL)
         return -1;
 
-    int local = resolve_local(compiler->enclosing, name);
+    int local = resolve_local(parser, compiler->enclosing, name);
     if (local != -1) {
         compiler->enclosing->locals[local].is_captured = true;
-        return add_upvalue(compiler, (uint8_t)local, true);
+        return add_upvalue(parser, compiler, (uint8_t)local, true);
     }
 
-    int upvalue = resolve_upvalue(compiler->enclosing, name);
+    int upvalue = resolve_upvalue(parser, compiler->enclosing, name);
     if (upvalue != -1)
-        return add_upvalue(compiler, (uint8_t)upvalue, false);
+        return add_upvalue(parser, compiler, (uint8_t)upvalue, false);
 
     return -1;
 }
 
-static void add_local(Token name) {
-    if (current->local_count == UINT8_COUNT) {
-        error("Too many local variables in function!");
+static void add_local(Parser* parser, Token name) {
+    if (parser->compiler->local_count == UINT8_COUNT) {
+        error(parser, "Too many local variables in function!");
         return;
     }
 
-    Local* local = &current->locals[current->local_count++];
+    Local* local = &parser->compiler->locals[parser->compiler->local_count++];
     local->name = name;
     local->depth = -1;
     local->is_captured = false;
 }
 
-static void declare_variable() {
+static void declare_variable(Parser* parser) {
     // Global variables are implicitly declared.
-    if (current->scope_depth == 0)
+    if (parser->compiler->scope_depth == 0)
         return;
 
-    Token* name = &parser.previous;
-    for (int i = current->local_count - 1; i >= 0; i--) {
-        Local* local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scope_depth)
+    Token* name = &parser->previous;
+    for (int i = parser->compiler->local_count - 1; i >= 0; i--) {
+        Local* local = &parser->compiler->locals[i];
+        if (local->depth != -1 && local->depth < parser->compiler->scope_depth)
             break;
 
         if (identifiers_equal(name, &local->name))
-            error("Already variable with this name in this scope!");
+            error(parser, "Already variable with this name in this scope!");
     }
-    add_local(*name);
+    add_local(parser, *name);
 }
 
-static uint8_t parse_variable(const char* error_message) {
-    consume(TOKEN_IDENTIFIER, error_message);
+static uint8_t parse_variable(Parser* parser, const char* error_message) {
+    consume(parser, TOKEN_IDENTIFIER, error_message);
 
-    declare_variable();
-    if (current->scope_depth > 0)
+    declare_variable(parser);
+    if (parser->compiler->scope_depth > 0)
         return 0;
 
-    return identifier_constant(&parser.previous);
+    return identifier_constant(parser, &parser->previous);
 }
 
-static void mark_initialized() {
-    if (current->scope_depth == 0)
+static void mark_initialized(Parser* parser) {
+    if (parser->compiler->scope_depth == 0)
         return;
-    current->locals[current->local_count - 1].depth = current->scope_depth;
+    Compiler* compiler = parser->compiler;
+    compiler->locals[compiler->local_count - 1].depth = compiler->scope_depth;
 }
 
-static void define_variable(uint8_t global) {
-    if (current->scope_depth > 0) {
-        mark_initialized();
+static void define_variable(Parser* parser, uint8_t global) {
+    if (parser->compiler->scope_depth > 0) {
+        mark_initialized(parser);
         return;
     }
 
-    emit_bytes(OP_DEFINE_GLOBAL, global);
+    emit_bytes(parser, OP_DEFINE_GLOBAL, global);
 }
 
-static uint8_t argument_list() {
+static uint8_t argument_list(Parser* parser) {
     uint8_t arg_count = 0;
-    if (!check(TOKEN_RIGHT_PAREN)) {
+    if (!check(parser, TOKEN_RIGHT_PAREN)) {
         do {
-            expression();
+            expression(parser);
             if (arg_count == 255)
-                error("Can't have more than 255 arguments!");
+                error(parser, "Can't have more than 255 arguments!");
             arg_count++;
-        } while (match(TOKEN_COMMA));
+        } while (match(parser, TOKEN_COMMA));
     }
 
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments!");
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments!");
     return arg_count;
 }
 
-static void and_(bool can_assign) {
-    int end_jump = emit_jump(OP_JUMP_IF_FALSE);
+static void and_(Parser* parser, bool can_assign) {
+    int end_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+
+    emit_byte(parser, OP_POP);
+    parse_precedence(parser, PREC_AND);
+
+    patch_jump(parser, end_jump);
+}
+
+// Evaluates the operator at compile time if both operands are constants
+// and it can't fail. Anything that would be a runtime error is left alone.
+static bool fold_binary(Parser* parser, Token_type operator_type,
+                        int left_start, int right_start) {
+    Value a, b;
+    if (!constant_operand(parser, left_start, right_start, &a)
+        || !constant_operand(parser, right_start, current_chunk(parser)->count,
+                             &b))
+        return false;
 
-    emit_byte(OP_POP);
-    parse_precedence(PREC_AND);
+    Value result;
+    switch (operator_type) {
+    case TOKEN_BANG_EQUAL:
+        result = BOOL_VAL(!values_equal(a, b));
+        break;
+    case TOKEN_EQUAL_EQUAL:
+        result = BOOL_VAL(values_equal(a, b));
+        break;
+    case TOKEN_PLUS:
+        if (IS_STRING(a) && IS_STRING(b)) {
+            Obj_string* left = AS_STRING(a);
+            Obj_string* right = AS_STRING(b);
+            int length = left->length + right->length;
+            char* chars = ALLOCATE(parser->vm, char, length + 1);
+            memcpy(chars, left->chars, left->length);
+            memcpy(chars + left->length, right->chars, right->length);
+            chars[length] = '\0';
+            result = OBJ_VAL(take_string(parser->vm, chars, length));
+            break;
+        }
+        if (!IS_NUMBER(a) || !IS_NUMBER(b))
+            return false;
+        result = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+        break;
+    default:
+    {
+        if (!IS_NUMBER(a) || !IS_NUMBER(b))
+            return false;
+
+        // Mirrors the instructions the operator would compile to.
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        switch (operator_type) {
+        case TOKEN_GREATER:
+            result = BOOL_VAL(x > y);
+            break;
+        case TOKEN_GREATER_EQUAL:
+            result = BOOL_VAL(!(x < y));
+            break;
+        case TOKEN_LESS:
+            result = BOOL_VAL(x < y);
+            break;
+        case TOKEN_LESS_EQUAL:
+            result = BOOL_VAL(!(x > y));
+            break;
+        case TOKEN_MINUS:
+            result = NUMBER_VAL(x - y);
+            break;
+        case TOKEN_STAR:
+            result = NUMBER_VAL(x * y);
+            break;
+        case TOKEN_SLASH:
+            result = NUMBER_VAL(x / y);
+            break;
+        default:
+            return false; // Unreachable.
+        }
+    }
+    }
 
-    patch_jump(end_jump);
+    remove_operand(parser, right_start);
+    remove_operand(parser, left_start);
+    emit_value(parser, result);
+    return true;
 }
 
-static void binary(bool can_assign) {
-    // Remember the operator.
-    Token_type operator_type = parser.previous.type;
+static void binary(Parser* parser, bool can_assign) {
+    // Remember the operator and where its left operand starts.
+    Token_type operator_type = parser->previous.type;
+    int left_start = parser->compiler->operand_start;
 
     // Compiler the right operand.
     Parse_rule* rule = get_rule(operator_type);
-    parse_precedence((Precedence)(rule->precedence + 1));
+    int right_start = current_chunk(parser)->count;
+    parse_precedence(parser, (Precedence)(rule->precedence + 1));
+
+    if (fold_binary(parser, operator_type, left_start, right_start))
+        return;
 
     // Emit the operator instruction.
     switch (operator_type) {
     case TOKEN_BANG_EQUAL:
-        emit_bytes(OP_EQUAL, OP_NOT);
+        emit_bytes(parser, OP_EQUAL, OP_NOT);
         break;
     case TOKEN_EQUAL_EQUAL:
-        emit_byte(OP_EQUAL);
+        emit_byte(parser, OP_EQUAL);
         break;
     case TOKEN_GREATER:
-        emit_byte(OP_GREATER);
+        emit_byte(parser, OP_GREATER);
         break;
     case TOKEN_GREATER_EQUAL:
-        emit_bytes(OP_LESS, OP_NOT);
+        emit_bytes(parser, OP_LESS, OP_NOT);
         break;
     case TOKEN_LESS:
-        emit_byte(OP_LESS);
+        emit_byte(parser, OP_LESS);
         break;
     case TOKEN_LESS_EQUAL:
-        emit_bytes(OP_GREATER, OP_NOT);
+        emit_bytes(parser, OP_GREATER, OP_NOT);
         break;
     case TOKEN_PLUS:
-        emit_byte(OP_ADD);
+        emit_byte(parser, OP_ADD);
         break;
     case TOKEN_MINUS:
-        emit_byte(OP_SUBTRACT);
+        emit_byte(parser, OP_SUBTRACT);
         break;
     case TOKEN_STAR:
-        emit_byte(OP_MULTIPLY);
+        emit_byte(parser, OP_MULTIPLY);
         break;
     case TOKEN_SLASH:
-        emit_byte(OP_DIVIDE);
+        emit_byte(parser, OP_DIVIDE);
         break;
     default:
         return; // Unreachable.
     }
 }
 
-static void call(bool can_assign) {
-    uint8_t arg_count = argument_list();
-    emit_bytes(OP_CALL, arg_count);
+static void call(Parser* parser, bool can_assign) {
+    uint8_t arg_count = argument_list(parser);
+    parser->compiler->last_call = current_chunk(parser)->count;
+    emit_bytes(parser, OP_CALL, arg_count);
+}
+
+static void dot(Parser* parser, bool can_assign) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect property name after '.'!");
+    uint8_t name = identifier_constant(parser, &parser->previous);
+
+    if (can_assign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        emit_bytes(parser, OP_SET_PROPERTY, name);
+    } else if (match(parser, TOKEN_LEFT_PAREN)) {
+        uint8_t arg_count = argument_list(parser);
+        parser->compiler->last_call = current_chunk(parser)->count;
+        emit_bytes(parser, OP_INVOKE, name);
+        emit_byte(parser, arg_count);
+    } else
+        emit_bytes(parser, OP_GET_PROPERTY, name);
 }
 
-static void dot(bool can_assign) {
-    consume(TOKEN_IDENTIFIER, "Expect property name after '.'!");
-    uint8_t name = identifier_constant(&parser.previous);
+static void subscript(Parser* parser, bool can_assign) {
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after index!");
 
-    if (can_assign && match(TOKEN_EQUAL)) {
-        expression();
-        emit_bytes(OP_SET_PROPERTY, name);
-    } else if (match(TOKEN_LEFT_PAREN)) {
-        uint8_t arg_count = argument_list();
-        emit_bytes(OP_INVOKE, name);
-        emit_byte(arg_count);
+    if (can_assign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        emit_byte(parser, OP_SET_INDEX);
     } else
-        emit_bytes(OP_GET_PROPERTY, name);
+        emit_byte(parser, OP_GET_INDEX);
+}
+
+static void list(Parser* parser, bool can_assign) {
+    int item_count = 0;
+    do {
+        // The list may be empty or end in a comma.
+        if (check(parser, TOKEN_RIGHT_BRACKET))
+            break;
+        expression(parser);
+        if (item_count == 255)
+            error(parser, "Can't have more than 255 items in a list literal!");
+        item_count++;
+    } while (match(parser, TOKEN_COMMA));
+
+    consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after list items!");
+    emit_bytes(parser, OP_BUILD_LIST, (uint8_t)item_count);
 }
 
-static void literal(bool can_assign) {
-    switch (parser.previous.type) {
+static void literal(Parser* parser, bool can_assign) {
+    switch (parser->previous.type) {
     case TOKEN_FALSE:
-        emit_byte(OP_FALSE);
+        emit_byte(parser, OP_FALSE);
         break;
     case TOKEN_NIL:
-        emit_byte(OP_NIL);
+        emit_byte(parser, OP_NIL);
         break;
     case TOKEN_TRUE:
-        emit_byte(OP_TRUE);
+        emit_byte(parser, OP_TRUE);
         break;
     default:
         return; // Unreachable.
     }
 }
 
-static void grouping(bool can_assign) {
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression!");
+static void grouping(Parser* parser, bool can_assign) {
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression!");
 }
 
-static void number(bool can_assign) {
-    double value = strtod(parser.previous.start, NULL);
-    emit_constant(NUMBER_VAL(value));
+static void number(Parser* parser, bool can_assign) {
+    double value;
+    parse_number(parser->previous.start, parser->previous.length, &value);
+    emit_constant(parser, NUMBER_VAL(value));
 }
 
-static void or_(bool can_assign) {
-    int else_jump = emit_jump(OP_JUMP_IF_FALSE);
-    int end_jump = emit_jump(OP_JUMP);
+static void or_(Parser* parser, bool can_assign) {
+    int else_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+    int end_jump = emit_jump(parser, OP_JUMP);
 
-    patch_jump(else_jump);
-    emit_byte(OP_POP);
+    patch_jump(parser, else_jump);
+    emit_byte(parser, OP_POP);
 
-    parse_precedence(PREC_OR);
-    patch_jump(end_jump);
+    parse_precedence(parser, PREC_OR);
+    patch_jump(parser, end_jump);
 }
 
-static void string(bool can_assign) {
-    emit_constant(OBJ_VAL(copy_string(parser.previous.start + 1,
-                                      parser.previous.length - 2)));
+static void string(Parser* parser, bool can_assign) {
+    emit_constant(parser, OBJ_VAL(copy_string(parser->vm,
+                                              parser->previous.start + 1,
+                                              parser->previous.length - 2)));
 }
 
-static void named_variable(Token name, bool can_assign) {
+static void named_variable(Parser* parser, Token name, bool can_assign) {
     uint8_t get_op, set_op;
-    int arg = resolve_local(current, &name);
+    int arg = resolve_local(parser, parser->compiler, &name);
     if (arg != -1) {
         get_op = OP_GET_LOCAL;
         set_op = OP_SET_LOCAL;
-    } else if ((arg = resolve_upvalue(current, &name)) != -1) {
+    } else if ((arg = resolve_upvalue(parser, parser->compiler, &name)) != -1) {
         get_op = OP_GET_UPVALUE;
         set_op = OP_SET_UPVALUE;
     } else {
-        arg = identifier_constant(&name);
+        arg = identifier_constant(parser, &name);
         get_op = OP_GET_GLOBAL;
         set_op = OP_SET_GLOBAL;
     }
 
-    if (can_assign && match(TOKEN_EQUAL)) {
-        expression();
-        emit_bytes(set_op, (uint8_t)arg);
+    if (can_assign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        emit_bytes(parser, set_op, (uint8_t)arg);
     } else
-        emit_bytes(get_op, (uint8_t)arg);
+        emit_bytes(parser, get_op, (uint8_t)arg);
 }
 
-static void variable(bool can_assign) {
-    named_variable(parser.previous, can_assign);
+static void variable(Parser* parser, bool can_assign) {
+    named_variable(parser, parser->previous, can_assign);
 }
 
-static void this_(bool can_assign) {
-    if (current_class == NULL) {
-        error("Can't use 'this' outside of a class!");
+static void this_(Parser* parser, bool can_assign) {
+    if (parser->class_compiler == NULL) {
+        error(parser, "Can't use 'this' outside of a class!");
         return;
     }
-    variable(false);
+    variable(parser, false);
+}
+
+static bool fold_unary(Parser* parser, Token_type operator_type,
+                       int operand_start) {
+    Value operand;
+    if (!constant_operand(parser, operand_start, current_chunk(parser)->count,
+                          &operand))
+        return false;
+
+    Value result;
+    switch (operator_type) {
+    case TOKEN_MINUS:
+        if (!IS_NUMBER(operand))
+            return false;
+        result = NUMBER_VAL(-AS_NUMBER(operand));
+        break;
+    case TOKEN_BANG:
+        result = BOOL_VAL(is_falsey(operand));
+        break;
+    default:
+        return false; // Unreachable.
+    }
+
+    remove_operand(parser, operand_start);
+    emit_value(parser, result);
+    return true;
 }
 
-static void unary(bool can_assign) {
-    Token_type operator_type = parser.previous.type;
+static void unary(Parser* parser, bool can_assign) {
+    Token_type operator_type = parser->previous.type;
 
     // Compile the operand.
-    parse_precedence(PREC_UNARY);
+    int operand_start = current_chunk(parser)->count;
+    parse_precedence(parser, PREC_UNARY);
+
+    if (fold_unary(parser, operator_type, operand_start))
+        return;
 
     // Emit the operator instruction.
     switch (operator_type) {
     case TOKEN_MINUS:
-        emit_byte(OP_NEGATE);
+        emit_byte(parser, OP_NEGATE);
         break;
     case TOKEN_BANG:
-        emit_byte(OP_NOT);
+        emit_byte(parser, OP_NOT);
         break;
     default:
         return; // Unreachable.
@@ -574,6 +788,8 @@ Parse_rule rules[] = {
     [TOKEN_RIGHT_PAREN]   = {NULL,     NULL,   PREC_NONE},
     [TOKEN_LEFT_BRACE]    = {NULL,     NULL,   PREC_NONE},
     [TOKEN_RIGHT_BRACE]   = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_LEFT_BRACKET]  = {list,     subscript, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET] = {NULL,     NULL,   PREC_NONE},
     [TOKEN_COMMA]         = {NULL,     NULL,   PREC_NONE},
     [TOKEN_DOT]           = {NULL,     dot,    PREC_CALL},
     [TOKEN_MINUS]         = {unary,    binary, PREC_TERM},
@@ -612,254 +828,320 @@ Parse_rule rules[] = {
     [TOKEN_EOF]           = {NULL,     NULL,   PREC_NONE},
 };
 
-static void parse_precedence(Precedence precedence) {
-    advance();
-    Parse_fn prefix_rule = get_rule(parser.previous.type)->prefix;
+static void parse_precedence(Parser* parser, Precedence precedence) {
+    advance(parser);
+    Parse_fn prefix_rule = get_rule(parser->previous.type)->prefix;
     if (prefix_rule == NULL) {
-        error("Expect expression!");
+        error(parser, "Expect expression!");
         return;
     }
 
     bool can_assign = precedence <= PREC_ASSIGNMENT;
-    prefix_rule(can_assign);
-
-    while (precedence <= get_rule(parser.current.type)->precedence) {
-        advance();
-        Parse_fn infix_rule = get_rule(parser.previous.type)->infix;
-        infix_rule(can_assign);
+    int start = current_chunk(parser)->count;
+    prefix_rule(parser, can_assign);
+
+    while (precedence <= get_rule(parser->current.type)->precedence) {
+        advance(parser);
+        Parse_fn infix_rule = get_rule(parser->previous.type)->infix;
+        parser->compiler->operand_start = start;
+        infix_rule(parser, can_assign);
     }
 
-    if (can_assign && match(TOKEN_EQUAL))
-        error("Invalid assignment target!");
+    if (can_assign && match(parser, TOKEN_EQUAL))
+        error(parser, "Invalid assignment target!");
 }
 
 static Parse_rule* get_rule(Token_type type) {
     return &rules[type];
 }
 
-static void expression() {
-    parse_precedence(PREC_ASSIGNMENT);
+static void expression(Parser* parser) {
+    parse_precedence(parser, PREC_ASSIGNMENT);
 }
 
-static void block() {
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-        declaration();
+static void block(Parser* parser) {
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+        declaration(parser);
     }
 
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block!");
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block!");
 }
 
-static void function(Function_type type) {
+static void function(Parser* parser, Function_type type) {
     Compiler compiler;
-    init_compiler(&compiler, type);
-    begin_scope();
+    init_compiler(parser, &compiler, type);
+    begin_scope(parser);
 
     // Compiler the parameter list.
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name!");
-    if (!check(TOKEN_RIGHT_PAREN)) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name!");
+    if (!check(parser, TOKEN_RIGHT_PAREN)) {
         do {
-            current->function->arity++;
-            if (current->function->arity > 255)
-                error_at_current("Can't have more than 255 parameters!");
-
-            uint8_t param_constant = parse_variable("Expect parameter name!");
-            define_variable(param_constant);
-        } while (match(TOKEN_COMMA));
+            parser->compiler->function->arity++;
+            if (parser->compiler->function->arity > 255)
+                error_at_current(parser,
+                                 "Can't have more than 255 parameters!");
+
+            uint8_t param_constant = parse_variable(parser,
+                                                    "Expect parameter name!");
+            define_variable(parser, param_constant);
+        } while (match(parser, TOKEN_COMMA));
     }
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after function parameters!");
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after function parameters!");
 
     // The body.
-    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body!");
-    block();
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body!");
+    block(parser);
 
     // Creater the function object.
-    Obj_function* function = end_compiler();
-    emit_bytes(OP_CLOSURE, make_constant(OBJ_VAL(function)));
+    Obj_function* function = end_compiler(parser);
+    emit_bytes(parser, OP_CLOSURE, make_constant(parser, OBJ_VAL(function)));
 
     for (int i = 0; i < function->upvalue_count; i++) {
-        emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
-        emit_byte(compiler.upvalues[i].index);
+        emit_byte(parser, compiler.upvalues[i].is_local ? 1 : 0);
+        emit_byte(parser, compiler.upvalues[i].index);
     }
 }
 
-static void method() {
-    consume(TOKEN_IDENTIFIER, "Expect method name!");
-    uint8_t constant = identifier_constant(&parser.previous);
+static void method(Parser* parser) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect method name!");
+    uint8_t constant = identifier_constant(parser, &parser->previous);
 
     Function_type type = TYPE_METHOD;
-    if (parser.previous.length == 4
-        && memcmp(parser.previous.start, "init", 4) == 0)
+    if (parser->previous.length == 4
+        && memcmp(parser->previous.start, "init", 4) == 0)
         type = TYPE_INITIALIZER;
-    function(type);
-    emit_bytes(OP_METHOD, constant);
+    function(parser, type);
+    emit_bytes(parser, OP_METHOD, constant);
 }
 
-static void class_declaration() {
-    consume(TOKEN_IDENTIFIER, "Expect class name!");
-    Token class_name = parser.previous;
-    uint8_t name_constant = identifier_constant(&parser.previous);
-    declare_variable();
+static void class_declaration(Parser* parser) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect class name!");
+    Token class_name = parser->previous;
+    uint8_t name_constant = identifier_constant(parser, &parser->previous);
+    declare_variable(parser);
 
-    emit_bytes(OP_CLASS, name_constant);
-    define_variable(name_constant);
+    emit_bytes(parser, OP_CLASS, name_constant);
+    define_variable(parser, name_constant);
 
     Class_compiler class_compiler;
-    class_compiler.name = parser.previous;
-    class_compiler.enclosing = current_class;
-    current_class = &class_compiler;
+    class_compiler.name = parser->previous;
+    class_compiler.enclosing = parser->class_compiler;
+    parser->class_compiler = &class_compiler;
 
-    named_variable(class_name, false);
-    consume(TOKEN_LEFT_BRACE, "Expect '{' before class body!");
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
-        method();
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body!");
-    emit_byte(OP_POP);
+    named_variable(parser, class_name, false);
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before class body!");
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF))
+        method(parser);
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after class body!");
+    emit_byte(parser, OP_POP);
 
-    current_class = current_class->enclosing;
+    parser->class_compiler = parser->class_compiler->enclosing;
 }
 
-static void fun_declaration() {
-    uint8_t global = parse_variable("Expect function name!");
-    mark_initialized();
-    function(TYPE_FUNCTION);
-    define_variable(global);
+static void fun_declaration(Parser* parser) {
+    uint8_t global = parse_variable(parser, "Expect function name!");
+    mark_initialized(parser);
+    function(parser, TYPE_FUNCTION);
+    define_variable(parser, global);
 }
 
-static void var_declaration() {
-    uint8_t global = parse_variable("Expect variable name!");
+static void var_declaration(Parser* parser) {
+    uint8_t global = parse_variable(parser, "Expect variable name!");
 
-    if (match(TOKEN_EQUAL)) {
-        expression();
+    if (match(parser, TOKEN_EQUAL)) {
+        expression(parser);
     } else {
-        emit_byte(OP_NIL);
+        emit_byte(parser, OP_NIL);
     }
 
-    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration");
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration");
 
-    define_variable(global);
+    define_variable(parser, global);
 }
 
-static void expression_statement() {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after expression!");
-    emit_byte(OP_POP);
+static void expression_statement(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression!");
+    emit_byte(parser, OP_POP);
 }
 
-static void for_statement() {
-    begin_scope();
+static void for_statement(Parser* parser) {
+    begin_scope(parser);
 
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'!");
-    if (match(TOKEN_SEMICOLON)) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'!");
+    if (match(parser, TOKEN_SEMICOLON)) {
         // No initializer.
-    } else if (match(TOKEN_VAR))
-        var_declaration();
+    } else if (match(parser, TOKEN_VAR))
+        var_declaration(parser);
     else
-        expression_statement();
+        expression_statement(parser);
 
-    int loop_start = current_chunk()->count;
+    int loop_start = current_chunk(parser)->count;
 
     int exit_jump = -1;
-    if (!match(TOKEN_SEMICOLON)) {
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after loop condition!");
+    if (!match(parser, TOKEN_SEMICOLON)) {
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition!");
 
         // Jump out of the loop if the condition is false.
-        exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-        emit_byte(OP_POP); // Condition.
+        exit_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+        emit_byte(parser, OP_POP); // Condition.
     }
 
-    if (!match(TOKEN_RIGHT_PAREN)) {
-        int body_jump = emit_jump(OP_JUMP);
+    if (!match(parser, TOKEN_RIGHT_PAREN)) {
+        int body_jump = emit_jump(parser, OP_JUMP);
 
-        int increment_start = current_chunk()->count;
-        expression();
-        emit_byte(OP_POP);
-        consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses!");
+        int increment_start = current_chunk(parser)->count;
+        expression(parser);
+        emit_byte(parser, OP_POP);
+        consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses!");
 
-        emit_loop(loop_start);
+        emit_loop(parser, loop_start);
         loop_start = increment_start;
-        patch_jump(body_jump);
+        patch_jump(parser, body_jump);
     }
 
-    statement();
+    statement(parser);
 
-    emit_loop(loop_start);
+    emit_loop(parser, loop_start);
 
     if (exit_jump != -1) {
-        patch_jump(exit_jump);
-        emit_byte(OP_POP); // Condition.
+        patch_jump(parser, exit_jump);
+        emit_byte(parser, OP_POP); // Condition.
     }
 
-    end_scope();
+    end_scope(parser);
+}
+
+// Compiles a statement that can never run, for its errors only.
+static void dead_statement(Parser* parser) {
+    Chunk* chunk = current_chunk(parser);
+    int count = chunk->count;
+    int constant_count = chunk->constants.count;
+
+    statement(parser);
+
+    // Nothing outside the statement refers to its code or constants.
+    chunk->count = count;
+    chunk->constants.count = constant_count;
+    parser->compiler->last_call = -1;
 }
 
-static void if_statement() {
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'!");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition!");
+static void if_statement(Parser* parser) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'!");
+    int condition_start = current_chunk(parser)->count;
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition!");
+
+    Value condition;
+    if (constant_operand(parser, condition_start, current_chunk(parser)->count,
+                         &condition)) {
+        // Only the branch that is taken needs any code.
+        remove_operand(parser, condition_start);
+        bool taken = !is_falsey(condition);
+
+        if (taken)
+            statement(parser);
+        else
+            dead_statement(parser);
+
+        if (match(parser, TOKEN_ELSE)) {
+            if (taken)
+                dead_statement(parser);
+            else
+                statement(parser);
+        }
+        return;
+    }
 
-    int then_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
-    statement();
+    int then_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+    emit_byte(parser, OP_POP);
+    statement(parser);
 
-    int else_jump = emit_jump(OP_JUMP);
+    int else_jump = emit_jump(parser, OP_JUMP);
 
-    patch_jump(then_jump);
-    emit_byte(OP_POP);
+    patch_jump(parser, then_jump);
+    emit_byte(parser, OP_POP);
 
-    if (match(TOKEN_ELSE))
-        statement();
-    patch_jump(else_jump);
+    if (match(parser, TOKEN_ELSE))
+        statement(parser);
+    patch_jump(parser, else_jump);
 }
 
-static void print_statement() {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after value!");
-    emit_byte(OP_PRINT);
+static void print_statement(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after value!");
+    emit_byte(parser, OP_PRINT);
 }
 
-static void return_statement() {
-    if (current->type == TYPE_SCRIPT)
-        error("Can't return from top-level code!");
+static void return_statement(Parser* parser) {
+    if (parser->compiler->type == TYPE_SCRIPT)
+        error(parser, "Can't return from top-level code!");
 
-    if (match(TOKEN_SEMICOLON))
-        emit_return();
+    if (match(parser, TOKEN_SEMICOLON))
+        emit_return(parser);
     else {
-        if (current->type == TYPE_INITIALIZER)
-            error("Can't return a value from an initializer!");
-
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after return value!");
-        emit_byte(OP_RETURN);
+        if (parser->compiler->type == TYPE_INITIALIZER)
+            error(parser, "Can't return a value from an initializer!");
+
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value!");
+
+        // A call whose result is returned as it is can reuse the frame.
+        // OP_RETURN stays for callees that don't.
+        Chunk* chunk = current_chunk(parser);
+        int last_call = parser->compiler->last_call;
+        uint8_t* last = last_call != -1 ? &chunk->code[last_call] : NULL;
+        if (last != NULL && last_call == chunk->count - 2 && *last == OP_CALL)
+            *last = OP_TAIL_CALL;
+        else if (last != NULL && last_call == chunk->count - 3
+                 && *last == OP_INVOKE)
+            *last = OP_TAIL_INVOKE;
+        emit_byte(parser, OP_RETURN);
     }
 }
 
-static void while_statement() {
-    int loop_start = current_chunk()->count;
+static void while_statement(Parser* parser) {
+    int loop_start = current_chunk(parser)->count;
+
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'!");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition!");
+
+    Value condition;
+    if (constant_operand(parser, loop_start, current_chunk(parser)->count,
+                         &condition)) {
+        // Either the body never runs or the loop never exits.
+        remove_operand(parser, loop_start);
+        if (is_falsey(condition)) {
+            dead_statement(parser);
+            return;
+        }
 
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'!");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition!");
+        statement(parser);
+        emit_loop(parser, loop_start);
+        return;
+    }
 
-    int exit_jump = emit_jump(OP_JUMP_IF_FALSE);
+    int exit_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
 
-    emit_byte(OP_POP);
-    statement();
+    emit_byte(parser, OP_POP);
+    statement(parser);
 
-    emit_loop(loop_start);
+    emit_loop(parser, loop_start);
 
-    patch_jump(exit_jump);
-    emit_byte(OP_POP);
+    patch_jump(parser, exit_jump);
+    emit_byte(parser, OP_POP);
 }
 
-static void synchronize() {
-    parser.panic_mode = false;
+static void synchronize(Parser* parser) {
+    parser->panic_mode = false;
 
-    while (parser.current.type != TOKEN_EOF) {
-        if (parser.previous.type == TOKEN_SEMICOLON)
+    while (parser->current.type != TOKEN_EOF) {
+        if (parser->previous.type == TOKEN_SEMICOLON)
             return;
 
-        switch (parser.current.type) {
+        switch (parser->current.type) {
         case TOKEN_CLASS:
         case TOKEN_FUN:
         case TOKEN_VAR:
@@ -875,64 +1157,79 @@ static void synchronize() {
             ;
         }
 
-        advance();
+        advance(parser);
     }
 }
 
-static void declaration() {
-    if (match(TOKEN_CLASS))
-        class_declaration();
-    else if (match(TOKEN_FUN))
-        fun_declaration();
-    else if (match(TOKEN_VAR))
-        var_declaration();
+static void declaration(Parser* parser) {
+    if (match(parser, TOKEN_CLASS))
+        class_declaration(parser);
+    else if (match(parser, TOKEN_FUN))
+        fun_declaration(parser);
+    else if (match(parser, TOKEN_VAR))
+        var_declaration(parser);
     else
-        statement();
-
-    if (parser.panic_mode)
-        synchronize();
-}
-
-static void statement() {
-    if (match(TOKEN_PRINT))
-        print_statement();
-    else if (match(TOKEN_FOR))
-        for_statement();
-    else if (match(TOKEN_IF))
-        if_statement();
-    else if (match(TOKEN_RETURN))
-        return_statement();
-    else if (match(TOKEN_WHILE))
-        while_statement();
-    else if (match(TOKEN_LEFT_BRACE)) {
-        begin_scope();
-        block();
-        end_scope();
+        statement(parser);
+
+    if (parser->panic_mode)
+        synchronize(parser);
+}
+
+static void statement(Parser* parser) {
+    if (match(parser, TOKEN_PRINT))
+        print_statement(parser);
+    else if (match(parser, TOKEN_FOR))
+        for_statement(parser);
+    else if (match(parser, TOKEN_IF))
+        if_statement(parser);
+    else if (match(parser, TOKEN_RETURN))
+        return_statement(parser);
+    else if (match(parser, TOKEN_WHILE))
+        while_statement(parser);
+    else if (match(parser, TOKEN_LEFT_BRACE)) {
+        begin_scope(parser);
+        block(parser);
+        end_scope(parser);
     }
     else
-        expression_statement();
+        expression_statement(parser);
 }
 
-Obj_function* compile(const char *source) {
-    init_scanner(source);
+Obj_function* compile(VM* vm, const char *source) {
+    Parser state;
+    Parser* parser = &state;
+    parser->vm = vm;
+    parser->compiler = NULL;
+    parser->class_compiler = NULL;
+
+    init_scanner(&parser->scanner, source);
     Compiler compiler;
-    init_compiler(&compiler, TYPE_SCRIPT);
+    init_compiler(parser, &compiler, TYPE_SCRIPT);
 
-    parser.had_error = false;
-    parser.had_error = false;
+    parser->had_error = false;
+    parser->panic_mode = false;
 
-    advance();
-    while (!match(TOKEN_EOF))
-        declaration();
+    advance(parser);
+    while (!match(parser, TOKEN_EOF))
+        declaration(parser);
 
-    Obj_function* function = end_compiler();
-    return parser.had_error ? NULL : function;
+    Obj_function* function = end_compiler(parser);
+    if (parser->had_error)
+        return NULL;
+
+    // Inlining needs the whole program to know which calls are safe.
+    if (vm->optimize) {
+        push(vm, OBJ_VAL(function));
+        inline_functions(vm, function);
+        pop(vm);
+    }
+    return function;
 }
 
-void mark_compiler_roots() {
-    Compiler* compiler = current;
+void mark_compiler_roots(VM* vm) {
+    Compiler* compiler = vm->compiler;
     while (compiler != NULL) {
-        mark_object((Obj*)compiler->function);
+        mark_object(vm, (Obj*)compiler->function);
         compiler = compiler->enclosing;
     }
 }
@@ -63,12 +63,18 @@ int disassemble_instruction(Chunk *chunk, int offset) {
             return jump_instruction("OP_JUMP", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
             return jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_JUMP_IF_TRUE:
+            return jump_instruction("OP_JUMP_IF_TRUE", 1, chunk, offset);
         case OP_LOOP:
             return jump_instruction("OP_LOOP", -1, chunk, offset);
         case OP_CALL:
             return byte_instruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byte_instruction("OP_TAIL_CALL", chunk, offset);
         case OP_INVOKE:
             return invoke_instruction("OP_INVOKE", chunk, offset);
+        case OP_TAIL_INVOKE:
+            return invoke_instruction("OP_TAIL_INVOKE", chunk, offset);
         case OP_CLOSURE:
         {
             offset++;
@@ -126,6 +132,12 @@ int disassemble_instruction(Chunk *chunk, int offset) {
             return constant_instruction("OP_GET_PROPERTY", chunk, offset);
         case OP_SET_PROPERTY:
             return constant_instruction("OP_SET_PROPERTY", chunk, offset);
+        case OP_GET_INDEX:
+            return simple_instruction("OP_GET_INDEX", offset);
+        case OP_SET_INDEX:
+            return simple_instruction("OP_SET_INDEX", offset);
+        case OP_BUILD_LIST:
+            return byte_instruction("OP_BUILD_LIST", chunk, offset);
         case OP_EQUAL:
             return simple_instruction("OP_EQUAL", offset);
         case OP_GREATER:
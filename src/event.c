@@ -0,0 +1,897 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+// The event loop runs tasks, fibers started by go(), until all of them
+// have finished. A task that would block on a descriptor or a timer is
+// parked, and once epoll says the descriptor is ready the loop does what
+// the task was waiting to do and resumes it with the result. Outside a
+// task the same natives block instead, running the loop until they can go
+// on, so the script's main body can wait alongside its tasks.
+//
+// Descriptors are plain numbers to Lox. Everything is non-blocking, and
+// errors once a wait has started come back as nil rather than stopping
+// the script, the way a peer hanging up does.
+
+#define EVENTS_MAX 64
+#define READ_MAX 65536
+
+typedef enum {
+    WAIT_READ,
+    WAIT_ACCEPT,
+    WAIT_WRITE,
+    WAIT_CONNECT
+} Wait_kind;
+
+// Something waiting to be done on a descriptor, for a parked task or for
+// a native that blocks until it is done.
+typedef struct {
+    bool active;
+    bool done;
+    Wait_kind kind;
+    Obj_fiber* fiber;       // NULL for a blocked native.
+    Obj_string* data;       // What to write, from offset on.
+    int offset;
+    int max;                // Most bytes to read.
+    Value result;
+} Wait;
+
+// Reads and accepts wait in one direction, writes and connects in the
+// other. They sit where they are until the loop is freed, so that a wait
+// can be pointed to while the table grows.
+typedef struct {
+    Wait in;
+    Wait out;
+    uint32_t events;        // Registered with epoll.
+} Descriptor;
+
+typedef struct {
+    Obj_fiber* fiber;
+    Value value;
+} Task;
+
+typedef struct {
+    double deadline;
+    uint64_t order;         // Ties go first come, first served.
+    Obj_fiber* fiber;
+} Timer;
+
+typedef struct Event_loop {
+    int epoll;
+    int wait_count;
+
+    Descriptor** descriptors;
+    int descriptor_capacity;
+
+    // Tasks ready to run, from head on.
+    Task* ready;
+    int ready_head;
+    int ready_count;
+    int ready_capacity;
+
+    // A binary heap, soonest first.
+    Timer* timers;
+    int timer_count;
+    int timer_capacity;
+    uint64_t timer_order;
+
+    Obj_fiber* current;     // Task the loop is running.
+    Obj_fiber* parked;      // Task that parked itself last.
+    char buffer[READ_MAX];
+} Event_loop;
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// The loop is only set up once a script first needs it.
+static Event_loop* get_loop(VM* vm) {
+    if (vm->loop != NULL)
+        return vm->loop;
+
+    Event_loop* loop = (Event_loop*)malloc(sizeof(Event_loop));
+    if (loop == NULL)
+        exit(1);
+    loop->epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll < 0) {
+        free(loop);
+        runtime_error(vm, "Can't start the event loop: %s!",
+                      strerror(errno));
+        return NULL;
+    }
+
+    loop->wait_count = 0;
+    loop->descriptors = NULL;
+    loop->descriptor_capacity = 0;
+    loop->ready = NULL;
+    loop->ready_head = 0;
+    loop->ready_count = 0;
+    loop->ready_capacity = 0;
+    loop->timers = NULL;
+    loop->timer_count = 0;
+    loop->timer_capacity = 0;
+    loop->timer_order = 0;
+    loop->current = NULL;
+    loop->parked = NULL;
+    vm->loop = loop;
+    return loop;
+}
+
+static void init_wait(Wait* wait) {
+    wait->active = false;
+    wait->done = false;
+    wait->fiber = NULL;
+    wait->data = NULL;
+    wait->offset = 0;
+    wait->max = 0;
+    wait->result = NIL_VAL;
+}
+
+static Descriptor* get_descriptor(Event_loop* loop, int fd) {
+    if (fd >= loop->descriptor_capacity) {
+        int capacity = loop->descriptor_capacity;
+        while (capacity <= fd)
+            capacity = GROW_CAPACITY(capacity);
+        size_t size = sizeof(Descriptor*) * capacity;
+        loop->descriptors = (Descriptor**)realloc(loop->descriptors, size);
+        if (loop->descriptors == NULL)
+            exit(1);
+        for (int i = loop->descriptor_capacity; i < capacity; i++)
+            loop->descriptors[i] = NULL;
+        loop->descriptor_capacity = capacity;
+    }
+
+    if (loop->descriptors[fd] == NULL) {
+        Descriptor* descriptor = (Descriptor*)malloc(sizeof(Descriptor));
+        if (descriptor == NULL)
+            exit(1);
+        init_wait(&descriptor->in);
+        init_wait(&descriptor->out);
+        descriptor->events = 0;
+        loop->descriptors[fd] = descriptor;
+    }
+    return loop->descriptors[fd];
+}
+
+// Brings epoll in line with what is waiting on the descriptor.
+static bool watch(Event_loop* loop, int fd, Descriptor* descriptor) {
+    uint32_t events = (descriptor->in.active ? EPOLLIN : 0)
+                      | (descriptor->out.active ? EPOLLOUT : 0);
+    if (events == descriptor->events)
+        return true;
+
+    struct epoll_event event;
+    event.events = events;
+    event.data.fd = fd;
+    int operation = descriptor->events == 0 ? EPOLL_CTL_ADD
+                    : events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    bool watched = epoll_ctl(loop->epoll, operation, fd, &event) == 0;
+
+    // Closing a descriptor takes it out of epoll by itself.
+    if (watched || operation == EPOLL_CTL_DEL)
+        descriptor->events = events;
+    return watched;
+}
+
+// The queue lives outside the GC's accounting, so that scheduling never
+// starts a collection while a result is only held in C.
+static void schedule(Event_loop* loop, Obj_fiber* fiber, Value value) {
+    if (loop->ready_count == loop->ready_capacity) {
+        int capacity = GROW_CAPACITY(loop->ready_capacity);
+        loop->ready = (Task*)realloc(loop->ready, sizeof(Task) * capacity);
+        if (loop->ready == NULL)
+            exit(1);
+        loop->ready_capacity = capacity;
+    }
+
+    loop->ready[loop->ready_count].fiber = fiber;
+    loop->ready[loop->ready_count].value = value;
+    loop->ready_count++;
+}
+
+static bool timer_before(Timer* a, Timer* b) {
+    return a->deadline < b->deadline
+           || (a->deadline == b->deadline && a->order < b->order);
+}
+
+static void add_timer(Event_loop* loop, double deadline, Obj_fiber* fiber) {
+    if (loop->timer_count == loop->timer_capacity) {
+        int capacity = GROW_CAPACITY(loop->timer_capacity);
+        loop->timers = (Timer*)realloc(loop->timers,
+                                       sizeof(Timer) * capacity);
+        if (loop->timers == NULL)
+            exit(1);
+        loop->timer_capacity = capacity;
+    }
+
+    int index = loop->timer_count++;
+    Timer timer = {deadline, loop->timer_order++, fiber};
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (!timer_before(&timer, &loop->timers[parent]))
+            break;
+        loop->timers[index] = loop->timers[parent];
+        index = parent;
+    }
+    loop->timers[index] = timer;
+}
+
+static Obj_fiber* remove_timer(Event_loop* loop) {
+    Obj_fiber* fiber = loop->timers[0].fiber;
+    Timer last = loop->timers[--loop->timer_count];
+
+    int index = 0;
+    for (;;) {
+        int child = index * 2 + 1;
+        if (child >= loop->timer_count)
+            break;
+        if (child + 1 < loop->timer_count
+            && timer_before(&loop->timers[child + 1], &loop->timers[child]))
+            child++;
+        if (!timer_before(&loop->timers[child], &last))
+            break;
+        loop->timers[index] = loop->timers[child];
+        index = child;
+    }
+    if (loop->timer_count > 0)
+        loop->timers[index] = last;
+    return fiber;
+}
+
+static bool set_non_blocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0
+           && fcntl(fd, F_SETFD, FD_CLOEXEC) == 0;
+}
+
+static bool would_block() {
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+// Does what the wait is for, if the descriptor lets it. Returns false if
+// that would still block, and otherwise the result, which is nil if it
+// failed.
+static bool attempt(VM* vm, Event_loop* loop, int fd, Wait* wait,
+                    Value* result) {
+    switch (wait->kind) {
+    case WAIT_READ:
+    {
+        ssize_t count = read(fd, loop->buffer, wait->max);
+        if (count < 0 && would_block())
+            return false;
+        *result = count > 0
+                  ? OBJ_VAL(copy_string(vm, loop->buffer, (int)count))
+                  : NIL_VAL;
+        return true;
+    }
+    case WAIT_ACCEPT:
+    {
+        int client = accept(fd, NULL, NULL);
+        if (client < 0 && (would_block() || errno == ECONNABORTED))
+            return false;
+        if (client >= 0 && !set_non_blocking(client)) {
+            close(client);
+            client = -1;
+        }
+        *result = client >= 0 ? NUMBER_VAL(client) : NIL_VAL;
+        return true;
+    }
+    case WAIT_WRITE:
+        // Sockets are written with send(), which doesn't raise SIGPIPE
+        // when the peer has gone.
+        while (wait->offset < wait->data->length) {
+            const char* bytes = wait->data->chars + wait->offset;
+            size_t count = wait->data->length - wait->offset;
+            ssize_t written = send(fd, bytes, count, MSG_NOSIGNAL);
+            if (written < 0 && errno == ENOTSOCK)
+                written = write(fd, bytes, count);
+            if (written < 0 && would_block())
+                return false;
+            if (written < 0) {
+                *result = NIL_VAL;
+                return true;
+            }
+            wait->offset += (int)written;
+        }
+        *result = NUMBER_VAL(wait->data->length);
+        return true;
+    case WAIT_CONNECT:
+    {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0)
+            close(fd);
+        *result = error == 0 ? NUMBER_VAL(fd) : NIL_VAL;
+        return true;
+    }
+    }
+    return false;
+}
+
+// Hands the result to the task that was waiting, or to the blocked native.
+static void finish_wait(Event_loop* loop, Wait* wait, Value result) {
+    if (wait->fiber != NULL)
+        schedule(loop, wait->fiber, result);
+    else {
+        wait->done = true;
+        wait->result = result;
+    }
+
+    wait->active = false;
+    wait->fiber = NULL;
+    wait->data = NULL;
+    loop->wait_count--;
+}
+
+static void poll_wait(VM* vm, Event_loop* loop, int fd, Wait* wait,
+                      bool ready) {
+    Value result;
+    if (wait->active && ready && attempt(vm, loop, fd, wait, &result))
+        finish_wait(loop, wait, result);
+}
+
+// Runs a task until it parks or yields, and queues it again if it yielded
+// of its own accord, to let the others have a turn.
+static bool run_task(VM* vm, Event_loop* loop, Task task) {
+    Obj_fiber* current = loop->current;
+    loop->current = task.fiber;
+    loop->parked = NULL;
+    Interpret_result result = resume_fiber(vm, task.fiber, task.value);
+    loop->current = current;
+    if (result != INTERPRET_OK)
+        return false;
+
+    pop(vm);
+    if (task.fiber->status == FIBER_SUSPENDED && loop->parked != task.fiber)
+        schedule(loop, task.fiber, NIL_VAL);
+    return true;
+}
+
+// Runs tasks and waits on descriptors and timers until the blocked wait,
+// if any, is done and the deadline, if any, has passed. Without either it
+// runs until there is nothing left to do. Tasks that become ready while
+// the ones before them run wait for the next turn, after the loop has
+// looked for events again.
+static bool run_loop(VM* vm, Event_loop* loop, Wait* until,
+                     double deadline) {
+    for (;;) {
+        int turn = loop->ready_count - loop->ready_head;
+        for (int i = 0; i < turn && loop->ready_head < loop->ready_count;
+             i++) {
+            Task task = loop->ready[loop->ready_head++];
+            if (!run_task(vm, loop, task))
+                return false;
+        }
+        if (loop->ready_head == loop->ready_count) {
+            loop->ready_head = 0;
+            loop->ready_count = 0;
+        }
+
+        if (until != NULL && until->done)
+            return true;
+        double time = now();
+        if (deadline >= 0 && time >= deadline)
+            return true;
+
+        bool has_ready = loop->ready_count > 0;
+        if (until == NULL && deadline < 0 && !has_ready
+            && loop->wait_count == 0 && loop->timer_count == 0)
+            return true;
+
+        double wake = deadline;
+        if (loop->timer_count > 0
+            && (wake < 0 || loop->timers[0].deadline < wake))
+            wake = loop->timers[0].deadline;
+        int timeout = -1;
+        if (has_ready)
+            timeout = 0;
+        else if (wake >= 0)
+            timeout = wake > time ? (int)((wake - time) * 1000) + 1 : 0;
+
+        struct epoll_event events[EVENTS_MAX];
+        int count = epoll_wait(loop->epoll, events, EVENTS_MAX, timeout);
+        if (count < 0 && errno != EINTR) {
+            runtime_error(vm, "Can't wait for events: %s!", strerror(errno));
+            return false;
+        }
+
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+            Descriptor* descriptor = get_descriptor(loop, fd);
+            uint32_t ready = events[i].events;
+            bool failed = ready & (EPOLLERR | EPOLLHUP);
+            poll_wait(vm, loop, fd, &descriptor->in,
+                      failed || (ready & EPOLLIN));
+            poll_wait(vm, loop, fd, &descriptor->out,
+                      failed || (ready & EPOLLOUT));
+            watch(loop, fd, descriptor);
+        }
+
+        time = now();
+        while (loop->timer_count > 0 && loop->timers[0].deadline <= time)
+            schedule(loop, remove_timer(loop), NIL_VAL);
+    }
+}
+
+// A task parks itself and the loop resumes it later. Anything else, the
+// main script or a fiber the loop didn't start, blocks and runs the loop
+// until it can go on.
+static bool in_task(VM* vm, Event_loop* loop) {
+    return vm->fiber != NULL && vm->fiber == loop->current
+           && vm->native_depth == vm->fiber->native_depth;
+}
+
+// Finishes the wait now if the descriptor is ready for it, and otherwise
+// parks the task or blocks until it can be finished.
+static bool wait_on(VM* vm, Event_loop* loop, int arg_count, int fd,
+                    Wait* wait, Value* result) {
+    // A connection still being made has no error to report yet.
+    if (wait->kind != WAIT_CONNECT && attempt(vm, loop, fd, wait, result))
+        return true;
+
+    wait->active = true;
+    wait->done = false;
+    loop->wait_count++;
+    if (!watch(loop, fd, get_descriptor(loop, fd))) {
+        wait->active = false;
+        loop->wait_count--;
+        runtime_error(vm, "Can't wait on descriptor %d: %s!", fd,
+                      strerror(errno));
+        return false;
+    }
+
+    if (in_task(vm, loop)) {
+        wait->fiber = vm->fiber;
+        loop->parked = vm->fiber;
+        return yield_fiber(vm, arg_count, NIL_VAL);
+    }
+
+    if (!run_loop(vm, loop, wait, -1))
+        return false;
+    *result = wait->result;
+    wait->result = NIL_VAL;
+    wait->done = false;
+    watch(loop, fd, get_descriptor(loop, fd));
+    return true;
+}
+
+static bool check_fd(VM* vm, Value value, int* fd) {
+    double number = IS_NUMBER(value) ? AS_NUMBER(value) : -1;
+    if (!(number >= 0 && number <= INT_MAX) || (int)number != number) {
+        runtime_error(vm, "Expected a file descriptor!");
+        return false;
+    }
+    *fd = (int)number;
+    return true;
+}
+
+// Looks up the wait for one direction of the descriptor, which mustn't be
+// in use already.
+static Wait* start_wait(VM* vm, Event_loop* loop, int fd, Wait_kind kind) {
+    Descriptor* descriptor = get_descriptor(loop, fd);
+    Wait* wait = kind == WAIT_READ || kind == WAIT_ACCEPT
+                 ? &descriptor->in : &descriptor->out;
+    if (wait->active) {
+        runtime_error(vm, "Something is already waiting on descriptor %d!",
+                      fd);
+        return NULL;
+    }
+    wait->kind = kind;
+    return wait;
+}
+
+// go(function, value) starts a task running the function, with the value
+// as its argument if it takes one, and returns its fiber. Tasks run once
+// the script waits on something, or when it ends.
+static bool go_native(VM* vm, int arg_count, Value* args, Value* result) {
+    if (arg_count < 1 || arg_count > 2) {
+        runtime_error(vm, "Expected 1 or 2 arguments, but got %d!",
+                      arg_count);
+        return false;
+    }
+    if (!IS_CLOSURE(args[0]) || AS_CLOSURE(args[0])->function->arity > 1) {
+        runtime_error(vm, "Fibers run functions of at most one argument!");
+        return false;
+    }
+
+    Event_loop* loop = get_loop(vm);
+    if (loop == NULL)
+        return false;
+
+    Obj_fiber* fiber = new_fiber(vm, AS_CLOSURE(args[0]));
+    schedule(loop, fiber, arg_count == 2 ? args[1] : NIL_VAL);
+    *result = OBJ_VAL(fiber);
+    return true;
+}
+
+// run_tasks() returns once every task has finished.
+static bool run_tasks_native(VM* vm, int arg_count, Value* args,
+                             Value* result) {
+    Event_loop* loop = get_loop(vm);
+    if (loop == NULL || !run_loop(vm, loop, NULL, -1))
+        return false;
+    *result = NIL_VAL;
+    return true;
+}
+
+// sleep(seconds) lets other tasks run for that long. A task sleeping for
+// no time goes to the back of the queue.
+static bool sleep_native(VM* vm, int arg_count, Value* args,
+                         Value* result) {
+    if (!IS_NUMBER(args[0])) {
+        runtime_error(vm, "Can only sleep for a number of seconds!");
+        return false;
+    }
+
+    Event_loop* loop = get_loop(vm);
+    if (loop == NULL)
+        return false;
+
+    double deadline = now() + AS_NUMBER(args[0]);
+    *result = NIL_VAL;
+    if (!in_task(vm, loop))
+        return run_loop(vm, loop, NULL, deadline);
+
+    if (AS_NUMBER(args[0]) > 0) {
+        add_timer(loop, deadline, vm->fiber);
+        loop->parked = vm->fiber;
+    }
+    return yield_fiber(vm, arg_count, NIL_VAL);
+}
+
+// read(fd, max) reads up to max bytes as they come, and returns them as a
+// string, or nil at the end of the input.
+static bool read_native(VM* vm, int arg_count, Value* args, Value* result) {
+    int fd;
+    if (!check_fd(vm, args[0], &fd))
+        return false;
+    if (!IS_NUMBER(args[1]) || !(AS_NUMBER(args[1]) >= 1)) {
+        runtime_error(vm, "Can only read a positive number of bytes!");
+        return false;
+    }
+
+    Event_loop* loop = get_loop(vm);
+    Wait* wait;
+    if (loop == NULL || (wait = start_wait(vm, loop, fd, WAIT_READ)) == NULL)
+        return false;
+    wait->max = AS_NUMBER(args[1]) < READ_MAX ? (int)AS_NUMBER(args[1])
+                                               : READ_MAX;
+    return wait_on(vm, loop, arg_count, fd, wait, result);
+}
+
+// write(fd, string) returns once all of the string is written, with its
+// length, or nil if the other end has gone.
+static bool write_native(VM* vm, int arg_count, Value* args,
+                         Value* result) {
+    int fd;
+    if (!check_fd(vm, args[0], &fd))
+        return false;
+    if (!IS_STRING(args[1])) {
+        runtime_error(vm, "Can only write strings!");
+        return false;
+    }
+
+    Event_loop* loop = get_loop(vm);
+    Wait* wait;
+    if (loop == NULL || (wait = start_wait(vm, loop, fd, WAIT_WRITE)) == NULL)
+        return false;
+    wait->data = AS_STRING(args[1]);
+    wait->offset = 0;
+    return wait_on(vm, loop, arg_count, fd, wait, result);
+}
+
+// accept(fd) returns the descriptor of the next connection to a listening
+// socket.
+static bool accept_native(VM* vm, int arg_count, Value* args,
+                          Value* result) {
+    int fd;
+    if (!check_fd(vm, args[0], &fd))
+        return false;
+
+    Event_loop* loop = get_loop(vm);
+    Wait* wait;
+    if (loop == NULL
+        || (wait = start_wait(vm, loop, fd, WAIT_ACCEPT)) == NULL)
+        return false;
+    return wait_on(vm, loop, arg_count, fd, wait, result);
+}
+
+// Starts connecting a new non-blocking socket, and waits for it to finish
+// if it doesn't at once. A refused connection is nil.
+static bool connect_to(VM* vm, int arg_count, int family,
+                       struct sockaddr* address, socklen_t length,
+                       Value* result) {
+    Event_loop* loop = get_loop(vm);
+    if (loop == NULL)
+        return false;
+
+    int fd = socket(family, SOCK_STREAM, 0);
+    if (fd < 0 || !set_non_blocking(fd)) {
+        if (fd >= 0)
+            close(fd);
+        runtime_error(vm, "Can't make a socket: %s!", strerror(errno));
+        return false;
+    }
+
+    if (connect(fd, address, length) == 0) {
+        *result = NUMBER_VAL(fd);
+        return true;
+    }
+    if (errno != EINPROGRESS && errno != EAGAIN) {
+        close(fd);
+        *result = NIL_VAL;
+        return true;
+    }
+
+    Wait* wait = start_wait(vm, loop, fd, WAIT_CONNECT);
+    if (wait == NULL) {
+        close(fd);
+        return false;
+    }
+    return wait_on(vm, loop, arg_count, fd, wait, result);
+}
+
+static bool unix_address(VM* vm, Value path, struct sockaddr_un* address) {
+    if (!IS_STRING(path)
+        || AS_STRING(path)->length >= (int)sizeof(address->sun_path)) {
+        runtime_error(vm, "Expected a socket path!");
+        return false;
+    }
+
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    memcpy(address->sun_path, AS_CSTRING(path), AS_STRING(path)->length);
+    return true;
+}
+
+// Addresses are numbers, so that nothing blocks on a name lookup.
+static bool tcp_address(VM* vm, const char* host, Value port,
+                        struct sockaddr_in* address) {
+    double number = IS_NUMBER(port) ? AS_NUMBER(port) : -1;
+    if (!(number >= 0 && number <= 65535) || (int)number != number) {
+        runtime_error(vm, "Expected a port number!");
+        return false;
+    }
+
+    memset(address, 0, sizeof(*address));
+    address->sin_family = AF_INET;
+    address->sin_port = htons((uint16_t)number);
+    if (inet_pton(AF_INET, host, &address->sin_addr) != 1) {
+        runtime_error(vm, "Expected an IPv4 address, not \"%s\"!", host);
+        return false;
+    }
+    return true;
+}
+
+static bool connect_unix_native(VM* vm, int arg_count, Value* args,
+                                Value* result) {
+    struct sockaddr_un address;
+    if (!unix_address(vm, args[0], &address))
+        return false;
+    return connect_to(vm, arg_count, AF_UNIX, (struct sockaddr*)&address,
+                      sizeof(address), result);
+}
+
+static bool connect_tcp_native(VM* vm, int arg_count, Value* args,
+                               Value* result) {
+    if (!IS_STRING(args[0])) {
+        runtime_error(vm, "Expected an IPv4 address!");
+        return false;
+    }
+
+    struct sockaddr_in address;
+    if (!tcp_address(vm, AS_CSTRING(args[0]), args[1], &address))
+        return false;
+    return connect_to(vm, arg_count, AF_INET, (struct sockaddr*)&address,
+                      sizeof(address), result);
+}
+
+static bool listen_on(VM* vm, int family, struct sockaddr* address,
+                      socklen_t length, Value* result) {
+    int fd = socket(family, SOCK_STREAM, 0);
+    int reuse = 1;
+    if (fd < 0 || !set_non_blocking(fd)
+        || (family == AF_INET
+            && setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse,
+                          sizeof(reuse)) != 0)
+        || bind(fd, address, length) != 0
+        || listen(fd, SOMAXCONN) != 0) {
+        runtime_error(vm, "Can't listen: %s!", strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    *result = NUMBER_VAL(fd);
+    return true;
+}
+
+// listen_unix(path) replaces any socket left at the path.
+static bool listen_unix_native(VM* vm, int arg_count, Value* args,
+                               Value* result) {
+    struct sockaddr_un address;
+    if (!unix_address(vm, args[0], &address))
+        return false;
+    unlink(address.sun_path);
+    return listen_on(vm, AF_UNIX, (struct sockaddr*)&address,
+                     sizeof(address), result);
+}
+
+// listen_tcp(port) listens on the loopback interface. Port 0 picks a free
+// one, which port() tells.
+static bool listen_tcp_native(VM* vm, int arg_count, Value* args,
+                              Value* result) {
+    struct sockaddr_in address;
+    if (!tcp_address(vm, "127.0.0.1", args[0], &address))
+        return false;
+    return listen_on(vm, AF_INET, (struct sockaddr*)&address,
+                     sizeof(address), result);
+}
+
+static bool port_native(VM* vm, int arg_count, Value* args, Value* result) {
+    int fd;
+    if (!check_fd(vm, args[0], &fd))
+        return false;
+
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    if (getsockname(fd, (struct sockaddr*)&address, &length) != 0
+        || address.sin_family != AF_INET) {
+        runtime_error(vm, "Descriptor %d isn't a TCP socket!", fd);
+        return false;
+    }
+
+    *result = NUMBER_VAL(ntohs(address.sin_port));
+    return true;
+}
+
+// open(path, mode) opens a file to read ("r"), to write from scratch
+// ("w") or to add to the end of ("a").
+static bool open_native(VM* vm, int arg_count, Value* args, Value* result) {
+    if (!IS_STRING(args[0]) || !IS_STRING(args[1])) {
+        runtime_error(vm, "Expected a path and a mode!");
+        return false;
+    }
+
+    const char* mode = AS_CSTRING(args[1]);
+    int flags;
+    if (strcmp(mode, "r") == 0)
+        flags = O_RDONLY;
+    else if (strcmp(mode, "w") == 0)
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    else if (strcmp(mode, "a") == 0)
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    else {
+        runtime_error(vm, "Unknown mode \"%s\"!", mode);
+        return false;
+    }
+
+    int fd = open(AS_CSTRING(args[0]), flags | O_NONBLOCK | O_CLOEXEC, 0644);
+    *result = fd >= 0 ? NUMBER_VAL(fd) : NIL_VAL;
+    return true;
+}
+
+// pipe() returns a list of the descriptor to read from and the one to
+// write to.
+static bool pipe_native(VM* vm, int arg_count, Value* args, Value* result) {
+    int fds[2];
+    if (pipe(fds) != 0 || !set_non_blocking(fds[0])
+        || !set_non_blocking(fds[1])) {
+        runtime_error(vm, "Can't make a pipe: %s!", strerror(errno));
+        return false;
+    }
+
+    Obj_list* list = new_list(vm);
+    push(vm, OBJ_VAL(list));
+    write_value_array(vm, &list->items, NUMBER_VAL(fds[0]));
+    write_value_array(vm, &list->items, NUMBER_VAL(fds[1]));
+    *result = pop(vm);
+    return true;
+}
+
+// close(fd) also ends whatever was waiting on the descriptor, with nil.
+static bool close_native(VM* vm, int arg_count, Value* args,
+                         Value* result) {
+    int fd;
+    if (!check_fd(vm, args[0], &fd))
+        return false;
+
+    Event_loop* loop = vm->loop;
+    if (loop != NULL && fd < loop->descriptor_capacity
+        && loop->descriptors[fd] != NULL) {
+        Descriptor* descriptor = loop->descriptors[fd];
+        if (descriptor->in.active)
+            finish_wait(loop, &descriptor->in, NIL_VAL);
+        if (descriptor->out.active)
+            finish_wait(loop, &descriptor->out, NIL_VAL);
+        watch(loop, fd, descriptor);
+    }
+
+    close(fd);
+    *result = NIL_VAL;
+    return true;
+}
+
+// Runs whatever tasks the script left behind once it has finished.
+bool run_event_loop(VM* vm) {
+    if (vm->loop == NULL)
+        return true;
+    return run_loop(vm, vm->loop, NULL, -1);
+}
+
+static void mark_wait(VM* vm, Wait* wait) {
+    mark_object(vm, (Obj*)wait->fiber);
+    mark_object(vm, (Obj*)wait->data);
+    mark_value(vm, wait->result);
+}
+
+void mark_event_loop(VM* vm) {
+    Event_loop* loop = vm->loop;
+    if (loop == NULL)
+        return;
+
+    for (int i = loop->ready_head; i < loop->ready_count; i++) {
+        mark_object(vm, (Obj*)loop->ready[i].fiber);
+        mark_value(vm, loop->ready[i].value);
+    }
+    for (int i = 0; i < loop->timer_count; i++)
+        mark_object(vm, (Obj*)loop->timers[i].fiber);
+    for (int i = 0; i < loop->descriptor_capacity; i++) {
+        if (loop->descriptors[i] != NULL) {
+            mark_wait(vm, &loop->descriptors[i]->in);
+            mark_wait(vm, &loop->descriptors[i]->out);
+        }
+    }
+    mark_object(vm, (Obj*)loop->current);
+}
+
+void free_event_loop(VM* vm) {
+    Event_loop* loop = vm->loop;
+    if (loop == NULL)
+        return;
+
+    for (int i = 0; i < loop->descriptor_capacity; i++)
+        free(loop->descriptors[i]);
+    free(loop->descriptors);
+    free(loop->ready);
+    free(loop->timers);
+    close(loop->epoll);
+    free(loop);
+    vm->loop = NULL;
+}
+
+void define_event_natives(VM* vm) {
+    define_native(vm, "accept", 1, accept_native);
+    define_native(vm, "close", 1, close_native);
+    define_native(vm, "connect_tcp", 2, connect_tcp_native);
+    define_native(vm, "connect_unix", 1, connect_unix_native);
+    define_native(vm, "go", NATIVE_VARIADIC, go_native);
+    define_native(vm, "listen_tcp", 1, listen_tcp_native);
+    define_native(vm, "listen_unix", 1, listen_unix_native);
+    define_native(vm, "open", 2, open_native);
+    define_native(vm, "pipe", 0, pipe_native);
+    define_native(vm, "port", 1, port_native);
+    define_native(vm, "read", 2, read_native);
+    define_native(vm, "run_tasks", 0, run_tasks_native);
+    define_native(vm, "sleep", 1, sleep_native);
+    define_native(vm, "write", 2, write_native);
+}
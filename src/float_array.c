@@ -0,0 +1,241 @@
+#include <limits.h>
+
+#include "float_array.h"
+#include "kernels.h"
+#include "object.h"
+#include "vm.h"
+
+// Natives over whole Float64Arrays. Those that compute an array write it
+// into one the caller passes first, and return that, so a loop can reuse
+// its arrays rather than allocate new ones on every pass.
+
+static bool check_array(VM* vm, Value value) {
+    if (IS_FLOAT_ARRAY(value))
+        return true;
+
+    runtime_error(vm, "Expected a Float64Array!");
+    return false;
+}
+
+static bool check_count(VM* vm, Value value, int limit, int* count) {
+    double number = IS_NUMBER(value) ? AS_NUMBER(value) : -1;
+    if (!(number >= 0 && number <= limit) || (int)number != number) {
+        runtime_error(vm, "Expected a whole number from 0 to %d!", limit);
+        return false;
+    }
+    *count = (int)number;
+    return true;
+}
+
+// The kernels can write over an input they are reading from at the same
+// place, but not one a view has shifted.
+static bool check_pair(VM* vm, Obj_float_array* out, Obj_float_array* a) {
+    if (out->count != a->count) {
+        runtime_error(vm, "Arrays must have the same length!");
+        return false;
+    }
+    if (out->values != a->values
+        && out->values < a->values + a->count
+        && a->values < out->values + out->count) {
+        runtime_error(vm, "Arrays can't partly overlap!");
+        return false;
+    }
+    return true;
+}
+
+// Checks that the first count arguments are arrays that fit together, the
+// first being where the result goes.
+static bool check_arrays(VM* vm, Value* args, int count) {
+    for (int i = 0; i < count; i++) {
+        if (!check_array(vm, args[i]))
+            return false;
+    }
+    for (int i = 1; i < count; i++) {
+        if (!check_pair(vm, AS_FLOAT_ARRAY(args[0]), AS_FLOAT_ARRAY(args[i])))
+            return false;
+    }
+    return true;
+}
+
+// Float64Array(count) is that many zeros, and Float64Array(list) holds the
+// numbers in the list.
+static bool float_array_native(VM* vm, int arg_count, Value* args,
+                               Value* result) {
+    if (!IS_LIST(args[0])) {
+        int count;
+        if (!check_count(vm, args[0], (int)(INT_MAX / sizeof(double)), &count))
+            return false;
+        *result = OBJ_VAL(new_float_array(vm, count));
+        return true;
+    }
+
+    Value_array* items = &AS_LIST(args[0])->items;
+    for (int i = 0; i < items->count; i++) {
+        if (!IS_NUMBER(items->values[i])) {
+            runtime_error(vm, "Arrays can only hold numbers!");
+            return false;
+        }
+    }
+
+    Obj_float_array* array = new_float_array(vm, items->count);
+    for (int i = 0; i < items->count; i++)
+        array->values[i] = AS_NUMBER(items->values[i]);
+    *result = OBJ_VAL(array);
+    return true;
+}
+
+static bool fill_native(VM* vm, int arg_count, Value* args, Value* result) {
+    if (!check_array(vm, args[0]))
+        return false;
+    if (!IS_NUMBER(args[1])) {
+        runtime_error(vm, "Arrays can only hold numbers!");
+        return false;
+    }
+
+    Obj_float_array* out = AS_FLOAT_ARRAY(args[0]);
+    kernels()->fill(out->values, AS_NUMBER(args[1]), out->count);
+    *result = args[0];
+    return true;
+}
+
+// add(out, a, b) sets each value in out to the sum of those in a and b.
+static bool add_native(VM* vm, int arg_count, Value* args, Value* result) {
+    if (!check_arrays(vm, args, 3))
+        return false;
+
+    Obj_float_array* out = AS_FLOAT_ARRAY(args[0]);
+    kernels()->add(out->values, AS_FLOAT_ARRAY(args[1])->values,
+                   AS_FLOAT_ARRAY(args[2])->values, out->count);
+    *result = args[0];
+    return true;
+}
+
+static bool mul_native(VM* vm, int arg_count, Value* args, Value* result) {
+    if (!check_arrays(vm, args, 3))
+        return false;
+
+    Obj_float_array* out = AS_FLOAT_ARRAY(args[0]);
+    kernels()->mul(out->values, AS_FLOAT_ARRAY(args[1])->values,
+                   AS_FLOAT_ARRAY(args[2])->values, out->count);
+    *result = args[0];
+    return true;
+}
+
+// scale(out, a, factor) sets out to a times the factor.
+static bool scale_native(VM* vm, int arg_count, Value* args,
+                         Value* result) {
+    if (!check_arrays(vm, args, 2))
+        return false;
+    if (!IS_NUMBER(args[2])) {
+        runtime_error(vm, "Can only scale by a number!");
+        return false;
+    }
+
+    Obj_float_array* out = AS_FLOAT_ARRAY(args[0]);
+    kernels()->scale(out->values, AS_FLOAT_ARRAY(args[1])->values,
+                     AS_NUMBER(args[2]), out->count);
+    *result = args[0];
+    return true;
+}
+
+// prefix_sum(out, a) sets each value in out to the sum of a up to and
+// including that one.
+static bool prefix_sum_native(VM* vm, int arg_count, Value* args,
+                              Value* result) {
+    if (!check_arrays(vm, args, 2))
+        return false;
+
+    Obj_float_array* out = AS_FLOAT_ARRAY(args[0]);
+    kernels()->prefix_sum(out->values, AS_FLOAT_ARRAY(args[1])->values,
+                          out->count);
+    *result = args[0];
+    return true;
+}
+
+static bool dot_native(VM* vm, int arg_count, Value* args, Value* result) {
+    if (!check_array(vm, args[0]) || !check_array(vm, args[1]))
+        return false;
+
+    Obj_float_array* a = AS_FLOAT_ARRAY(args[0]);
+    Obj_float_array* b = AS_FLOAT_ARRAY(args[1]);
+    if (a->count != b->count) {
+        runtime_error(vm, "Arrays must have the same length!");
+        return false;
+    }
+
+    *result = NUMBER_VAL(kernels()->dot(a->values, b->values, a->count));
+    return true;
+}
+
+static bool sum_native(VM* vm, int arg_count, Value* args, Value* result) {
+    if (!check_array(vm, args[0]))
+        return false;
+
+    Obj_float_array* a = AS_FLOAT_ARRAY(args[0]);
+    *result = NUMBER_VAL(kernels()->sum(a->values, a->count));
+    return true;
+}
+
+static bool check_not_empty(VM* vm, Value value) {
+    if (!check_array(vm, value))
+        return false;
+    if (AS_FLOAT_ARRAY(value)->count == 0) {
+        runtime_error(vm, "Array is empty!");
+        return false;
+    }
+    return true;
+}
+
+static bool min_native(VM* vm, int arg_count, Value* args, Value* result) {
+    if (!check_not_empty(vm, args[0]))
+        return false;
+
+    Obj_float_array* a = AS_FLOAT_ARRAY(args[0]);
+    *result = NUMBER_VAL(kernels()->min(a->values, a->count));
+    return true;
+}
+
+static bool max_native(VM* vm, int arg_count, Value* args, Value* result) {
+    if (!check_not_empty(vm, args[0]))
+        return false;
+
+    Obj_float_array* a = AS_FLOAT_ARRAY(args[0]);
+    *result = NUMBER_VAL(kernels()->max(a->values, a->count));
+    return true;
+}
+
+// slice(array, start, end) is a view of the values from start up to but
+// not including end. Writes through either one show up in the other.
+static bool slice_native(VM* vm, int arg_count, Value* args,
+                         Value* result) {
+    if (!check_array(vm, args[0]))
+        return false;
+
+    Obj_float_array* array = AS_FLOAT_ARRAY(args[0]);
+    int start;
+    int end;
+    if (!check_count(vm, args[1], array->count, &start)
+        || !check_count(vm, args[2], array->count, &end))
+        return false;
+    if (end < start) {
+        runtime_error(vm, "Slice ends before it starts!");
+        return false;
+    }
+
+    *result = OBJ_VAL(new_float_view(vm, array, start, end - start));
+    return true;
+}
+
+void define_float_array_natives(VM* vm) {
+    define_native(vm, "Float64Array", 1, float_array_native);
+    define_native(vm, "add", 3, add_native);
+    define_native(vm, "dot", 2, dot_native);
+    define_native(vm, "fill", 2, fill_native);
+    define_native(vm, "max", 1, max_native);
+    define_native(vm, "min", 1, min_native);
+    define_native(vm, "mul", 3, mul_native);
+    define_native(vm, "prefix_sum", 2, prefix_sum_native);
+    define_native(vm, "scale", 3, scale_native);
+    define_native(vm, "slice", 3, slice_native);
+    define_native(vm, "sum", 1, sum_native);
+}
@@ -0,0 +1,767 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "intern.h"
+#include "memory.h"
+#include "table.h"
+#include "vm.h"
+
+// An image is a header followed by fixed-size string, function and
+// constant records, and then the raw string, line and code data. Records
+// refer to data by file offset and to each other by index, so an image
+// carries no pointers. Functions are stored children first and the script
+// function is named in the header. Integers use the byte order of the
+// machine that wrote the image; a marker in the header rejects foreign ones.
+// Nothing in the layout depends on where the image sits in memory, so it is
+// mapped read-only and functions run straight out of the mapping.
+
+#define IMAGE_MAGIC "LOXC"
+#define IMAGE_BYTE_ORDER 0x01020304u
+#define IMAGE_NONE UINT32_MAX
+
+// Options an image was compiled with. The peephole rewrites go above these.
+#define IMAGE_OPTIMIZED 1
+#define IMAGE_INLINED_GLOBALS 2
+#define IMAGE_PEEPHOLE_SHIFT 2
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t file_size;
+    uint32_t string_count;
+    uint32_t function_count;
+    uint32_t constant_count;
+    uint32_t main_function;
+    uint32_t strings_offset;
+    uint32_t functions_offset;
+    uint32_t constants_offset;
+    uint32_t options;       // How the code was optimized.
+} Image_header;
+
+typedef struct {
+    uint32_t offset;
+    uint32_t length;
+} Image_string;
+
+typedef struct {
+    uint32_t name;
+    uint32_t arity;
+    uint32_t upvalue_count;
+    uint32_t code_count;
+    uint32_t code_offset;
+    uint32_t lines_offset;
+    uint32_t constants_start;
+    uint32_t constant_count;
+} Image_function;
+
+typedef enum {
+    IMAGE_NIL,
+    IMAGE_BOOL,
+    IMAGE_NUMBER,
+    IMAGE_STRING,
+    IMAGE_FUNCTION
+} Image_constant_type;
+
+typedef struct {
+    uint32_t type;
+    uint32_t index;     // Boolean value, string or function index.
+    double number;
+} Image_constant;
+
+typedef struct {
+    bool failed;
+    Table string_indices;
+    Value_array strings;
+    Value_array functions;
+
+    int function_capacity;
+    Image_function* function_records;
+    int constant_count;
+    int constant_capacity;
+    Image_constant* constant_records;
+} Image_writer;
+
+static uint32_t add_string(VM* vm, Image_writer* writer, Obj_string* string) {
+    Value index;
+    if (table_get(&writer->string_indices, string, &index))
+        return (uint32_t)AS_NUMBER(index);
+
+    write_value_array(vm, &writer->strings, OBJ_VAL(string));
+    table_set(vm, &writer->string_indices, string,
+              NUMBER_VAL(writer->strings.count - 1));
+    return (uint32_t)writer->strings.count - 1;
+}
+
+static void add_constant_record(VM* vm, Image_writer* writer,
+                                Image_constant record) {
+    if (writer->constant_capacity < writer->constant_count + 1) {
+        int old_capacity = writer->constant_capacity;
+        writer->constant_capacity = GROW_CAPACITY(old_capacity);
+        writer->constant_records = GROW_ARRAY(vm, Image_constant,
+                                              writer->constant_records,
+                                              old_capacity,
+                                              writer->constant_capacity);
+    }
+
+    writer->constant_records[writer->constant_count++] = record;
+}
+
+static uint32_t collect_function(VM* vm, Image_writer* writer,
+                                 Obj_function* function) {
+    if (function->image != NULL && !link_image_function(vm, function))
+        writer->failed = true;
+    Value_array* constants = &function->chunk.constants;
+
+    // Children go first so that loading never refers forward.
+    uint32_t* children = malloc(sizeof(uint32_t) * (constants->count + 1));
+    if (children == NULL)
+        exit(1);
+    for (int i = 0; i < constants->count; i++) {
+        if (IS_FUNCTION(constants->values[i]))
+            children[i] = collect_function(vm, writer,
+                                           AS_FUNCTION(constants->values[i]));
+    }
+
+    Image_function record;
+    record.name = function->name != NULL
+                      ? add_string(vm, writer, function->name)
+                      : IMAGE_NONE;
+    record.arity = (uint32_t)function->arity;
+    record.upvalue_count = (uint32_t)function->upvalue_count;
+    record.code_count = (uint32_t)function->chunk.count;
+    record.code_offset = 0;
+    record.lines_offset = 0;
+    record.constants_start = (uint32_t)writer->constant_count;
+    record.constant_count = (uint32_t)constants->count;
+
+    for (int i = 0; i < constants->count; i++) {
+        Value value = constants->values[i];
+        Image_constant constant = {IMAGE_NIL, 0, 0};
+
+        if (IS_BOOL(value)) {
+            constant.type = IMAGE_BOOL;
+            constant.index = AS_BOOL(value) ? 1 : 0;
+        } else if (IS_NUMBER(value)) {
+            constant.type = IMAGE_NUMBER;
+            constant.number = AS_NUMBER(value);
+        } else if (IS_STRING(value)) {
+            constant.type = IMAGE_STRING;
+            constant.index = add_string(vm, writer, AS_STRING(value));
+        } else if (IS_FUNCTION(value)) {
+            constant.type = IMAGE_FUNCTION;
+            constant.index = children[i];
+        }
+
+        add_constant_record(vm, writer, constant);
+    }
+    free(children);
+
+    if (writer->function_capacity < writer->functions.count + 1) {
+        int old_capacity = writer->function_capacity;
+        writer->function_capacity = GROW_CAPACITY(old_capacity);
+        writer->function_records = GROW_ARRAY(vm, Image_function,
+                                              writer->function_records,
+                                              old_capacity,
+                                              writer->function_capacity);
+    }
+    writer->function_records[writer->functions.count] = record;
+    write_value_array(vm, &writer->functions, OBJ_VAL(function));
+
+    return (uint32_t)writer->functions.count - 1;
+}
+
+static uint64_t align(uint64_t offset, uint64_t alignment) {
+    return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+// The optimizer settings the VM compiles with.
+static uint32_t compile_options(VM* vm) {
+    uint32_t options = (uint32_t)vm->peephole << IMAGE_PEEPHOLE_SHIFT;
+    if (vm->optimize)
+        options |= IMAGE_OPTIMIZED;
+    if (vm->optimize && vm->inline_globals)
+        options |= IMAGE_INLINED_GLOBALS;
+    return options;
+}
+
+static bool options_fit(VM* vm, uint32_t options, bool same_options) {
+    if (same_options)
+        return options == compile_options(vm);
+    // Inlined calls rely on nothing else rebinding the globals.
+    return !(options & IMAGE_INLINED_GLOBALS) || vm->inline_globals;
+}
+
+static void write_padding(FILE* file, uint64_t* position, uint64_t target) {
+    static const uint8_t zeroes[8] = {0};
+    fwrite(zeroes, 1, target - *position, file);
+    *position = target;
+}
+
+bool write_image(VM* vm, Obj_function* function, const char* path) {
+    // The writer's own allocations may trigger a collection.
+    push(vm, OBJ_VAL(function));
+
+    Image_writer writer;
+    writer.failed = false;
+    init_table(&writer.string_indices);
+    init_value_array(&writer.strings);
+    init_value_array(&writer.functions);
+    writer.function_capacity = 0;
+    writer.function_records = NULL;
+    writer.constant_count = 0;
+    writer.constant_capacity = 0;
+    writer.constant_records = NULL;
+
+    uint32_t main_function = collect_function(vm, &writer, function);
+
+    Image_header header;
+    memcpy(header.magic, IMAGE_MAGIC, 4);
+    header.version = IMAGE_VERSION;
+    header.byte_order = IMAGE_BYTE_ORDER;
+    header.string_count = (uint32_t)writer.strings.count;
+    header.function_count = (uint32_t)writer.functions.count;
+    header.constant_count = (uint32_t)writer.constant_count;
+    header.main_function = main_function;
+    header.options = compile_options(vm);
+
+    // Lay the file out.
+    uint64_t offset = sizeof(Image_header);
+    header.strings_offset = (uint32_t)offset;
+    offset += sizeof(Image_string) * header.string_count;
+    offset = align(offset, 8);
+    header.functions_offset = (uint32_t)offset;
+    offset += sizeof(Image_function) * header.function_count;
+    offset = align(offset, 8);
+    header.constants_offset = (uint32_t)offset;
+    offset += sizeof(Image_constant) * header.constant_count;
+
+    uint64_t string_data = offset;
+    for (int i = 0; i < writer.strings.count; i++)
+        offset += AS_STRING(writer.strings.values[i])->length + 1;
+
+    offset = align(offset, sizeof(int));
+    uint64_t line_data = offset;
+    for (int i = 0; i < writer.functions.count; i++) {
+        writer.function_records[i].lines_offset = (uint32_t)offset;
+        offset += sizeof(int) * writer.function_records[i].code_count;
+    }
+    uint64_t code_data = offset;
+    for (int i = 0; i < writer.functions.count; i++) {
+        writer.function_records[i].code_offset = (uint32_t)offset;
+        offset += writer.function_records[i].code_count;
+    }
+    header.file_size = (uint32_t)offset;
+
+    bool success = false;
+    FILE* file = !writer.failed && offset <= UINT32_MAX
+                     ? fopen(path, "wb")
+                     : NULL;
+    if (file != NULL) {
+        uint64_t position = 0;
+        fwrite(&header, sizeof(header), 1, file);
+        position += sizeof(header);
+
+        uint64_t chars = string_data;
+        for (int i = 0; i < writer.strings.count; i++) {
+            Obj_string* string = AS_STRING(writer.strings.values[i]);
+            Image_string record = {(uint32_t)chars, (uint32_t)string->length};
+            fwrite(&record, sizeof(record), 1, file);
+            chars += string->length + 1;
+        }
+        position += sizeof(Image_string) * header.string_count;
+
+        write_padding(file, &position, header.functions_offset);
+        fwrite(writer.function_records, sizeof(Image_function),
+               header.function_count, file);
+        position += sizeof(Image_function) * header.function_count;
+
+        write_padding(file, &position, header.constants_offset);
+        fwrite(writer.constant_records, sizeof(Image_constant),
+               header.constant_count, file);
+        position += sizeof(Image_constant) * header.constant_count;
+
+        for (int i = 0; i < writer.strings.count; i++) {
+            Obj_string* string = AS_STRING(writer.strings.values[i]);
+            fwrite(string->chars, 1, string->length + 1, file);
+            position += string->length + 1;
+        }
+
+        write_padding(file, &position, line_data);
+        for (int i = 0; i < writer.functions.count; i++) {
+            Chunk* chunk = &AS_FUNCTION(writer.functions.values[i])->chunk;
+            fwrite(chunk->lines, sizeof(int), chunk->count, file);
+            position += sizeof(int) * chunk->count;
+        }
+
+        write_padding(file, &position, code_data);
+        for (int i = 0; i < writer.functions.count; i++) {
+            Chunk* chunk = &AS_FUNCTION(writer.functions.values[i])->chunk;
+            fwrite(chunk->code, 1, chunk->count, file);
+        }
+
+        success = !ferror(file);
+        if (fclose(file) != 0)
+            success = false;
+    }
+
+    FREE_ARRAY(vm, Image_function, writer.function_records,
+               writer.function_capacity);
+    FREE_ARRAY(vm, Image_constant, writer.constant_records,
+               writer.constant_capacity);
+    free_value_array(vm, &writer.functions);
+    free_value_array(vm, &writer.strings);
+    free_table(vm, &writer.string_indices);
+    pop(vm);
+
+    return success;
+}
+
+static bool in_bounds(const Image_header* header, uint64_t offset,
+                      uint64_t size) {
+    return offset <= header->file_size && size <= header->file_size - offset;
+}
+
+// Length of the instruction at offset with its operands, or 0 if it
+// can't be worked out.
+static uint32_t code_length(const uint8_t* code, uint32_t count,
+                            uint32_t offset, const Image_function* functions,
+                            const Image_function* function,
+                            const Image_constant* pool) {
+    uint8_t instruction = code[offset];
+    if (instruction == OP_CLOSURE && offset + 1 < count
+        && code[offset + 1] < function->constant_count
+        && pool[code[offset + 1]].type == IMAGE_FUNCTION)
+        return 2 + 2 * functions[pool[code[offset + 1]].index].upvalue_count;
+    return (uint32_t)fixed_instruction_length(instruction);
+}
+
+static bool reach(int* depths, uint32_t* worklist, uint32_t* pending,
+                  uint32_t offset, int depth) {
+    if (depths[offset] == -1) {
+        depths[offset] = depth;
+        worklist[(*pending)++] = offset;
+        return true;
+    }
+
+    // Every path to an instruction has to agree on the stack.
+    return depths[offset] == depth;
+}
+
+// Works out the stack depth before each instruction, the way the
+// optimizer does, starting above the callee and its arguments. Nothing
+// may read a slot or pop a value below the frame. Relies on the code's
+// lengths and jumps having been checked.
+static bool verify_depth(const uint8_t* code, const Image_function* functions,
+                         const Image_function* function,
+                         const Image_constant* pool) {
+    uint32_t count = function->code_count;
+    int* depths = malloc(sizeof(int) * count);
+    uint32_t* worklist = malloc(sizeof(uint32_t) * count);
+    if (depths == NULL || worklist == NULL)
+        exit(1);
+    for (uint32_t i = 0; i < count; i++)
+        depths[i] = -1;
+
+    uint32_t pending = 0;
+    bool valid = reach(depths, worklist, &pending, 0,
+                       (int)function->arity + 1);
+    while (valid && pending > 0) {
+        uint32_t offset = worklist[--pending];
+        int depth = depths[offset];
+
+        for (;;) {
+            uint8_t instruction = code[offset];
+            uint32_t length = code_length(code, count, offset, functions,
+                                          function, pool);
+            int pops, pushes;
+            stack_effect(code + offset, &pops, &pushes);
+
+            // Values looked at without being popped.
+            int reads = pops;
+            switch (instruction) {
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+                reads = code[offset + 1] + 1;
+                break;
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE:
+                reads = 1;
+                break;
+            case OP_METHOD:
+                reads = 2;
+                break;
+            case OP_CLOSURE:
+                for (uint32_t i = offset + 2; i < offset + length; i += 2) {
+                    if (code[i] == 1 && code[i + 1] + 1 > reads)
+                        reads = code[i + 1] + 1;
+                }
+                break;
+            }
+            if (reads > depth) {
+                valid = false;
+                break;
+            }
+            depth += pushes - pops;
+
+            if (instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE
+                || instruction == OP_JUMP_IF_TRUE || instruction == OP_LOOP) {
+                int64_t jump = (code[offset + 1] << 8) | code[offset + 2];
+                int64_t target = offset + 3
+                                 + (instruction == OP_LOOP ? -jump : jump);
+                valid = reach(depths, worklist, &pending, (uint32_t)target,
+                              depth);
+            }
+            if (!valid || instruction == OP_RETURN || instruction == OP_JUMP
+                || instruction == OP_LOOP)
+                break;
+
+            // The code ends in a return or a loop, so there's always a
+            // next instruction to fall through to.
+            offset += length;
+            if (depths[offset] != -1) {
+                valid = depths[offset] == depth;
+                break;
+            }
+            depths[offset] = depth;
+        }
+    }
+
+    free(worklist);
+    free(depths);
+    return valid;
+}
+
+static bool verify_code(const uint8_t* image, const Image_function* functions,
+                        const Image_constant* constants, uint32_t index) {
+    const Image_function* function = &functions[index];
+    const uint8_t* code = image + function->code_offset;
+    const Image_constant* pool = constants + function->constants_start;
+    uint32_t count = function->code_count;
+
+    bool* starts = calloc(count + 1, sizeof(bool));
+    if (starts == NULL)
+        exit(1);
+
+    bool valid = count > 0;
+    uint32_t last = 0;
+    for (uint32_t offset = 0; valid && offset < count; ) {
+        uint8_t instruction = code[offset];
+        uint32_t length = code_length(code, count, offset, functions,
+                                      function, pool);
+        if (length == 0 || length > count - offset) {
+            valid = false;
+            break;
+        }
+
+        switch (instruction) {
+        case OP_CONSTANT:
+            valid = code[offset + 1] < function->constant_count;
+            break;
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+            valid = code[offset + 1] < function->constant_count
+                    && pool[code[offset + 1]].type == IMAGE_STRING;
+            break;
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+            valid = code[offset + 1] < function->upvalue_count;
+            break;
+        case OP_CLOSURE:
+            for (uint32_t i = offset + 2; valid && i < offset + length; i += 2)
+                valid = code[i] == 1
+                        || (code[i] == 0
+                            && code[i + 1] < function->upvalue_count);
+            break;
+        }
+
+        starts[offset] = true;
+        last = offset;
+        offset += length;
+    }
+
+    // Every jump must land on an instruction and the code can't run off
+    // its end. Optimized code may end in a loop with no way out.
+    valid = valid && (code[last] == OP_RETURN || code[last] == OP_LOOP);
+    for (uint32_t offset = 0; valid && offset < count; offset++) {
+        if (!starts[offset])
+            continue;
+
+        uint8_t instruction = code[offset];
+        if (instruction != OP_JUMP && instruction != OP_JUMP_IF_FALSE
+            && instruction != OP_JUMP_IF_TRUE && instruction != OP_LOOP)
+            continue;
+
+        int64_t jump = (code[offset + 1] << 8) | code[offset + 2];
+        int64_t target = offset + 3
+                         + (instruction == OP_LOOP ? -jump : jump);
+        valid = target >= 0 && target < count && starts[target];
+    }
+
+    free(starts);
+    return valid && verify_depth(code, functions, function, pool);
+}
+
+// Only the header is checked when an image is opened. Each function is
+// checked as it is loaded and its code and constants when it is linked, so
+// that pages of the image are only touched once they're needed.
+static bool validate_header(const uint8_t* image, size_t size) {
+    if (size < sizeof(Image_header))
+        return false;
+
+    const Image_header* header = (const Image_header*)image;
+    return memcmp(header->magic, IMAGE_MAGIC, 4) == 0
+           && header->version == IMAGE_VERSION
+           && header->byte_order == IMAGE_BYTE_ORDER
+           && header->file_size == size
+           && header->main_function < header->function_count
+           && header->functions_offset % 8 == 0
+           && header->constants_offset % 8 == 0
+           && in_bounds(header, header->strings_offset,
+                        (uint64_t)sizeof(Image_string)
+                            * header->string_count)
+           && in_bounds(header, header->functions_offset,
+                        (uint64_t)sizeof(Image_function)
+                            * header->function_count)
+           && in_bounds(header, header->constants_offset,
+                        (uint64_t)sizeof(Image_constant)
+                            * header->constant_count);
+}
+
+static bool validate_function(const Image_header* header,
+                              const Image_function* function) {
+    return (function->name == IMAGE_NONE
+            || function->name < header->string_count)
+           && function->arity <= UINT8_MAX
+           && function->upvalue_count <= UINT8_COUNT
+           && function->code_count <= INT32_MAX
+           && function->lines_offset % sizeof(int) == 0
+           && in_bounds(header, function->code_offset, function->code_count)
+           && in_bounds(header, function->lines_offset,
+                        (uint64_t)sizeof(int) * function->code_count)
+           && function->constant_count <= UINT8_COUNT
+           && function->constants_start <= header->constant_count
+           && function->constant_count
+              <= header->constant_count - function->constants_start;
+}
+
+static bool validate_constants(const Image_header* header,
+                               const Image_constant* constants,
+                               const Image_function* function,
+                               uint32_t index) {
+    for (uint32_t i = 0; i < function->constant_count; i++) {
+        const Image_constant* constant = &constants[function->constants_start
+                                                    + i];
+        switch (constant->type) {
+        case IMAGE_NIL:
+        case IMAGE_NUMBER:
+            break;
+        case IMAGE_BOOL:
+            if (constant->index > 1)
+                return false;
+            break;
+        case IMAGE_STRING:
+            if (constant->index >= header->string_count)
+                return false;
+            break;
+        case IMAGE_FUNCTION:
+            // Children are stored before their parents.
+            if (constant->index >= index)
+                return false;
+            break;
+        default:
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static Obj_string* image_string(VM* vm, const uint8_t* image, uint32_t index) {
+    const Image_header* header = (const Image_header*)image;
+    const Image_string* string
+            = &((const Image_string*)(image + header->strings_offset))[index];
+
+    if (string->length > INT32_MAX - 1
+        || !in_bounds(header, string->offset, (uint64_t)string->length + 1)
+        || image[string->offset + string->length] != '\0')
+        return NULL;
+
+    return copy_string(vm, (const char*)image + string->offset,
+                       (int)string->length);
+}
+
+// Creates the function with its code and lines pointing into the image.
+// Its constants are filled in by link_image_function(VM* vm) on the first call.
+static Obj_function* load_function(VM* vm, const uint8_t* image,
+                                   uint32_t index) {
+    const Image_header* header = (const Image_header*)image;
+    const Image_function* record
+            = &((const Image_function*)(image + header->functions_offset))
+                    [index];
+    if (!validate_function(header, record))
+        return NULL;
+
+    Obj_function* function = new_function(vm);
+    function->arity = (int)record->arity;
+    function->upvalue_count = (int)record->upvalue_count;
+    function->chunk.code = (uint8_t*)(image + record->code_offset);
+    function->chunk.lines = (int*)(image + record->lines_offset);
+    function->chunk.count = (int)record->code_count;
+    function->image = image;
+    function->image_index = index;
+
+    if (record->name != IMAGE_NONE) {
+        push(vm, OBJ_VAL(function));
+        function->name = image_string(vm, image, record->name);
+        pop(vm);
+        if (function->name == NULL)
+            return NULL;
+    }
+
+    return function;
+}
+
+bool link_image_function(VM* vm, Obj_function* function) {
+    const uint8_t* image = function->image;
+    const Image_header* header = (const Image_header*)image;
+    const Image_function* functions
+            = (const Image_function*)(image + header->functions_offset);
+    const Image_constant* constants
+            = (const Image_constant*)(image + header->constants_offset);
+    const Image_function* record = &functions[function->image_index];
+
+    if (!validate_constants(header, constants, record, function->image_index)
+        || !verify_code(image, functions, constants, function->image_index))
+        return false;
+
+    // The caller keeps the function reachable, and with it every constant
+    // stored so far. If one can't be loaded, the function is left as it
+    // was, so that linking it again starts over.
+    Value_array* pool = &function->chunk.constants;
+    pool->values = GROW_ARRAY(vm, Value, NULL, 0, record->constant_count);
+    pool->capacity = (int)record->constant_count;
+    bool linked = true;
+    for (uint32_t i = 0; linked && i < record->constant_count; i++) {
+        const Image_constant* constant = &constants[record->constants_start
+                                                    + i];
+        Value value = NIL_VAL;
+        switch (constant->type) {
+        case IMAGE_BOOL:
+            value = BOOL_VAL(constant->index != 0);
+            break;
+        case IMAGE_NUMBER:
+            value = NUMBER_VAL(constant->number);
+            break;
+        case IMAGE_STRING:
+        {
+            Obj_string* string = image_string(vm, image, constant->index);
+            linked = string != NULL;
+            if (linked)
+                value = OBJ_VAL(string);
+            break;
+        }
+        case IMAGE_FUNCTION:
+        {
+            Obj_function* child = load_function(vm, image, constant->index);
+            linked = child != NULL;
+            if (linked)
+                value = OBJ_VAL(child);
+            break;
+        }
+        }
+        if (linked)
+            pool->values[pool->count++] = value;
+    }
+
+    if (!linked) {
+        FREE_ARRAY(vm, Value, pool->values, pool->capacity);
+        init_value_array(pool);
+        return false;
+    }
+
+    function->image = NULL;
+    return true;
+}
+
+Obj_function* read_image(VM* vm, const char* path, bool same_options) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat image_stat;
+    if (fstat(fd, &image_stat) != 0 || image_stat.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+
+    // A private read-only mapping lets every process running the same
+    // image share its pages.
+    size_t size = (size_t)image_stat.st_size;
+    uint8_t* image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+        return NULL;
+
+    Obj_function* function = NULL;
+    if (validate_header(image, size)
+        && options_fit(vm, ((const Image_header*)image)->options,
+                       same_options)) {
+        const Image_header* header = (const Image_header*)image;
+        intern_set_reserve(vm, &vm->strings, (int)header->string_count);
+        function = load_function(vm, image, header->main_function);
+    }
+
+    if (function == NULL) {
+        munmap(image, size);
+        return NULL;
+    }
+
+    // Functions borrow their code from the mapping, so it lives as long as
+    // the VM.
+    push(vm, OBJ_VAL(function));
+    Mapped_image* mapped = ALLOCATE(vm, Mapped_image, 1);
+    mapped->base = image;
+    mapped->size = size;
+    mapped->next = vm->images;
+    vm->images = mapped;
+    pop(vm);
+
+    return function;
+}
+
+void free_images(VM* vm) {
+    Mapped_image* mapped = vm->images;
+    while (mapped != NULL) {
+        Mapped_image* next = mapped->next;
+        munmap(mapped->base, mapped->size);
+        FREE(vm, Mapped_image, mapped);
+        mapped = next;
+    }
+    vm->images = NULL;
+}
+
+// Images handed over to a segment are no longer accounted to any VM.
+void unmap_images(Mapped_image* images) {
+    while (images != NULL) {
+        Mapped_image* next = images->next;
+        munmap(images->base, images->size);
+        free(images);
+        images = next;
+    }
+}
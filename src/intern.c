@@ -0,0 +1,104 @@
+#include <string.h>
+
+#include "intern.h"
+#include "memory.h"
+#include "object.h"
+
+#define INTERN_MAX_LOAD 0.75
+
+// Deleted slots point here so probe sequences stay unbroken.
+static Obj_string tombstone_string;
+#define TOMBSTONE (&tombstone_string)
+
+void init_intern_set(Intern_set* set) {
+    set->count = 0;
+    set->capacity = 0;
+    set->keys = NULL;
+}
+
+void free_intern_set(VM* vm, Intern_set* set) {
+    FREE_ARRAY(vm, Obj_string*, set->keys, set->capacity);
+    init_intern_set(set);
+}
+
+static void adjust_capacity(VM* vm, Intern_set* set, int capacity) {
+    Obj_string** keys = ALLOCATE(vm, Obj_string*, capacity);
+    for (int i = 0; i < capacity; i++)
+        keys[i] = NULL;
+
+    set->count = 0;
+    for (int i = 0; i < set->capacity; i++) {
+        Obj_string* key = set->keys[i];
+        if (key == NULL || key == TOMBSTONE)
+            continue;
+
+        uint32_t index = key->hash & (capacity - 1);
+        while (keys[index] != NULL)
+            index = (index + 1) & (capacity - 1);
+        keys[index] = key;
+        set->count++;
+    }
+
+    FREE_ARRAY(vm, Obj_string*, set->keys, set->capacity);
+    set->keys = keys;
+    set->capacity = capacity;
+}
+
+// Makes room for count more strings so interning them in bulk doesn't keep
+// rehashing the set.
+void intern_set_reserve(VM* vm, Intern_set* set, int count) {
+    int capacity = set->capacity;
+    while (set->count + count > capacity * INTERN_MAX_LOAD)
+        capacity = GROW_CAPACITY(capacity);
+
+    if (capacity != set->capacity)
+        adjust_capacity(vm, set, capacity);
+}
+
+// Looks the string up and, if it isn't interned yet, stores the index of
+// the slot where it should go. The set is grown up front, so the slot stays
+// valid across the allocation of the new string: a collection in between
+// only turns live slots into tombstones.
+Obj_string* intern_set_find(VM* vm, Intern_set* set, const char* chars,
+                            int length, uint32_t hash, int* insert_index) {
+    if (set->count + 1 > set->capacity * INTERN_MAX_LOAD)
+        adjust_capacity(vm, set, GROW_CAPACITY(set->capacity));
+
+    uint32_t index = hash & (set->capacity - 1);
+    int tombstone = -1;
+
+    for (;;) {
+        Obj_string* key = set->keys[index];
+
+        if (key == NULL) {
+            // Empty slot, the string isn't interned.
+            *insert_index = tombstone != -1 ? tombstone : (int)index;
+            return NULL;
+        } else if (key == TOMBSTONE) {
+            if (tombstone == -1)
+                tombstone = (int)index;
+        } else if (key->hash == hash
+                   && key->length == length
+                   && memcmp(key->chars, chars, length) == 0) {
+            // Found it.
+            return key;
+        }
+
+        index = (index + 1) & (set->capacity - 1);
+    }
+}
+
+void intern_set_insert(Intern_set* set, int index, Obj_string* string) {
+    // Tombstones are already accounted for in the count.
+    if (set->keys[index] == NULL)
+        set->count++;
+    set->keys[index] = string;
+}
+
+void intern_set_remove_white(Intern_set* set) {
+    for (int i = 0; i < set->capacity; i++) {
+        Obj_string* key = set->keys[i];
+        if (key != NULL && key != TOMBSTONE && !key->obj.is_marked)
+            set->keys[i] = TOMBSTONE;
+    }
+}
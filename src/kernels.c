@@ -0,0 +1,427 @@
+#include <math.h>
+#include <pthread.h>
+
+#include "kernels.h"
+
+// Every kernel has a plain loop that works anywhere. On x86-64, where SSE2
+// is always there, those are replaced by SSE2 versions, and by AVX2 ones
+// when the CPU turns out to have it. The AVX2 code is compiled for that
+// target alone, so the rest of the program still runs on older machines.
+#if defined(__x86_64__) && defined(__GNUC__)
+#define KERNELS_X86
+#include <immintrin.h>
+#endif
+
+static void add_scalar(double* out, const double* a, const double* b,
+                       int count) {
+    for (int i = 0; i < count; i++)
+        out[i] = a[i] + b[i];
+}
+
+static void mul_scalar(double* out, const double* a, const double* b,
+                       int count) {
+    for (int i = 0; i < count; i++)
+        out[i] = a[i] * b[i];
+}
+
+static void scale_scalar(double* out, const double* a, double factor,
+                         int count) {
+    for (int i = 0; i < count; i++)
+        out[i] = a[i] * factor;
+}
+
+static void fill_scalar(double* out, double value, int count) {
+    for (int i = 0; i < count; i++)
+        out[i] = value;
+}
+
+static void prefix_sum_scalar(double* out, const double* a, int count) {
+    double total = 0;
+    for (int i = 0; i < count; i++) {
+        total += a[i];
+        out[i] = total;
+    }
+}
+
+static double dot_scalar(const double* a, const double* b, int count) {
+    double total = 0;
+    for (int i = 0; i < count; i++)
+        total += a[i] * b[i];
+    return total;
+}
+
+static double sum_scalar(const double* a, int count) {
+    double total = 0;
+    for (int i = 0; i < count; i++)
+        total += a[i];
+    return total;
+}
+
+// Min and max give the first NaN in the array if there is one, and take
+// -0 to be less than 0, whichever loop runs.
+static double least_of(double x, double y) {
+    if (x != x)
+        return x;
+    if (y != y)
+        return y;
+    if (x == y)
+        return signbit(x) ? x : y;
+    return x < y ? x : y;
+}
+
+static double most_of(double x, double y) {
+    if (x != x)
+        return x;
+    if (y != y)
+        return y;
+    if (x == y)
+        return signbit(x) ? y : x;
+    return x > y ? x : y;
+}
+
+// Only equal values and NaNs need the slow comparison.
+static double min_scalar(const double* a, int count) {
+    double least = a[0];
+    for (int i = 1; i < count; i++) {
+        if (a[i] < least)
+            least = a[i];
+        else if (!(a[i] > least))
+            least = least_of(least, a[i]);
+    }
+    return least;
+}
+
+static double max_scalar(const double* a, int count) {
+    double most = a[0];
+    for (int i = 1; i < count; i++) {
+        if (a[i] > most)
+            most = a[i];
+        else if (!(a[i] < most))
+            most = most_of(most, a[i]);
+    }
+    return most;
+}
+
+#ifdef KERNELS_X86
+
+// Loads and stores are unaligned, since a view can start anywhere in its
+// array. Whatever is left over after the last full vector goes through
+// the plain loop.
+
+static double sum_pair(__m128d pair) {
+    return _mm_cvtsd_f64(_mm_add_sd(pair, _mm_unpackhi_pd(pair, pair)));
+}
+
+static void add_sse2(double* out, const double* a, const double* b,
+                     int count) {
+    int i = 0;
+    for (; i + 2 <= count; i += 2)
+        _mm_storeu_pd(out + i, _mm_add_pd(_mm_loadu_pd(a + i),
+                                          _mm_loadu_pd(b + i)));
+    add_scalar(out + i, a + i, b + i, count - i);
+}
+
+static void mul_sse2(double* out, const double* a, const double* b,
+                     int count) {
+    int i = 0;
+    for (; i + 2 <= count; i += 2)
+        _mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(a + i),
+                                          _mm_loadu_pd(b + i)));
+    mul_scalar(out + i, a + i, b + i, count - i);
+}
+
+static void scale_sse2(double* out, const double* a, double factor,
+                       int count) {
+    __m128d factors = _mm_set1_pd(factor);
+    int i = 0;
+    for (; i + 2 <= count; i += 2)
+        _mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(a + i), factors));
+    scale_scalar(out + i, a + i, factor, count - i);
+}
+
+static void fill_sse2(double* out, double value, int count) {
+    __m128d values = _mm_set1_pd(value);
+    int i = 0;
+    for (; i + 2 <= count; i += 2)
+        _mm_storeu_pd(out + i, values);
+    fill_scalar(out + i, value, count - i);
+}
+
+// Each pair [x, y] becomes [x, x + y], and then has the running total of
+// everything before it added to both halves.
+static void prefix_sum_sse2(double* out, const double* a, int count) {
+    __m128d total = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128d pair = _mm_loadu_pd(a + i);
+        pair = _mm_add_pd(pair, _mm_unpacklo_pd(_mm_setzero_pd(), pair));
+        pair = _mm_add_pd(pair, total);
+        _mm_storeu_pd(out + i, pair);
+        total = _mm_unpackhi_pd(pair, pair);
+    }
+    if (i < count)
+        out[i] = a[i] + _mm_cvtsd_f64(total);
+}
+
+static double dot_sse2(const double* a, const double* b, int count) {
+    __m128d total = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 2 <= count; i += 2)
+        total = _mm_add_pd(total, _mm_mul_pd(_mm_loadu_pd(a + i),
+                                             _mm_loadu_pd(b + i)));
+    return sum_pair(total) + dot_scalar(a + i, b + i, count - i);
+}
+
+static double sum_sse2(const double* a, int count) {
+    __m128d total = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 2 <= count; i += 2)
+        total = _mm_add_pd(total, _mm_loadu_pd(a + i));
+    return sum_pair(total) + sum_scalar(a + i, count - i);
+}
+
+// The vector min and max instructions give their second operand for NaNs
+// and for zeros of either sign. So the loops note on the side whether they
+// have seen a NaN, which is then looked up again, and the zeros of the sign
+// that should win, which decide the sign of a zero result. Both are read
+// from the sign bits alone.
+static double first_nan(const double* a, int count) {
+    for (int i = 0; i < count; i++) {
+        if (a[i] != a[i])
+            return a[i];
+    }
+    return 0;
+}
+
+// Sign bits set in lanes that are NaN, or zeros of the sign asked for.
+static __m128d nan_lanes(__m128d x) {
+    return _mm_cmpunord_pd(x, x);
+}
+
+static __m128d negative_zeros(__m128d x) {
+    return _mm_and_pd(_mm_cmpeq_pd(x, _mm_setzero_pd()), x);
+}
+
+static __m128d positive_zeros(__m128d x) {
+    return _mm_andnot_pd(x, _mm_cmpeq_pd(x, _mm_setzero_pd()));
+}
+
+static double min_sse2(const double* a, int count) {
+    if (count < 2)
+        return a[0];
+
+    __m128d least = _mm_loadu_pd(a);
+    __m128d nan = nan_lanes(least);
+    __m128d zero = negative_zeros(least);
+    int i = 2;
+    for (; i + 2 <= count; i += 2) {
+        __m128d next = _mm_loadu_pd(a + i);
+        least = _mm_min_pd(least, next);
+        nan = _mm_or_pd(nan, nan_lanes(next));
+        zero = _mm_or_pd(zero, negative_zeros(next));
+    }
+    if (_mm_movemask_pd(nan) != 0)
+        return first_nan(a, count);
+
+    least = _mm_min_sd(least, _mm_unpackhi_pd(least, least));
+    double result = _mm_cvtsd_f64(least);
+    if (result == 0)
+        result = _mm_movemask_pd(zero) != 0 ? -0.0 : 0.0;
+    return i < count ? least_of(result, a[i]) : result;
+}
+
+static double max_sse2(const double* a, int count) {
+    if (count < 2)
+        return a[0];
+
+    __m128d most = _mm_loadu_pd(a);
+    __m128d nan = nan_lanes(most);
+    __m128d zero = positive_zeros(most);
+    int i = 2;
+    for (; i + 2 <= count; i += 2) {
+        __m128d next = _mm_loadu_pd(a + i);
+        most = _mm_max_pd(most, next);
+        nan = _mm_or_pd(nan, nan_lanes(next));
+        zero = _mm_or_pd(zero, positive_zeros(next));
+    }
+    if (_mm_movemask_pd(nan) != 0)
+        return first_nan(a, count);
+
+    most = _mm_max_sd(most, _mm_unpackhi_pd(most, most));
+    double result = _mm_cvtsd_f64(most);
+    if (result == 0)
+        result = _mm_movemask_pd(zero) != 0 ? 0.0 : -0.0;
+    return i < count ? most_of(result, a[i]) : result;
+}
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static __m128d fold_halves(__m256d quad) {
+    return _mm_add_pd(_mm256_castpd256_pd128(quad),
+                      _mm256_extractf128_pd(quad, 1));
+}
+
+AVX2 static void add_avx2(double* out, const double* a, const double* b,
+                          int count) {
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+        _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(a + i),
+                                                _mm256_loadu_pd(b + i)));
+    add_scalar(out + i, a + i, b + i, count - i);
+}
+
+AVX2 static void mul_avx2(double* out, const double* a, const double* b,
+                          int count) {
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+        _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i),
+                                                _mm256_loadu_pd(b + i)));
+    mul_scalar(out + i, a + i, b + i, count - i);
+}
+
+AVX2 static void scale_avx2(double* out, const double* a, double factor,
+                            int count) {
+    __m256d factors = _mm256_set1_pd(factor);
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+        _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i),
+                                                factors));
+    scale_scalar(out + i, a + i, factor, count - i);
+}
+
+AVX2 static void fill_avx2(double* out, double value, int count) {
+    __m256d values = _mm256_set1_pd(value);
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+        _mm256_storeu_pd(out + i, values);
+    fill_scalar(out + i, value, count - i);
+}
+
+// Two accumulators keep two additions in flight, which is where the time
+// goes once the loads are wide.
+AVX2 static double dot_avx2(const double* a, const double* b, int count) {
+    __m256d first = _mm256_setzero_pd();
+    __m256d second = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        first = _mm256_add_pd(first, _mm256_mul_pd(_mm256_loadu_pd(a + i),
+                                                   _mm256_loadu_pd(b + i)));
+        second = _mm256_add_pd(second,
+                               _mm256_mul_pd(_mm256_loadu_pd(a + i + 4),
+                                             _mm256_loadu_pd(b + i + 4)));
+    }
+    __m128d total = fold_halves(_mm256_add_pd(first, second));
+    return sum_pair(total) + dot_sse2(a + i, b + i, count - i);
+}
+
+AVX2 static double sum_avx2(const double* a, int count) {
+    __m256d first = _mm256_setzero_pd();
+    __m256d second = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        first = _mm256_add_pd(first, _mm256_loadu_pd(a + i));
+        second = _mm256_add_pd(second, _mm256_loadu_pd(a + i + 4));
+    }
+    __m128d total = fold_halves(_mm256_add_pd(first, second));
+    return sum_pair(total) + sum_sse2(a + i, count - i);
+}
+
+AVX2 static __m256d nan_quad(__m256d x) {
+    return _mm256_cmp_pd(x, x, _CMP_UNORD_Q);
+}
+
+AVX2 static __m256d negative_zero_quad(__m256d x) {
+    return _mm256_and_pd(_mm256_cmp_pd(x, _mm256_setzero_pd(), _CMP_EQ_OQ),
+                         x);
+}
+
+AVX2 static __m256d positive_zero_quad(__m256d x) {
+    return _mm256_andnot_pd(x, _mm256_cmp_pd(x, _mm256_setzero_pd(),
+                                             _CMP_EQ_OQ));
+}
+
+AVX2 static double min_avx2(const double* a, int count) {
+    if (count < 4)
+        return min_sse2(a, count);
+
+    __m256d least = _mm256_loadu_pd(a);
+    __m256d nan = nan_quad(least);
+    __m256d zero = negative_zero_quad(least);
+    int i = 4;
+    for (; i + 4 <= count; i += 4) {
+        __m256d next = _mm256_loadu_pd(a + i);
+        least = _mm256_min_pd(least, next);
+        nan = _mm256_or_pd(nan, nan_quad(next));
+        zero = _mm256_or_pd(zero, negative_zero_quad(next));
+    }
+    if (_mm256_movemask_pd(nan) != 0)
+        return first_nan(a, count);
+
+    __m128d pair = _mm_min_pd(_mm256_castpd256_pd128(least),
+                              _mm256_extractf128_pd(least, 1));
+    pair = _mm_min_sd(pair, _mm_unpackhi_pd(pair, pair));
+    double result = _mm_cvtsd_f64(pair);
+    if (result == 0)
+        result = _mm256_movemask_pd(zero) != 0 ? -0.0 : 0.0;
+    return i < count ? least_of(result, min_scalar(a + i, count - i))
+                     : result;
+}
+
+AVX2 static double max_avx2(const double* a, int count) {
+    if (count < 4)
+        return max_sse2(a, count);
+
+    __m256d most = _mm256_loadu_pd(a);
+    __m256d nan = nan_quad(most);
+    __m256d zero = positive_zero_quad(most);
+    int i = 4;
+    for (; i + 4 <= count; i += 4) {
+        __m256d next = _mm256_loadu_pd(a + i);
+        most = _mm256_max_pd(most, next);
+        nan = _mm256_or_pd(nan, nan_quad(next));
+        zero = _mm256_or_pd(zero, positive_zero_quad(next));
+    }
+    if (_mm256_movemask_pd(nan) != 0)
+        return first_nan(a, count);
+
+    __m128d pair = _mm_max_pd(_mm256_castpd256_pd128(most),
+                              _mm256_extractf128_pd(most, 1));
+    pair = _mm_max_sd(pair, _mm_unpackhi_pd(pair, pair));
+    double result = _mm_cvtsd_f64(pair);
+    if (result == 0)
+        result = _mm256_movemask_pd(zero) != 0 ? 0.0 : -0.0;
+    return i < count ? most_of(result, max_scalar(a + i, count - i))
+                     : result;
+}
+
+#endif // KERNELS_X86
+
+static Kernels chosen = {
+    add_scalar, mul_scalar, scale_scalar, fill_scalar, prefix_sum_scalar,
+    dot_scalar, sum_scalar, min_scalar, max_scalar
+};
+
+static pthread_once_t chosen_once = PTHREAD_ONCE_INIT;
+
+static void choose_kernels() {
+#ifdef KERNELS_X86
+    chosen = (Kernels){
+        add_sse2, mul_sse2, scale_sse2, fill_sse2, prefix_sum_sse2,
+        dot_sse2, sum_sse2, min_sse2, max_sse2
+    };
+
+    // A running sum carries from one element to the next, so AVX2 has
+    // nothing on SSE2 there.
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        chosen = (Kernels){
+            add_avx2, mul_avx2, scale_avx2, fill_avx2, prefix_sum_sse2,
+            dot_avx2, sum_avx2, min_avx2, max_avx2
+        };
+#endif
+}
+
+const Kernels* kernels(void) {
+    pthread_once(&chosen_once, choose_kernels);
+    return &chosen;
+}
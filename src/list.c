@@ -0,0 +1,39 @@
+#include "list.h"
+#include "object.h"
+#include "vm.h"
+
+// append(list, value) adds the value to the end of the list. Its storage
+// doubles when full, so appending is amortized constant time.
+static bool append_native(VM* vm, int arg_count, Value* args,
+                          Value* result) {
+    if (!IS_LIST(args[0])) {
+        runtime_error(vm, "Can only append to lists!");
+        return false;
+    }
+
+    write_value_array(vm, &AS_LIST(args[0])->items, args[1]);
+    *result = NIL_VAL;
+    return true;
+}
+
+static bool len_native(VM* vm, int arg_count, Value* args, Value* result) {
+    if (IS_LIST(args[0]))
+        *result = NUMBER_VAL(AS_LIST(args[0])->items.count);
+    else if (IS_FLOAT_ARRAY(args[0]))
+        *result = NUMBER_VAL(AS_FLOAT_ARRAY(args[0])->count);
+    else if (IS_MAP(args[0]))
+        *result = NUMBER_VAL(AS_MAP(args[0])->live);
+    else if (IS_STRING(args[0]))
+        *result = NUMBER_VAL(AS_STRING(args[0])->length);
+    else {
+        runtime_error(vm, "Can only take the length of lists, arrays, maps "
+                          "and strings!");
+        return false;
+    }
+    return true;
+}
+
+void define_list_natives(VM* vm) {
+    define_native(vm, "append", 2, append_native);
+    define_native(vm, "len", 1, len_native);
+}
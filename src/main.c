@@ -1,15 +1,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "common.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "event.h"
+#include "image.h"
+#include "optimize.h"
+#include "pool.h"
+#include "profile.h"
+#include "segment.h"
+#include "server.h"
+#include "snapshot.h"
 #include "vm.h"
 
-static void repl() {
+static void repl(VM* vm) {
     char line[1024];
     for (;;) {
+        flush_output(&vm->output);
         printf("> ");
 
         if (!fgets(line, sizeof(line), stdin)) {
@@ -17,7 +28,7 @@ static void repl() {
             break;
         }
 
-        interpret(line);
+        interpret(vm, line);
     }
 }
 
@@ -49,29 +60,267 @@ static char* read_file(const char* path) {
     return buffer;
 }
 
-static void run_file(const char* path) {
+static bool has_suffix(const char* string, const char* suffix) {
+    size_t length = strlen(string);
+    size_t suffix_length = strlen(suffix);
+    return length >= suffix_length
+           && strcmp(string + length - suffix_length, suffix) == 0;
+}
+
+// "script.lox" is cached in "script.loxc".
+static char* cached_image_path(const char* path) {
+    size_t length = strlen(path);
+    char* image_path = (char*)malloc(length + 6);
+    if (image_path == NULL) {
+        fprintf(stderr, "Not enough memory to load \"%s\".\n", path);
+        exit(74);
+    }
+
+    strcpy(image_path, path);
+    strcat(image_path, has_suffix(path, ".lox") ? "c" : ".loxc");
+    return image_path;
+}
+
+static bool is_newer(const char* path, const char* than) {
+    struct stat path_stat;
+    struct stat than_stat;
+    if (stat(path, &path_stat) != 0 || stat(than, &than_stat) != 0)
+        return false;
+
+    return path_stat.st_mtime > than_stat.st_mtime;
+}
+
+// Tasks the script spawns run its code out of the same segment, so an
+// image is linked in full before it runs.
+static Obj_function* load_image(VM* vm, const char* path, bool same_options) {
+    Obj_function* function = read_image(vm, path, same_options);
+    if (function == NULL)
+        return NULL;
+
+    push(vm, OBJ_VAL(function));
+    Segment* segment = share_function(vm, function);
+    pop(vm);
+    return segment != NULL ? function : NULL;
+}
+
+static void run_file(VM* vm, const char* path) {
+    Obj_function* function = NULL;
+    if (has_suffix(path, ".loxc")) {
+        function = load_image(vm, path, false);
+        if (function == NULL) {
+            fprintf(stderr, "Could not load bytecode image \"%s\".\n", path);
+            exit(65);
+        }
+    } else {
+        // A stale or damaged cache is simply ignored, and so is one
+        // compiled with other --no-optimize or --peephole settings.
+        char* image_path = cached_image_path(path);
+        if (is_newer(image_path, path))
+            function = load_image(vm, image_path, true);
+        free(image_path);
+    }
+
+    if (function == NULL) {
+        char* source = read_file(path);
+        function = compile(vm, source);
+        free(source);
+        if (function == NULL)
+            exit(65);
+
+        push(vm, OBJ_VAL(function));
+        share_function(vm, function);
+        pop(vm);
+    }
+
+    // Tasks the script started but didn't wait for still get to finish.
+    if (interpret_function(vm, function) == INTERPRET_RUNTIME_ERROR
+        || !run_event_loop(vm)) {
+        flush_output(&vm->output);
+        finish_profile();
+        exit(70);
+    }
+}
+
+static void compile_file(VM* vm, const char* path,
+                         const char* image_path) {
     char* source = read_file(path);
-    Interpret_result result = interpret(source);
+    Obj_function* function = compile(vm, source);
     free(source);
 
-    if (result == INTERPRET_COMPILE_ERROR)
+    if (function == NULL)
         exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR)
-        exit(70);
+
+    if (!write_image(vm, function, image_path)) {
+        fprintf(stderr, "Could not write \"%s\".\n", image_path);
+        exit(74);
+    }
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: clox [--no-optimize] [--peephole=rewrites] "
+                    "[--max-frames=n] [--threads=n] [--output-buffer=n] "
+                    "[--flush=line|full] [--profile=out [--profile-rate=n]] "
+                    "[--compile out.loxc] [--snapshot in.snap] "
+                    "[--save-snapshot out.snap] "
+                    "[--serve socket [--workers n] [--handler name]] "
+                    "[path]\n");
+    exit(64);
+}
+
+// Parses a comma separated list of peephole rewrites, so that they can be
+// switched off one at a time when chasing a difference in behaviour.
+static int parse_rewrites(const char* list) {
+    static const struct {
+        const char* name;
+        int rewrites;
+    } names[] = {
+        {"all", PEEPHOLE_ALL},
+        {"none", 0},
+        {"jumps", PEEPHOLE_JUMPS},
+        {"not", PEEPHOLE_NOT_JUMP},
+        {"pop", PEEPHOLE_PUSH_POP},
+        {"locals", PEEPHOLE_LOCALS},
+    };
+
+    int rewrites = 0;
+    while (*list != '\0') {
+        size_t length = strcspn(list, ",");
+        bool found = false;
+        for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+            if (strlen(names[i].name) == length
+                && memcmp(names[i].name, list, length) == 0) {
+                rewrites |= names[i].rewrites;
+                found = true;
+            }
+        }
+        if (!found)
+            usage();
+
+        list += length;
+        if (*list == ',')
+            list++;
+    }
+    return rewrites;
 }
 
 int main(int argc, const char* argv[]) {
-    init_VM();
-
-    if (argc == 1)
-        repl();
-    else if (argc == 2)
-        run_file(argv[1]);
-    else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+    VM vm;
+    init_VM(&vm);
+
+    const char* path = NULL;
+    const char* image_path = NULL;
+    const char* snapshot_path = NULL;
+    const char* save_path = NULL;
+    const char* socket_path = NULL;
+    const char* profile_path = NULL;
+    const char* handler = "handle";
+    int profile_rate = PROFILE_DEFAULT_RATE;
+    int workers = 0;
+    bool optimize = true;
+    int rewrites = PEEPHOLE_ALL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--compile") == 0 && i + 1 < argc)
+            image_path = argv[++i];
+        else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc)
+            snapshot_path = argv[++i];
+        else if (strcmp(argv[i], "--save-snapshot") == 0 && i + 1 < argc)
+            save_path = argv[++i];
+        else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc)
+            socket_path = argv[++i];
+        else if (strcmp(argv[i], "--handler") == 0 && i + 1 < argc)
+            handler = argv[++i];
+        else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+            if (workers <= 0)
+                usage();
+        }
+        else if (strcmp(argv[i], "--no-optimize") == 0)
+            optimize = false;
+        else if (strncmp(argv[i], "--peephole=", 11) == 0)
+            rewrites = parse_rewrites(argv[i] + 11);
+        else if (strncmp(argv[i], "--max-frames=", 13) == 0) {
+            vm.max_frames = atoi(argv[i] + 13);
+            if (vm.max_frames <= 0)
+                usage();
+        }
+        else if (strncmp(argv[i], "--output-buffer=", 16) == 0) {
+            int capacity = atoi(argv[i] + 16);
+            if (capacity <= 0)
+                usage();
+            set_output(&vm.output, capacity, vm.output.mode);
+        }
+        else if (strcmp(argv[i], "--flush=line") == 0)
+            vm.output.mode = FLUSH_LINE;
+        else if (strcmp(argv[i], "--flush=full") == 0)
+            vm.output.mode = FLUSH_FULL;
+        else if (strncmp(argv[i], "--profile=", 10) == 0
+                 && argv[i][10] != '\0')
+            profile_path = argv[i] + 10;
+        else if (strncmp(argv[i], "--profile-rate=", 15) == 0) {
+            profile_rate = atoi(argv[i] + 15);
+            if (profile_rate <= 0)
+                usage();
+        }
+        else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            int threads = atoi(argv[i] + 10);
+            if (threads <= 0)
+                usage();
+            set_pool_size(threads);
+        }
+        else if (argv[i][0] != '-' && path == NULL)
+            path = argv[i];
+        else
+            usage();
     }
 
-    free_VM();
+    if (image_path != NULL && (snapshot_path != NULL || save_path != NULL))
+        usage();
+    if (socket_path != NULL && (path == NULL || image_path != NULL))
+        usage();
+
+    // The snapshot stands in for whatever prelude built it.
+    if (snapshot_path != NULL && !read_snapshot(&vm, snapshot_path)) {
+        fprintf(stderr, "Could not load snapshot \"%s\".\n", snapshot_path);
+        exit(65);
+    }
+
+    if (profile_path != NULL)
+        start_profile(&vm, profile_path, profile_rate);
+
+    // The REPL compiles in a single pass.
+    if (path == NULL) {
+        if (image_path != NULL || save_path != NULL)
+            usage();
+        repl(&vm);
+    } else {
+        vm.optimize = optimize;
+        vm.peephole = rewrites;
+        // A snapshot brings code compiled separately, and saving one lets
+        // later scripts run against this one's globals.
+        vm.inline_globals = snapshot_path == NULL && save_path == NULL;
+        if (image_path != NULL)
+            compile_file(&vm, path, image_path);
+        else
+            run_file(&vm, path);
+    }
+
+    // Nothing printed is lost if something below fails. Only what ran up
+    // to here is profiled, since the server's workers are processes of
+    // their own.
+    flush_output(&vm.output);
+    if (!finish_profile())
+        exit(74);
+
+    if (save_path != NULL && !write_snapshot(&vm, save_path)) {
+        fprintf(stderr, "Could not write snapshot \"%s\".\n", save_path);
+        exit(74);
+    }
+
+    // The script has built the heap that every worker starts from.
+    if (socket_path != NULL && !serve(&vm, socket_path, workers, handler))
+        exit(74);
+
+    finish_pool();
+    free_VM(&vm);
     return 0;
 }
@@ -0,0 +1,203 @@
+#include <string.h>
+
+#include "map.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+// Maps follow Table: open addressing with linear probing, kept at most
+// three quarters full. A slot with no key holds a null object, and a
+// deleted one also holds true as its value.
+
+#define MAP_MAX_LOAD 0.75
+
+#define EMPTY_KEY OBJ_VAL(NULL)
+
+static bool is_empty(Value key) {
+    return IS_OBJ(key) && AS_OBJ(key) == NULL;
+}
+
+// Spreads the bits of a number or address over the whole hash, since the
+// low bits of both are often all zero.
+static uint32_t mix(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    bits *= 0xc4ceb9fe1a85ec53ull;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+static uint32_t hash_value(Value value) {
+    switch (value.type) {
+    case VAL_BOOL:
+        return AS_BOOL(value) ? 1231 : 1237;
+    case VAL_NIL:
+        return 0;
+    case VAL_NUMBER:
+    {
+        // Adding zero turns -0 into 0, which it equals.
+        double number = AS_NUMBER(value) + 0.0;
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        return mix(bits);
+    }
+    case VAL_OBJ:
+        if (IS_STRING(value))
+            return AS_STRING(value)->hash;
+        return mix((uint64_t)(uintptr_t)AS_OBJ(value));
+    }
+    return 0;
+}
+
+static Map_entry* find_entry(Map_entry* entries, int capacity, Value key) {
+    uint32_t index = hash_value(key) & (capacity - 1);
+    Map_entry* tombstone = NULL;
+
+    for (;;) {
+        Map_entry* entry = &entries[index];
+        if (is_empty(entry->key)) {
+            if (IS_NIL(entry->value))
+                return tombstone != NULL ? tombstone : entry;
+            if (tombstone == NULL)
+                tombstone = entry;
+        } else if (values_equal(entry->key, key))
+            return entry;
+
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static void adjust_capacity(VM* vm, Obj_map* map, int capacity) {
+    Map_entry* entries = ALLOCATE(vm, Map_entry, capacity);
+    for (int i = 0; i < capacity; i++) {
+        entries[i].key = EMPTY_KEY;
+        entries[i].value = NIL_VAL;
+    }
+
+    map->count = 0;
+    for (int i = 0; i < map->capacity; i++) {
+        Map_entry* entry = &map->entries[i];
+        if (is_empty(entry->key))
+            continue;
+
+        Map_entry* dest = find_entry(entries, capacity, entry->key);
+        dest->key = entry->key;
+        dest->value = entry->value;
+        map->count++;
+    }
+
+    FREE_ARRAY(vm, Map_entry, map->entries, map->capacity);
+    map->entries = entries;
+    map->capacity = capacity;
+}
+
+bool map_get(Obj_map* map, Value key, Value* value) {
+    if (map->live == 0)
+        return false;
+
+    Map_entry* entry = find_entry(map->entries, map->capacity, key);
+    if (is_empty(entry->key))
+        return false;
+
+    *value = entry->value;
+    return true;
+}
+
+// The caller keeps the key and value reachable, since growing the map can
+// start a collection.
+bool map_set(VM* vm, Obj_map* map, Value key, Value value) {
+    if (map->count + 1 > map->capacity * MAP_MAX_LOAD) {
+        int capacity = GROW_CAPACITY(map->capacity);
+        adjust_capacity(vm, map, capacity);
+    }
+
+    Map_entry* entry = find_entry(map->entries, map->capacity, key);
+    bool is_new_key = is_empty(entry->key);
+    if (is_new_key) {
+        if (IS_NIL(entry->value))
+            map->count++;
+        map->live++;
+    }
+
+    entry->key = key;
+    entry->value = value;
+    return is_new_key;
+}
+
+bool map_delete(Obj_map* map, Value key) {
+    if (map->live == 0)
+        return false;
+
+    Map_entry* entry = find_entry(map->entries, map->capacity, key);
+    if (is_empty(entry->key))
+        return false;
+
+    entry->key = EMPTY_KEY;
+    entry->value = BOOL_VAL(true);
+    map->live--;
+    return true;
+}
+
+void mark_map(VM* vm, Obj_map* map) {
+    for (int i = 0; i < map->capacity; i++) {
+        mark_value(vm, map->entries[i].key);
+        mark_value(vm, map->entries[i].value);
+    }
+}
+
+static bool check_map(VM* vm, Value value) {
+    if (IS_MAP(value))
+        return true;
+
+    runtime_error(vm, "Expected a map!");
+    return false;
+}
+
+static bool map_native(VM* vm, int arg_count, Value* args, Value* result) {
+    *result = OBJ_VAL(new_map(vm));
+    return true;
+}
+
+static bool has_native(VM* vm, int arg_count, Value* args, Value* result) {
+    if (!check_map(vm, args[0]))
+        return false;
+
+    Value value;
+    *result = BOOL_VAL(map_get(AS_MAP(args[0]), args[1], &value));
+    return true;
+}
+
+// remove(map, key) returns whether the key was there.
+static bool remove_native(VM* vm, int arg_count, Value* args,
+                          Value* result) {
+    if (!check_map(vm, args[0]))
+        return false;
+
+    *result = BOOL_VAL(map_delete(AS_MAP(args[0]), args[1]));
+    return true;
+}
+
+// keys(map) returns a new list of the map's keys, in no particular order,
+// which stays put while the map is changed.
+static bool keys_native(VM* vm, int arg_count, Value* args, Value* result) {
+    if (!check_map(vm, args[0]))
+        return false;
+
+    Obj_map* map = AS_MAP(args[0]);
+    Obj_list* keys = new_list(vm);
+    push(vm, OBJ_VAL(keys));
+    for (int i = 0; i < map->capacity; i++) {
+        if (!is_empty(map->entries[i].key))
+            write_value_array(vm, &keys->items, map->entries[i].key);
+    }
+    *result = pop(vm);
+    return true;
+}
+
+void define_map_natives(VM* vm) {
+    define_native(vm, "has", 2, has_native);
+    define_native(vm, "keys", 1, keys_native);
+    define_native(vm, "map", 0, map_native);
+    define_native(vm, "remove", 2, remove_native);
+}
@@ -1,7 +1,11 @@
 #include <stdlib.h>
 
 #include "compiler.h"
+#include "event.h"
+#include "map.h"
 #include "memory.h"
+#include "pool.h"
+#include "profile.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
@@ -11,16 +15,16 @@
 
 #define GC_HEAP_GROW_FACTOR 2
 
-void* reallocate(void *pointer, size_t old_size, size_t new_size) {
-    vm.bytes_allocated += new_size - old_size;
+void* reallocate(VM* vm, void *pointer, size_t old_size, size_t new_size) {
+    vm->bytes_allocated += new_size - old_size;
 
     if (new_size > old_size) {
 #ifdef DEBUG_STRESS_GC
-        collect_garbage();
+        collect_garbage(vm);
 #endif
 
-        if (vm.bytes_allocated > vm.next_GC) {
-            collect_garbage();
+        if (vm->bytes_allocated > vm->next_GC) {
+            collect_garbage(vm);
         }
     }
 
@@ -35,7 +39,7 @@ void* reallocate(void *pointer, size_t old_size, size_t new_size) {
     return result;
 }
 
-void mark_object(Obj *object) {
+void mark_object(VM* vm, Obj *object) {
     if (object == NULL)
         return;
     if (object->is_marked)
@@ -47,29 +51,30 @@ void mark_object(Obj *object) {
 #endif
     object->is_marked = true;
 
-    if (vm.gray_capacity < vm.gray_count + 1) {
-        vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
-        vm.gray_stack = realloc(vm.gray_stack, sizeof(Obj*) * vm.gray_capacity);
+    if (vm->gray_capacity < vm->gray_count + 1) {
+        vm->gray_capacity = GROW_CAPACITY(vm->gray_capacity);
+        vm->gray_stack = realloc(vm->gray_stack,
+                                 sizeof(Obj*) * vm->gray_capacity);
 
-        if (vm.gray_stack == NULL)
+        if (vm->gray_stack == NULL)
             exit(1);
     }
 
-    vm.gray_stack[vm.gray_count++] = object;
+    vm->gray_stack[vm->gray_count++] = object;
 }
 
-void mark_value(Value value) {
+void mark_value(VM* vm, Value value) {
     if (!IS_OBJ(value))
         return;
-    mark_object(AS_OBJ(value));
+    mark_object(vm, AS_OBJ(value));
 }
 
-static void mark_array(Value_array* array) {
+static void mark_array(VM* vm, Value_array* array) {
     for (int i = 0; i < array->count; i++)
-        mark_value(array->values[i]);
+        mark_value(vm, array->values[i]);
 }
 
-static void blacken_object(Obj* object) {
+static void blacken_object(VM* vm, Obj* object) {
 #ifdef DEBUG_LOG_GC
     printf("%p blacken ", (void*)object);
     print_value(OBJ_VAL(object));
@@ -80,128 +85,194 @@ static void blacken_object(Obj* object) {
     case OBJ_BOUND_METHOD:
     {
         Obj_bound_method* bound = (Obj_bound_method*)object;
-        mark_value(bound->receiver);
-        mark_object((Obj*)bound->method);
+        mark_value(vm, bound->receiver);
+        mark_object(vm, (Obj*)bound->method);
         break;
     }
     case OBJ_CLASS:
     {
         Obj_class* klass = (Obj_class*)object;
-        mark_object((Obj*)klass->name);
-        mark_table(&klass->methods);
+        mark_object(vm, (Obj*)klass->name);
+        mark_table(vm, &klass->methods);
         break;
     }
     case OBJ_CLOSURE:
     {
         Obj_closure* closure = (Obj_closure*)object;
-        mark_object((Obj*)closure->function);
+        mark_object(vm, (Obj*)closure->function);
         for (int i = 0; i < closure->upvalue_count; i++)
-            mark_object((Obj*)closure->upvalues[i]);
+            mark_object(vm, (Obj*)closure->upvalues[i]);
         break;
     }
+    case OBJ_FIBER:
+    {
+        Obj_fiber* fiber = (Obj_fiber*)object;
+        mark_object(vm, (Obj*)fiber->closure);
+        mark_object(vm, (Obj*)fiber->caller);
+        for (Value* slot = fiber->stack; slot < fiber->stack_top; slot++)
+            mark_value(vm, *slot);
+        for (int i = 0; i < fiber->frame_count; i++)
+            mark_object(vm, (Obj*)fiber->frames[i].closure);
+        for (Obj_upvalue* upvalue = fiber->open_upvalues; upvalue != NULL;
+             upvalue = upvalue->next)
+            mark_object(vm, (Obj*)upvalue);
+        break;
+    }
+    case OBJ_FLOAT_ARRAY:
+        mark_object(vm, (Obj*)((Obj_float_array*)object)->base);
+        break;
     case OBJ_FUNCTION:
     {
         Obj_function* function = (Obj_function*)object;
-        mark_object((Obj*)function->name);
-        mark_array(&function->chunk.constants);
+        mark_object(vm, (Obj*)function->name);
+        mark_array(vm, &function->chunk.constants);
         break;
     }
     case OBJ_INSTANCE:
     {
         Obj_instance* instance = (Obj_instance*)object;
-        mark_object((Obj*)instance->klass);
-        mark_table(&instance->fields);
+        mark_object(vm, (Obj*)instance->klass);
+        mark_table(vm, &instance->fields);
         break;
     }
-    case OBJ_UPVALUE:
-        mark_value(((Obj_upvalue*)object)->closed);
+    case OBJ_LIST:
+        mark_array(vm, &((Obj_list*)object)->items);
+        break;
+    case OBJ_MAP:
+        mark_map(vm, (Obj_map*)object);
         break;
     case OBJ_NATIVE:
+        mark_object(vm, (Obj*)((Obj_native*)object)->name);
+        break;
+    case OBJ_UPVALUE:
+        mark_value(vm, ((Obj_upvalue*)object)->closed);
+        mark_object(vm, (Obj*)((Obj_upvalue*)object)->fiber);
+        break;
+    case OBJ_CHANNEL:
     case OBJ_STRING:
         break;
     }
 }
 
-static void free_object(Obj* object) {
+static void free_object(VM* vm, Obj* object) {
 #ifdef DEBUG_LOG_GC
     printf("%p free type %d\n", (void*)object, object->type);
 #endif
 
     switch (object->type) {
     case OBJ_BOUND_METHOD:
-        FREE(Obj_bound_method, object);
+        FREE(vm, Obj_bound_method, object);
+        break;
+    case OBJ_CHANNEL:
+        release_channel(((Obj_channel*)object)->channel);
+        FREE(vm, Obj_channel, object);
         break;
     case OBJ_CLASS:
     {
         Obj_class* klass = (Obj_class*)object;
-        free_table(&klass->methods);
-        FREE(Obj_class, object);
+        free_table(vm, &klass->methods);
+        FREE(vm, Obj_class, object);
         break;
     }
     case OBJ_CLOSURE:
     {
         Obj_closure* closure = (Obj_closure*)object;
-        FREE_ARRAY(Obj_upvalue*, closure->upvalues, closure->upvalue_count);
-        FREE(Obj_closure, object);
+        FREE_ARRAY(vm, Obj_upvalue*, closure->upvalues, closure->upvalue_count);
+        FREE(vm, Obj_closure, object);
+        break;
+    }
+    case OBJ_FIBER:
+    {
+        Obj_fiber* fiber = (Obj_fiber*)object;
+        free(fiber->frames);
+        free(fiber->stack);
+        FREE(vm, Obj_fiber, object);
+        break;
+    }
+    case OBJ_FLOAT_ARRAY:
+    {
+        // A view's values belong to its base.
+        Obj_float_array* array = (Obj_float_array*)object;
+        if (array->base == NULL)
+            FREE_ARRAY(vm, double, array->values, array->count);
+        FREE(vm, Obj_float_array, object);
         break;
     }
     case OBJ_FUNCTION:
     {
         Obj_function* function = (Obj_function*)object;
-        free_chunk(&function->chunk);
-        FREE(Obj_function, object);
+        free_chunk(vm, &function->chunk);
+        FREE(vm, Obj_function, object);
         break;
     }
     case OBJ_INSTANCE:
     {
         Obj_instance* instance = (Obj_instance*)object;
-        free_table(&instance->fields);
-        FREE(Obj_instance, object);
+        free_table(vm, &instance->fields);
+        FREE(vm, Obj_instance, object);
+        break;
+    }
+    case OBJ_LIST:
+        free_value_array(vm, &((Obj_list*)object)->items);
+        FREE(vm, Obj_list, object);
+        break;
+    case OBJ_MAP:
+    {
+        Obj_map* map = (Obj_map*)object;
+        FREE_ARRAY(vm, Map_entry, map->entries, map->capacity);
+        FREE(vm, Obj_map, object);
         break;
     }
     case OBJ_NATIVE:
-        FREE(Obj_native, object);
+        FREE(vm, Obj_native, object);
         break;
     case OBJ_STRING:
     {
         Obj_string* string = (Obj_string*)object;
-        FREE_ARRAY(char, string->chars, string->length + 1);
-        FREE(Obj_string, object);
+        FREE_ARRAY(vm, char, string->chars, string->length + 1);
+        FREE(vm, Obj_string, object);
         break;
     }
     case OBJ_UPVALUE:
-        FREE(Obj_upvalue, object);
+        FREE(vm, Obj_upvalue, object);
         break;
     }
 }
 
-static void mark_roots() {
-    for (Value* slot = vm.stack; slot < vm.stack_top; slot++)
-        mark_value(*slot);
+static void mark_roots(VM* vm) {
+    for (Value* slot = vm->stack; slot < vm->stack_top; slot++)
+        mark_value(vm, *slot);
 
-    for (int i = 0; i < vm.frame_count; i++)
-        mark_object((Obj*)vm.frames[i].closure);
+    for (int i = 0; i < vm->frame_count; i++)
+        mark_object(vm, (Obj*)vm->frames[i].closure);
 
-    for (Obj_upvalue* upvalue = vm.open_upvalues;
+    for (Obj_upvalue* upvalue = vm->open_upvalues;
          upvalue != NULL;
          upvalue = upvalue->next)
-        mark_object((Obj*)upvalue);
-
-    mark_table(&vm.globals);
-    mark_compiler_roots();
-    mark_object((Obj*)vm.init_string);
+        mark_object(vm, (Obj*)upvalue);
+
+    mark_object(vm, (Obj*)vm->fiber);
+    mark_event_loop(vm);
+    mark_table(vm, &vm->globals);
+    mark_compiler_roots(vm);
+    mark_object(vm, (Obj*)vm->init_string);
+
+    // Frozen objects are read, never written, to find what they have come
+    // to refer to since.
+    for (Obj* object = vm->frozen; object != NULL; object = object->next)
+        blacken_object(vm, object);
 }
 
-static void trace_references() {
-    while (vm.gray_count > 0) {
-        Obj* object = vm.gray_stack[--vm.gray_count];
-        blacken_object(object);
+static void trace_references(VM* vm) {
+    while (vm->gray_count > 0) {
+        Obj* object = vm->gray_stack[--vm->gray_count];
+        blacken_object(vm, object);
     }
 }
 
-static void sweep() {
+static void sweep(VM* vm) {
     Obj* previous = NULL;
-    Obj* object = vm.objects;
+    Obj* object = vm->objects;
     while (object != NULL) {
         if (object->is_marked) {
             object->is_marked = false;
@@ -214,40 +285,64 @@ static void sweep() {
             if (previous != NULL)
                 previous->next = object;
             else
-                vm.objects = object;
+                vm->objects = object;
 
-            free_object(unreached);
+            free_object(vm, unreached);
         }
     }
 }
 
-void collect_garbage() {
+void collect_garbage(VM* vm) {
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
-    size_t before = vm.bytes_allocated;
+    size_t before = vm->bytes_allocated;
 #endif
 
-    mark_roots();
-    trace_references();
-    table_remove_white(&vm.strings);
-    sweep();
+    mark_roots(vm);
+    trace_references(vm);
+    intern_set_remove_white(&vm->strings);
+    drain_profile();
+    sweep(vm);
 
-    vm.next_GC = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+    vm->next_GC = vm->bytes_allocated * GC_HEAP_GROW_FACTOR;
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
     printf("   collected %ld bytes (from %ld to %ld) next at %ld\n",
-           before - vm.bytes_allocated, before, vm.bytes_allocated, vm.next_GC);
+           before - vm->bytes_allocated, before, vm->bytes_allocated,
+           vm->next_GC);
 #endif
 }
 
-void free_objects() {
-    Obj* object = vm.objects;
+// Collects the garbage and then moves every object left into the frozen
+// heap, which no later collection writes to: frozen objects stay marked
+// and are never swept. A process forked afterwards keeps sharing their
+// pages with its parent.
+void freeze_heap(VM* vm) {
+    collect_garbage(vm);
+
+    Obj** link = &vm->frozen;
+    while (*link != NULL)
+        link = &(*link)->next;
+    *link = vm->objects;
+    for (Obj* object = vm->objects; object != NULL; object = object->next)
+        object->is_marked = true;
+    vm->objects = NULL;
+}
+
+static void free_list(VM* vm, Obj* object) {
     while (object != NULL) {
         Obj* next = object->next;
-        free_object(object);
+        free_object(vm, object);
         object = next;
     }
+}
+
+void free_objects(VM* vm) {
+    free_list(vm, vm->objects);
+    free_list(vm, vm->frozen);
+    vm->objects = NULL;
+    vm->frozen = NULL;
 
-    free(vm.gray_stack);
+    free(vm->gray_stack);
 }
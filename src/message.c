@@ -0,0 +1,842 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "image.h"
+#include "map.h"
+#include "memory.h"
+#include "message.h"
+#include "object.h"
+#include "pool.h"
+#include "segment.h"
+#include "table.h"
+#include "vm.h"
+
+// A message is a sequence of tagged values followed by the globals that
+// its functions use, each introduced by a nonzero byte. Every object gets
+// an index in the order it is first written; later occurrences refer back
+// to that index, so shared objects stay shared and cycles end. Integers and
+// pointers are stored as they sit in memory, since a message never leaves
+// the process. Functions from the writer's segment go by address, and are
+// copied only into a VM that doesn't share that segment.
+//
+// Portable messages, which are saved as snapshots, hold no pointers at all:
+// every function is copied, natives go by name and channels can't go.
+
+#define MESSAGE_MAX_DEPTH 4096
+
+// Snapshots hold these numbers, so adding a tag anywhere but the end means
+// bumping IMAGE_VERSION.
+typedef enum {
+    TAG_NIL,
+    TAG_FALSE,
+    TAG_TRUE,
+    TAG_NUMBER,
+    TAG_OBJECT,
+    TAG_BOUND_METHOD,
+    TAG_CHANNEL,
+    TAG_CLASS,
+    TAG_CLOSURE,
+    TAG_FLOAT_ARRAY,
+    TAG_FLOAT_VIEW,
+    TAG_FUNCTION,
+    TAG_INSTANCE,
+    TAG_LIST,
+    TAG_MAP,
+    TAG_NAMED_NATIVE,
+    TAG_NATIVE,
+    TAG_SHARED_FUNCTION,
+    TAG_STRING,
+    TAG_UPVALUE
+} Message_tag;
+
+typedef struct {
+    Obj* object;
+    int index;
+} Object_entry;
+
+typedef struct {
+    int count;
+    int capacity;
+    Object_entry* entries;
+} Object_map;
+
+typedef struct {
+    VM* vm;
+    Message* message;
+    bool portable;
+    int depth;
+
+    // Objects written so far, and functions whose globals have been noted.
+    Object_map written;
+    Object_map scanned;
+
+    // Globals read or assigned by the functions written so far.
+    Table used;
+    int global_count;
+    int global_capacity;
+    Obj_string** globals;
+} Message_writer;
+
+typedef struct {
+    VM* vm;
+    const Message* message;
+    size_t offset;
+
+    // Objects read so far sit on the stack from here up, which keeps them
+    // reachable until the whole message has been read.
+    int base;
+} Message_reader;
+
+void init_message(Message* message) {
+    message->count = 0;
+    message->capacity = 0;
+    message->bytes = NULL;
+    message->value_count = 0;
+    message->channel_count = 0;
+    message->channel_capacity = 0;
+    message->channels = NULL;
+    message->segment = NULL;
+}
+
+void free_message(Message* message) {
+    for (int i = 0; i < message->channel_count; i++)
+        release_channel(message->channels[i]);
+    free(message->bytes);
+    free(message->channels);
+    if (message->segment != NULL)
+        release_segment(message->segment);
+    init_message(message);
+}
+
+// Messages belong to no VM, so their buffers live outside GC accounting.
+static void write_bytes(Message* message, const void* bytes, size_t count) {
+    if (message->count + count > message->capacity) {
+        size_t capacity = GROW_CAPACITY(message->capacity);
+        while (capacity < message->count + count)
+            capacity *= 2;
+        message->bytes = (uint8_t*)realloc(message->bytes, capacity);
+        if (message->bytes == NULL)
+            exit(1);
+        message->capacity = capacity;
+    }
+
+    memcpy(message->bytes + message->count, bytes, count);
+    message->count += count;
+}
+
+static void write_byte(Message* message, uint8_t byte) {
+    write_bytes(message, &byte, 1);
+}
+
+static void write_int(Message* message, int value) {
+    write_bytes(message, &value, sizeof(value));
+}
+
+static uint32_t hash_pointer(Obj* object) {
+    uint64_t address = (uint64_t)(uintptr_t)object >> 3;
+    return (uint32_t)(address ^ (address >> 32)) * 2654435761u;
+}
+
+static Object_entry* find_entry(Object_entry* entries, int capacity,
+                                Obj* object) {
+    uint32_t index = hash_pointer(object) & (capacity - 1);
+    while (entries[index].object != NULL && entries[index].object != object)
+        index = (index + 1) & (capacity - 1);
+    return &entries[index];
+}
+
+// Returns true if the object is in the map already, and otherwise adds it
+// with the next index.
+static bool map_object(Object_map* map, Obj* object, int* index) {
+    if (map->count + 1 > map->capacity / 2) {
+        int capacity = map->capacity < 16 ? 16 : map->capacity * 2;
+        Object_entry* entries
+                = (Object_entry*)calloc(capacity, sizeof(Object_entry));
+        if (entries == NULL)
+            exit(1);
+        for (int i = 0; i < map->capacity; i++) {
+            if (map->entries[i].object != NULL)
+                *find_entry(entries, capacity, map->entries[i].object)
+                        = map->entries[i];
+        }
+        free(map->entries);
+        map->entries = entries;
+        map->capacity = capacity;
+    }
+
+    Object_entry* entry = find_entry(map->entries, map->capacity, object);
+    if (entry->object != NULL) {
+        *index = entry->index;
+        return true;
+    }
+
+    entry->object = object;
+    entry->index = map->count++;
+    return false;
+}
+
+static void hold_channel(Message* message, Channel* channel) {
+    if (message->channel_count == message->channel_capacity) {
+        int capacity = GROW_CAPACITY(message->channel_capacity);
+        message->channels = (Channel**)realloc(message->channels,
+                                               sizeof(Channel*) * capacity);
+        if (message->channels == NULL)
+            exit(1);
+        message->channel_capacity = capacity;
+    }
+
+    retain_channel(channel);
+    message->channels[message->channel_count++] = channel;
+}
+
+static void use_global(Message_writer* writer, Obj_string* name) {
+    if (!table_set(writer->vm, &writer->used, name, NIL_VAL))
+        return;
+
+    if (writer->global_count == writer->global_capacity) {
+        writer->global_capacity = GROW_CAPACITY(writer->global_capacity);
+        writer->globals = (Obj_string**)realloc(
+                writer->globals, sizeof(Obj_string*) * writer->global_capacity);
+        if (writer->globals == NULL)
+            exit(1);
+    }
+    writer->globals[writer->global_count++] = name;
+}
+
+// Notes the globals read or assigned by a function and the functions
+// nested in it.
+static void use_globals(Message_writer* writer, Obj_function* function) {
+    int index;
+    if (map_object(&writer->scanned, (Obj*)function, &index))
+        return;
+
+    Chunk* chunk = &function->chunk;
+    for (int offset = 0; offset < chunk->count;
+         offset += instruction_length(chunk, offset)) {
+        uint8_t instruction = chunk->code[offset];
+        if (instruction == OP_GET_GLOBAL || instruction == OP_SET_GLOBAL) {
+            Value name = chunk->constants.values[chunk->code[offset + 1]];
+            use_global(writer, AS_STRING(name));
+        }
+    }
+
+    for (int i = 0; i < chunk->constants.count; i++) {
+        if (IS_FUNCTION(chunk->constants.values[i]))
+            use_globals(writer, AS_FUNCTION(chunk->constants.values[i]));
+    }
+}
+
+static bool write_value(Message_writer* writer, Value value);
+
+static bool write_function(Message_writer* writer, Obj_function* function) {
+    Message* message = writer->message;
+    if (function->obj.is_shared && !writer->portable) {
+        if (message->segment == NULL) {
+            message->segment = writer->vm->segment;
+            retain_segment(message->segment);
+        }
+        write_byte(message, TAG_SHARED_FUNCTION);
+        write_bytes(message, &function, sizeof(function));
+        use_globals(writer, function);
+        return true;
+    }
+
+    if (function->image != NULL
+        && !link_image_function(writer->vm, function))
+        return false;
+
+    write_byte(message, TAG_FUNCTION);
+    Chunk* chunk = &function->chunk;
+    write_int(message, function->arity);
+    write_int(message, function->upvalue_count);
+    Value name = function->name == NULL ? NIL_VAL : OBJ_VAL(function->name);
+    if (!write_value(writer, name))
+        return false;
+
+    write_int(message, chunk->count);
+    write_bytes(message, chunk->code, chunk->count);
+    write_bytes(message, chunk->lines, sizeof(int) * chunk->count);
+    write_int(message, chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        if (!write_value(writer, chunk->constants.values[i]))
+            return false;
+    }
+
+    use_globals(writer, function);
+    return true;
+}
+
+static bool write_table(Message_writer* writer, Table* table) {
+    int count = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->entries[i].key != NULL)
+            count++;
+    }
+
+    write_int(writer->message, count);
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        if (entry->key == NULL)
+            continue;
+        if (!write_value(writer, OBJ_VAL(entry->key))
+            || !write_value(writer, entry->value))
+            return false;
+    }
+    return true;
+}
+
+static bool write_object(Message_writer* writer, Obj* object) {
+    Message* message = writer->message;
+    int index;
+    if (map_object(&writer->written, object, &index)) {
+        write_byte(message, TAG_OBJECT);
+        write_bytes(message, &index, sizeof(index));
+        return true;
+    }
+
+    switch (object->type) {
+    case OBJ_BOUND_METHOD:
+    {
+        Obj_bound_method* bound = (Obj_bound_method*)object;
+        write_byte(message, TAG_BOUND_METHOD);
+        return write_value(writer, bound->receiver)
+               && write_object(writer, (Obj*)bound->method);
+    }
+    case OBJ_CHANNEL:
+    {
+        if (writer->portable)
+            return false;
+
+        Channel* channel = ((Obj_channel*)object)->channel;
+        hold_channel(message, channel);
+        write_byte(message, TAG_CHANNEL);
+        write_bytes(message, &channel, sizeof(channel));
+        return true;
+    }
+    case OBJ_CLASS:
+    {
+        Obj_class* klass = (Obj_class*)object;
+        write_byte(message, TAG_CLASS);
+        return write_object(writer, (Obj*)klass->name)
+               && write_table(writer, &klass->methods);
+    }
+    case OBJ_CLOSURE:
+    {
+        Obj_closure* closure = (Obj_closure*)object;
+        write_byte(message, TAG_CLOSURE);
+        if (!write_object(writer, (Obj*)closure->function))
+            return false;
+        for (int i = 0; i < closure->upvalue_count; i++) {
+            if (!write_object(writer, (Obj*)closure->upvalues[i]))
+                return false;
+        }
+        return true;
+    }
+    case OBJ_FIBER:
+        // A fiber's frames point into code and stacks of this VM alone.
+        return false;
+    case OBJ_FLOAT_ARRAY:
+    {
+        // A view goes as its base and where it starts, so that it still
+        // shares the base's values at the other end.
+        Obj_float_array* array = (Obj_float_array*)object;
+        if (array->base != NULL) {
+            write_byte(message, TAG_FLOAT_VIEW);
+            write_int(message, (int)(array->values - array->base->values));
+            write_int(message, array->count);
+            return write_object(writer, (Obj*)array->base);
+        }
+
+        write_byte(message, TAG_FLOAT_ARRAY);
+        write_int(message, array->count);
+        write_bytes(message, array->values, sizeof(double) * array->count);
+        return true;
+    }
+    case OBJ_FUNCTION:
+        return write_function(writer, (Obj_function*)object);
+    case OBJ_INSTANCE:
+    {
+        Obj_instance* instance = (Obj_instance*)object;
+        write_byte(message, TAG_INSTANCE);
+        return write_object(writer, (Obj*)instance->klass)
+               && write_table(writer, &instance->fields);
+    }
+    case OBJ_LIST:
+    {
+        Value_array* items = &((Obj_list*)object)->items;
+        write_byte(message, TAG_LIST);
+        write_int(message, items->count);
+        for (int i = 0; i < items->count; i++) {
+            if (!write_value(writer, items->values[i]))
+                return false;
+        }
+        return true;
+    }
+    case OBJ_MAP:
+    {
+        Obj_map* map = (Obj_map*)object;
+        write_byte(message, TAG_MAP);
+        write_int(message, map->live);
+        for (int i = 0; i < map->capacity; i++) {
+            Map_entry* entry = &map->entries[i];
+            if (IS_OBJ(entry->key) && AS_OBJ(entry->key) == NULL)
+                continue;
+            if (!write_value(writer, entry->key)
+                || !write_value(writer, entry->value))
+                return false;
+        }
+        return true;
+    }
+    case OBJ_NATIVE:
+    {
+        Obj_native* native = (Obj_native*)object;
+        if (writer->portable) {
+            write_byte(message, TAG_NAMED_NATIVE);
+            return write_object(writer, (Obj*)native->name);
+        }
+
+        write_byte(message, TAG_NATIVE);
+        write_int(message, native->arity);
+        write_bytes(message, &native->function, sizeof(native->function));
+        return write_object(writer, (Obj*)native->name);
+    }
+    case OBJ_STRING:
+    {
+        Obj_string* string = (Obj_string*)object;
+        write_byte(message, TAG_STRING);
+        write_int(message, string->length);
+        write_bytes(message, string->chars, string->length);
+        return true;
+    }
+    case OBJ_UPVALUE:
+        // Captured variables are copied as they stand now.
+        write_byte(message, TAG_UPVALUE);
+        return write_value(writer, *((Obj_upvalue*)object)->location);
+    }
+    return false;
+}
+
+static bool write_value(Message_writer* writer, Value value) {
+    Message* message = writer->message;
+    if (IS_NIL(value))
+        write_byte(message, TAG_NIL);
+    else if (IS_BOOL(value))
+        write_byte(message, AS_BOOL(value) ? TAG_TRUE : TAG_FALSE);
+    else if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        write_byte(message, TAG_NUMBER);
+        write_bytes(message, &number, sizeof(number));
+    } else {
+        if (writer->depth == MESSAGE_MAX_DEPTH)
+            return false;
+        writer->depth++;
+        bool written = write_object(writer, AS_OBJ(value));
+        writer->depth--;
+        return written;
+    }
+    return true;
+}
+
+static void init_writer(Message_writer* writer, VM* vm, Message* message,
+                        bool portable) {
+    writer->vm = vm;
+    writer->message = message;
+    writer->portable = portable;
+    writer->depth = 0;
+    writer->written.count = 0;
+    writer->written.capacity = 0;
+    writer->written.entries = NULL;
+    writer->scanned = writer->written;
+    init_table(&writer->used);
+    writer->global_count = 0;
+    writer->global_capacity = 0;
+    writer->globals = NULL;
+}
+
+static void free_writer(Message_writer* writer) {
+    free(writer->written.entries);
+    free(writer->scanned.entries);
+    free(writer->globals);
+    free_table(writer->vm, &writer->used);
+}
+
+// Natives are left out of ordinary messages, since every VM has them
+// already.
+static bool write_globals_used(Message_writer* writer) {
+    // Writing a global's value can bring in more globals.
+    bool written = true;
+    for (int i = 0; i < writer->global_count && written; i++) {
+        Value value;
+        if (!table_get(&writer->vm->globals, writer->globals[i], &value)
+            || (IS_NATIVE(value) && !writer->portable))
+            continue;
+
+        write_byte(writer->message, 1);
+        written = write_object(writer, (Obj*)writer->globals[i])
+                  && write_value(writer, value);
+    }
+    write_byte(writer->message, 0);
+    return written;
+}
+
+// Copies the count values on top of the stack into the message, along with
+// the globals their functions use. Fails if the values are nested too
+// deeply or a function's image turns out to be corrupt.
+bool write_message(VM* vm, Message* message, int count) {
+    Message_writer writer;
+    init_writer(&writer, vm, message, false);
+
+    bool written = true;
+    for (int i = count; i > 0 && written; i--)
+        written = write_value(&writer, vm->stack_top[-i]);
+    written = written && write_globals_used(&writer);
+    message->value_count = count;
+
+    free_writer(&writer);
+    return written;
+}
+
+// Copies every global, and with them everything the program has built, into
+// a portable message. Fails as write_message() does, or if a global holds
+// on to a channel.
+bool write_globals(VM* vm, Message* message) {
+    Message_writer writer;
+    init_writer(&writer, vm, message, true);
+
+    Table* globals = &vm->globals;
+    for (int i = 0; i < globals->capacity; i++) {
+        if (globals->entries[i].key != NULL)
+            use_global(&writer, globals->entries[i].key);
+    }
+    bool written = write_globals_used(&writer);
+    message->value_count = 0;
+
+    free_writer(&writer);
+    return written;
+}
+
+static void read_bytes(Message_reader* reader, void* bytes, size_t count) {
+    memcpy(bytes, reader->message->bytes + reader->offset, count);
+    reader->offset += count;
+}
+
+static uint8_t read_byte(Message_reader* reader) {
+    return reader->message->bytes[reader->offset++];
+}
+
+static int read_int(Message_reader* reader) {
+    int value;
+    read_bytes(reader, &value, sizeof(value));
+    return value;
+}
+
+// Objects whose contents refer to other objects take their index before
+// those are read, to match the order they were written in. Until they are
+// filled in, the slot holds nil.
+static int reserve_object(Message_reader* reader) {
+    push(reader->vm, NIL_VAL);
+    return (int)(reader->vm->stack_top - reader->vm->stack) - 1;
+}
+
+static void add_object(Message_reader* reader, int slot, Obj* object) {
+    reader->vm->stack[slot] = OBJ_VAL(object);
+}
+
+static Value read_value(Message_reader* reader);
+
+static void read_table(Message_reader* reader, Table* table) {
+    int count = read_int(reader);
+    for (int i = 0; i < count; i++) {
+        Value key = read_value(reader);
+        Value value = read_value(reader);
+        table_set(reader->vm, table, AS_STRING(key), value);
+    }
+}
+
+static Obj_function* read_function(Message_reader* reader, int slot) {
+    VM* vm = reader->vm;
+    Obj_function* function = new_function(vm);
+    add_object(reader, slot, (Obj*)function);
+
+    function->arity = read_int(reader);
+    function->upvalue_count = read_int(reader);
+    Value name = read_value(reader);
+    function->name = IS_NIL(name) ? NULL : AS_STRING(name);
+
+    Chunk* chunk = &function->chunk;
+    int count = read_int(reader);
+    uint8_t* code = ALLOCATE(vm, uint8_t, count);
+    read_bytes(reader, code, count);
+    chunk->code = code;
+    chunk->capacity = count;
+    chunk->count = count;
+    chunk->lines = ALLOCATE(vm, int, count);
+    read_bytes(reader, chunk->lines, sizeof(int) * count);
+
+    int constant_count = read_int(reader);
+    for (int i = 0; i < constant_count; i++)
+        write_value_array(vm, &chunk->constants, read_value(reader));
+    return function;
+}
+
+// Copies a function out of a segment the VM doesn't share, along with the
+// functions nested in it. The message holds the segment meanwhile.
+static Obj_function* copy_shared_function(VM* vm, Obj_function* shared) {
+    Obj_function* function = new_function(vm);
+    push(vm, OBJ_VAL(function));
+    function->arity = shared->arity;
+    function->upvalue_count = shared->upvalue_count;
+    if (shared->name != NULL)
+        function->name = copy_string(vm, shared->name->chars,
+                                     shared->name->length);
+
+    Chunk* chunk = &function->chunk;
+    int count = shared->chunk.count;
+    chunk->code = ALLOCATE(vm, uint8_t, count);
+    memcpy(chunk->code, shared->chunk.code, count);
+    chunk->capacity = count;
+    chunk->count = count;
+    chunk->lines = ALLOCATE(vm, int, count);
+    memcpy(chunk->lines, shared->chunk.lines, sizeof(int) * count);
+
+    Value_array* constants = &shared->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        Value value = constants->values[i];
+        if (IS_STRING(value))
+            value = OBJ_VAL(copy_string(vm, AS_CSTRING(value),
+                                        AS_STRING(value)->length));
+        else if (IS_FUNCTION(value))
+            value = OBJ_VAL(copy_shared_function(vm, AS_FUNCTION(value)));
+        add_constant(vm, chunk, value);
+    }
+
+    pop(vm);
+    return function;
+}
+
+static Value read_object(Message_reader* reader, Message_tag tag) {
+    VM* vm = reader->vm;
+    int slot = reserve_object(reader);
+    switch (tag) {
+    case TAG_BOUND_METHOD:
+    {
+        Value receiver = read_value(reader);
+        Value method = read_value(reader);
+        add_object(reader, slot, (Obj*)new_bound_method(vm, receiver,
+                                                        AS_CLOSURE(method)));
+        break;
+    }
+    case TAG_CHANNEL:
+    {
+        Channel* channel;
+        read_bytes(reader, &channel, sizeof(channel));
+        add_object(reader, slot, (Obj*)new_channel(vm, channel));
+        break;
+    }
+    case TAG_CLASS:
+    {
+        Value name = read_value(reader);
+        Obj_class* klass = new_class(vm, AS_STRING(name));
+        add_object(reader, slot, (Obj*)klass);
+        read_table(reader, &klass->methods);
+        break;
+    }
+    case TAG_CLOSURE:
+    {
+        Obj_function* function = AS_FUNCTION(read_value(reader));
+        Obj_closure* closure = new_closure(vm, function);
+        add_object(reader, slot, (Obj*)closure);
+        for (int i = 0; i < closure->upvalue_count; i++)
+            closure->upvalues[i] = (Obj_upvalue*)AS_OBJ(read_value(reader));
+        break;
+    }
+    case TAG_FLOAT_ARRAY:
+    {
+        int count = read_int(reader);
+        Obj_float_array* array = new_float_array(vm, count);
+        read_bytes(reader, array->values, sizeof(double) * count);
+        add_object(reader, slot, (Obj*)array);
+        break;
+    }
+    case TAG_FLOAT_VIEW:
+    {
+        int start = read_int(reader);
+        int count = read_int(reader);
+        Obj_float_array* base = AS_FLOAT_ARRAY(read_value(reader));
+        add_object(reader, slot,
+                   (Obj*)new_float_view(vm, base, start, count));
+        break;
+    }
+    case TAG_FUNCTION:
+        read_function(reader, slot);
+        break;
+    case TAG_INSTANCE:
+    {
+        Value klass = read_value(reader);
+        Obj_instance* instance = new_instance(vm, AS_CLASS(klass));
+        add_object(reader, slot, (Obj*)instance);
+        read_table(reader, &instance->fields);
+        break;
+    }
+    case TAG_LIST:
+    {
+        Obj_list* list = new_list(vm);
+        add_object(reader, slot, (Obj*)list);
+        int count = read_int(reader);
+        for (int i = 0; i < count; i++)
+            write_value_array(vm, &list->items, read_value(reader));
+        break;
+    }
+    case TAG_MAP:
+    {
+        // Objects hash by address, which differs here, so every entry goes
+        // in afresh.
+        Obj_map* map = new_map(vm);
+        add_object(reader, slot, (Obj*)map);
+        int count = read_int(reader);
+        for (int i = 0; i < count; i++) {
+            Value key = read_value(reader);
+            Value value = read_value(reader);
+            map_set(vm, map, key, value);
+        }
+        break;
+    }
+    case TAG_NAMED_NATIVE:
+    {
+        // The VM's own globals still hold its natives while a message is
+        // read.
+        Value name = read_value(reader);
+        Value native;
+        if (table_get(&vm->globals, AS_STRING(name), &native)
+            && IS_NATIVE(native))
+            vm->stack[slot] = native;
+        break;
+    }
+    case TAG_NATIVE:
+    {
+        int arity = read_int(reader);
+        Native_fn function;
+        read_bytes(reader, &function, sizeof(function));
+        Value name = read_value(reader);
+        add_object(reader, slot,
+                   (Obj*)new_native(vm, AS_STRING(name), arity, function));
+        break;
+    }
+    case TAG_SHARED_FUNCTION:
+    {
+        Obj_function* function;
+        read_bytes(reader, &function, sizeof(function));
+        if (reader->message->segment != vm->segment)
+            function = copy_shared_function(vm, function);
+        add_object(reader, slot, (Obj*)function);
+        break;
+    }
+    case TAG_STRING:
+    {
+        int length = read_int(reader);
+        const char* chars = (const char*)reader->message->bytes
+                            + reader->offset;
+        reader->offset += length;
+        add_object(reader, slot, (Obj*)copy_string(vm, chars, length));
+        break;
+    }
+    case TAG_UPVALUE:
+    {
+        Obj_upvalue* upvalue = new_upvalue(vm, NULL);
+        upvalue->location = &upvalue->closed;
+        add_object(reader, slot, (Obj*)upvalue);
+        upvalue->closed = read_value(reader);
+        break;
+    }
+    default:
+        break;
+    }
+    return vm->stack[slot];
+}
+
+static Value read_value(Message_reader* reader) {
+    Message_tag tag = (Message_tag)read_byte(reader);
+    switch (tag) {
+    case TAG_NIL:
+        return NIL_VAL;
+    case TAG_FALSE:
+        return BOOL_VAL(false);
+    case TAG_TRUE:
+        return BOOL_VAL(true);
+    case TAG_NUMBER:
+    {
+        double number;
+        read_bytes(reader, &number, sizeof(number));
+        return NUMBER_VAL(number);
+    }
+    case TAG_OBJECT:
+    {
+        int index;
+        read_bytes(reader, &index, sizeof(index));
+        return reader->vm->stack[reader->base + index];
+    }
+    default:
+        return read_object(reader, tag);
+    }
+}
+
+// Globals are only defined once the whole message has been read, since
+// natives are looked up among them on the way.
+static void read_globals_used(Message_reader* reader, bool replace) {
+    VM* vm = reader->vm;
+    Table globals;
+    init_table(&globals);
+    while (read_byte(reader) != 0) {
+        Value name = read_value(reader);
+        Value value = read_value(reader);
+        table_set(vm, &globals, AS_STRING(name), value);
+    }
+
+    for (int i = 0; i < globals.capacity; i++) {
+        Entry* entry = &globals.entries[i];
+        Value existing;
+        if (entry->key != NULL
+            && (replace || !table_get(&vm->globals, entry->key, &existing)))
+            table_set(vm, &vm->globals, entry->key, entry->value);
+    }
+    free_table(vm, &globals);
+}
+
+static void init_reader(Message_reader* reader, VM* vm,
+                        const Message* message) {
+    reader->vm = vm;
+    reader->message = message;
+    reader->offset = 0;
+    reader->base = (int)(vm->stack_top - vm->stack);
+}
+
+// Rebuilds the message's values in the VM and pushes them. Globals it
+// carries are defined unless the VM already has a global by that name.
+void read_message(VM* vm, const Message* message) {
+    Message_reader reader;
+    init_reader(&reader, vm, message);
+
+    // Values are read into the reserved slots, so that none of them can be
+    // collected while the rest are read.
+    int first = reader.base;
+    for (int i = 0; i < message->value_count; i++)
+        reserve_object(&reader);
+    reader.base += message->value_count;
+    for (int i = 0; i < message->value_count; i++) {
+        Value value = read_value(&reader);
+        vm->stack[first + i] = value;
+    }
+
+    read_globals_used(&reader, false);
+    vm->stack_top = vm->stack + first + message->value_count;
+}
+
+// Rebuilds the globals of a message made by write_globals(), replacing any
+// the VM has already.
+void read_globals(VM* vm, const Message* message) {
+    Message_reader reader;
+    init_reader(&reader, vm, message);
+    read_globals_used(&reader, true);
+    vm->stack_top = vm->stack + reader.base;
+}
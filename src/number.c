@@ -0,0 +1,624 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "number.h"
+
+// The shortest digits come from Ryu (Ulf Adams, 2018). A double and the
+// points halfway to its neighbours are scaled by a power of ten with 128
+// bit fixed point multipliers, and digits are dropped for as long as the
+// two bounds still differ, which leaves the shortest decimal between them.
+//
+// Parsing goes the other way with the Eisel-Lemire method (2020): the
+// decimal digits times a 128 bit approximation of the power of ten almost
+// always settle the double's 53 bits. Whatever it can't settle, strtod()
+// works out exactly.
+
+#define MANTISSA_BITS 52
+#define EXPONENT_BIAS 1023
+
+#define POW5_BITS 125
+#define POW5_COUNT 326
+#define POW5_INV_COUNT 342
+
+// Powers of ten a parsed number can have without being zero or infinite
+// for certain.
+#define POW10_MIN -342
+#define POW10_MAX 308
+
+typedef unsigned __int128 Wide;
+
+// Each multiplier is stored low half first.
+static uint64_t pow5[POW5_COUNT][2];
+static uint64_t pow5_inv[POW5_INV_COUNT][2];
+static uint64_t pow10[POW10_MAX - POW10_MIN + 1][2];
+
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+// Approximations of log2(5^e), log10(2^e) and log10(5^e) that are exact
+// over the exponents a double has. pow5_bits() rounds up, and is 1 for 0.
+static int pow5_bits(int e) {
+    return (int)(((uint32_t)e * 1217359) >> 19) + 1;
+}
+
+static int log10_pow2(int e) {
+    return (int)(((uint32_t)e * 78913) >> 18);
+}
+
+static int log10_pow5(int e) {
+    return (int)(((uint32_t)e * 732923) >> 20);
+}
+
+// The tables are worked out once, the first time a number needs them,
+// in plain long arithmetic on 1024 bit numbers.
+#define BIG_LIMBS 32
+
+static void multiply_big(uint32_t* limbs, uint32_t factor) {
+    uint64_t carry = 0;
+    for (int i = 0; i < BIG_LIMBS; i++) {
+        uint64_t product = (uint64_t)limbs[i] * factor + carry;
+        limbs[i] = (uint32_t)product;
+        carry = product >> 32;
+    }
+}
+
+static void divide_big(uint32_t* limbs, uint32_t divisor) {
+    uint64_t remainder = 0;
+    for (int i = BIG_LIMBS - 1; i >= 0; i--) {
+        uint64_t part = remainder << 32 | limbs[i];
+        limbs[i] = (uint32_t)(part / divisor);
+        remainder = part % divisor;
+    }
+}
+
+// The 64 bits starting at bit `position`, which counts as zero below the
+// lowest one.
+static uint64_t big_bits(const uint32_t* limbs, int position) {
+    uint64_t bits = 0;
+    for (int bit = position + 63; bit >= position; bit--) {
+        bits <<= 1;
+        if (bit >= 0 && bit < BIG_LIMBS * 32)
+            bits |= (limbs[bit / 32] >> (bit % 32)) & 1;
+    }
+    return bits;
+}
+
+// pow5[i] is 5^i cut down to its top POW5_BITS bits, and pow5_inv[i] is
+// 2^(pow5_bits(i) - 1 + POW5_BITS) / 5^i, rounded down and plus one.
+// pow10[q - POW10_MIN] is the top 128 bits of 10^q, rounded down, which
+// are the same as those of 5^q.
+static void build_tables() {
+    uint32_t power[BIG_LIMBS] = {1};
+    for (int i = 0; i < POW5_COUNT; i++) {
+        int shift = pow5_bits(i) - POW5_BITS;
+        pow5[i][0] = big_bits(power, shift);
+        pow5[i][1] = big_bits(power, shift + 64);
+        if (i <= POW10_MAX) {
+            shift = pow5_bits(i) - 128;
+            pow10[i - POW10_MIN][0] = big_bits(power, shift);
+            pow10[i - POW10_MIN][1] = big_bits(power, shift + 64);
+        }
+        multiply_big(power, 5);
+    }
+
+    // Dividing 2^1023 by five over and over rounds down just as dividing
+    // it by 5^i once would. What is left has 1024 - pow5_bits(i) bits.
+    uint32_t inverse[BIG_LIMBS] = {0};
+    inverse[BIG_LIMBS - 1] = 1u << 31;
+    for (int i = 0; i <= -POW10_MIN; i++) {
+        if (i < POW5_INV_COUNT) {
+            int shift = BIG_LIMBS * 32 - 1 - (pow5_bits(i) - 1 + POW5_BITS);
+            pow5_inv[i][0] = big_bits(inverse, shift) + 1;
+            pow5_inv[i][1] = big_bits(inverse, shift + 64)
+                             + (pow5_inv[i][0] == 0);
+        }
+        if (i > 0) {
+            int shift = BIG_LIMBS * 32 - pow5_bits(i) - 128;
+            pow10[-i - POW10_MIN][0] = big_bits(inverse, shift);
+            pow10[-i - POW10_MIN][1] = big_bits(inverse, shift + 64);
+        }
+        divide_big(inverse, 5);
+    }
+}
+
+static int pow5_factor(uint64_t value) {
+    int count = 0;
+    while (value % 5 == 0) {
+        value /= 5;
+        count++;
+    }
+    return count;
+}
+
+static bool multiple_of_pow5(uint64_t value, int power) {
+    return pow5_factor(value) >= power;
+}
+
+static bool multiple_of_pow2(uint64_t value, int power) {
+    return (value & ((1ull << power) - 1)) == 0;
+}
+
+static uint64_t mul_shift(uint64_t value, const uint64_t* factor, int shift) {
+    Wide low = (Wide)value * factor[0];
+    Wide high = (Wide)value * factor[1];
+    return (uint64_t)(((low >> 64) + high) >> (shift - 64));
+}
+
+// Finds the shortest digits that read back as the finite, nonzero double
+// with the given fields, so that it is *digits * 10^*exponent. When more
+// than one is as short, the closest one wins, and ties go to even.
+static void shortest(uint64_t ieee_mantissa, int ieee_exponent,
+                     uint64_t* digits, int* exponent) {
+    int e2;
+    uint64_t m2;
+    if (ieee_exponent == 0) {
+        e2 = 1 - EXPONENT_BIAS - MANTISSA_BITS - 2;
+        m2 = ieee_mantissa;
+    } else {
+        e2 = ieee_exponent - EXPONENT_BIAS - MANTISSA_BITS - 2;
+        m2 = (1ull << MANTISSA_BITS) | ieee_mantissa;
+    }
+    bool even = (m2 & 1) == 0;
+
+    // The double is mv / 4 * 2^e2, and its halfway points are mp and mm,
+    // which is closer when the double is the lowest of its binade.
+    uint64_t mv = 4 * m2;
+    uint64_t mp = mv + 2;
+    uint64_t mm = mv - 1 - (ieee_mantissa != 0 || ieee_exponent <= 1);
+
+    // Scale all three to decimal, noting whether anything dropped on the
+    // way was nonzero.
+    uint64_t vr, vp, vm;
+    int e10;
+    bool vm_trailing_zeros = false;
+    bool vr_trailing_zeros = false;
+    if (e2 >= 0) {
+        int q = log10_pow2(e2) - (e2 > 3);
+        e10 = q;
+        int shift = -e2 + q + POW5_BITS + pow5_bits(q) - 1;
+        vr = mul_shift(mv, pow5_inv[q], shift);
+        vp = mul_shift(mp, pow5_inv[q], shift);
+        vm = mul_shift(mm, pow5_inv[q], shift);
+        if (q <= 21) {
+            // At most one of the three can be a multiple of five.
+            if (mv % 5 == 0)
+                vr_trailing_zeros = multiple_of_pow5(mv, q);
+            else if (even)
+                vm_trailing_zeros = multiple_of_pow5(mm, q);
+            else
+                vp -= multiple_of_pow5(mp, q);
+        }
+    } else {
+        int q = log10_pow5(-e2) - (-e2 > 1);
+        e10 = q + e2;
+        int i = -e2 - q;
+        int shift = q - (pow5_bits(i) - POW5_BITS);
+        vr = mul_shift(mv, pow5[i], shift);
+        vp = mul_shift(mp, pow5[i], shift);
+        vm = mul_shift(mm, pow5[i], shift);
+        if (q <= 1) {
+            // mv always ends in two zero bits, and mp in one.
+            vr_trailing_zeros = true;
+            if (even)
+                vm_trailing_zeros = mv - mm == 2;
+            else
+                vp--;
+        } else if (q < 63)
+            vr_trailing_zeros = multiple_of_pow2(mv, q);
+    }
+
+    int removed = 0;
+    int last_removed = 0;
+    if (vm_trailing_zeros || vr_trailing_zeros) {
+        // Rare: a bound or the number itself might be exact, which decides
+        // whether the bound is allowed and how a tie rounds.
+        while (vp / 10 > vm / 10) {
+            vm_trailing_zeros &= vm % 10 == 0;
+            vr_trailing_zeros &= last_removed == 0;
+            last_removed = (int)(vr % 10);
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+        if (vm_trailing_zeros) {
+            while (vm % 10 == 0) {
+                vr_trailing_zeros &= last_removed == 0;
+                last_removed = (int)(vr % 10);
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+                removed++;
+            }
+        }
+        if (vr_trailing_zeros && last_removed == 5 && vr % 2 == 0)
+            last_removed = 4;
+        *digits = vr + ((vr == vm && (!even || !vm_trailing_zeros))
+                        || last_removed >= 5);
+    } else {
+        bool round_up = false;
+        if (vp / 100 > vm / 100) {
+            round_up = vr % 100 >= 50;
+            vr /= 100;
+            vp /= 100;
+            vm /= 100;
+            removed += 2;
+        }
+        while (vp / 10 > vm / 10) {
+            round_up = vr % 10 >= 5;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+        *digits = vr + (vr == vm || round_up);
+    }
+    *exponent = e10 + removed;
+}
+
+static int count_digits(uint64_t value) {
+    int count = 1;
+    while (value >= 10) {
+        value /= 10;
+        count++;
+    }
+    return count;
+}
+
+static void write_digits(char* out, uint64_t value, int count) {
+    for (int i = count - 1; i >= 0; i--) {
+        out[i] = (char)('0' + value % 10);
+        value /= 10;
+    }
+}
+
+// %g keeps six significant digits.
+#define G_DIGITS 6
+
+int format_number(char* buffer, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    int ieee_exponent = (int)(bits >> MANTISSA_BITS) & 0x7ff;
+    uint64_t ieee_mantissa = bits & ((1ull << MANTISSA_BITS) - 1);
+    if (ieee_exponent == 0x7ff)
+        return snprintf(buffer, NUMBER_MAX_LENGTH, "%g", value);
+
+    char* out = buffer;
+    if (bits >> 63)
+        *out++ = '-';
+
+    // Small whole numbers, zero among them, are the common case.
+    double magnitude = value < 0 ? -value : value;
+    if (magnitude < 1e6 && magnitude == (double)(int32_t)magnitude) {
+        int count = count_digits((uint64_t)magnitude);
+        write_digits(out, (uint64_t)magnitude, count);
+        out[count] = '\0';
+        return (int)(out - buffer) + count;
+    }
+
+    // A subnormal can have so few bits that its shortest form, though it
+    // reads back, isn't what six digits of the exact number round to.
+    if (ieee_exponent == 0)
+        return snprintf(buffer, NUMBER_MAX_LENGTH, "%g", value);
+
+    pthread_once(&tables_once, build_tables);
+    uint64_t digits;
+    int exponent;
+    shortest(ieee_mantissa, ieee_exponent, &digits, &exponent);
+    while (digits % 10 == 0) {
+        digits /= 10;
+        exponent++;
+    }
+
+    // No six digit decimal lies between the number and its shortest form,
+    // so rounding one rounds the other the same way. The exception is a
+    // shortest form that ends halfway, where the exact number decides.
+    int count = count_digits(digits);
+    if (count > G_DIGITS) {
+        if (count == G_DIGITS + 1 && digits % 10 == 5)
+            return snprintf(buffer, NUMBER_MAX_LENGTH, "%g", value);
+
+        uint64_t divisor = 1;
+        for (int i = G_DIGITS; i < count; i++)
+            divisor *= 10;
+        bool round_up = digits % divisor >= divisor / 2;
+        digits = digits / divisor + round_up;
+        exponent += count - G_DIGITS;
+        while (digits % 10 == 0) {
+            digits /= 10;
+            exponent++;
+        }
+        count = count_digits(digits);
+    }
+
+    char text[G_DIGITS];
+    write_digits(text, digits, count);
+    int leading = exponent + count - 1;
+    if (leading < -4 || leading >= G_DIGITS) {
+        *out++ = text[0];
+        if (count > 1) {
+            *out++ = '.';
+            memcpy(out, text + 1, count - 1);
+            out += count - 1;
+        }
+        *out++ = 'e';
+        *out++ = leading < 0 ? '-' : '+';
+        int power = leading < 0 ? -leading : leading;
+        int power_digits = power < 100 ? 2 : 3;
+        write_digits(out, (uint64_t)power, power_digits);
+        out += power_digits;
+    } else if (exponent >= 0) {
+        memcpy(out, text, count);
+        out += count;
+        memset(out, '0', exponent);
+        out += exponent;
+    } else if (leading >= 0) {
+        memcpy(out, text, leading + 1);
+        out += leading + 1;
+        *out++ = '.';
+        memcpy(out, text + leading + 1, count - leading - 1);
+        out += count - leading - 1;
+    } else {
+        *out++ = '0';
+        *out++ = '.';
+        memset(out, '0', -leading - 1);
+        out += -leading - 1;
+        memcpy(out, text, count);
+        out += count;
+    }
+    *out = '\0';
+    return (int)(out - buffer);
+}
+
+int format_shortest(char* buffer, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    int ieee_exponent = (int)(bits >> MANTISSA_BITS) & 0x7ff;
+    uint64_t ieee_mantissa = bits & ((1ull << MANTISSA_BITS) - 1);
+    if (ieee_exponent == 0x7ff)
+        return snprintf(buffer, NUMBER_MAX_LENGTH, "%g", value);
+
+    char* out = buffer;
+    if (bits >> 63)
+        *out++ = '-';
+
+    // Whole numbers below 2^53 are their own shortest digits.
+    double magnitude = value < 0 ? -value : value;
+    if (magnitude < 9007199254740992.0
+        && magnitude == (double)(int64_t)magnitude) {
+        int count = count_digits((uint64_t)magnitude);
+        write_digits(out, (uint64_t)magnitude, count);
+        out[count] = '\0';
+        return (int)(out - buffer) + count;
+    }
+
+    pthread_once(&tables_once, build_tables);
+    uint64_t digits;
+    int exponent;
+    shortest(ieee_mantissa, ieee_exponent, &digits, &exponent);
+    while (digits % 10 == 0) {
+        digits /= 10;
+        exponent++;
+    }
+
+    // Laid out as JavaScript does: plainly from 1e-7 up to 1e21.
+    char text[20];
+    int count = count_digits(digits);
+    write_digits(text, digits, count);
+    int point = exponent + count;
+    if (point > 21 || point < -5) {
+        *out++ = text[0];
+        if (count > 1) {
+            *out++ = '.';
+            memcpy(out, text + 1, count - 1);
+            out += count - 1;
+        }
+        *out++ = 'e';
+        *out++ = point - 1 < 0 ? '-' : '+';
+        int power = point - 1 < 0 ? 1 - point : point - 1;
+        int power_digits = count_digits((uint64_t)power);
+        write_digits(out, (uint64_t)power, power_digits);
+        out += power_digits;
+    } else if (point >= count) {
+        memcpy(out, text, count);
+        out += count;
+        memset(out, '0', point - count);
+        out += point - count;
+    } else if (point > 0) {
+        memcpy(out, text, point);
+        out += point;
+        *out++ = '.';
+        memcpy(out, text + point, count - point);
+        out += count - point;
+    } else {
+        *out++ = '0';
+        *out++ = '.';
+        memset(out, '0', -point);
+        out += -point;
+        memcpy(out, text, count);
+        out += count;
+    }
+    *out = '\0';
+    return (int)(out - buffer);
+}
+
+// The most digits a uint64_t holds whatever they are.
+#define FAST_DIGITS 19
+
+// Powers of ten that doubles hold exactly.
+static const double exact_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Works out digits * 10^exponent for nonzero digits, or fails when the
+// product can't tell which way a halfway case rounds, or when the result
+// is subnormal or out of range.
+static bool eisel_lemire(uint64_t digits, int exponent, double* value) {
+    if (exponent < POW10_MIN || exponent > POW10_MAX)
+        return false;
+
+    // Normalize the digits so that their top bit is set.
+    int zeros = __builtin_clzll(digits);
+    digits <<= zeros;
+    int e2 = ((217706 * exponent) >> 16) + 64 + EXPONENT_BIAS - zeros;
+
+    const uint64_t* factor = pow10[exponent - POW10_MIN];
+    Wide product = (Wide)digits * factor[1];
+    uint64_t high = (uint64_t)(product >> 64);
+    uint64_t low = (uint64_t)product;
+
+    // When the bits below the 54 kept might carry into them, bring in the
+    // rest of the power. If they still might, give up.
+    if ((high & 0x1ff) == 0x1ff && low + digits < digits) {
+        Wide more = (Wide)digits * factor[0];
+        uint64_t more_high = (uint64_t)(more >> 64);
+        uint64_t merged_low = low + more_high;
+        uint64_t merged_high = high + (merged_low < low);
+        if ((merged_high & 0x1ff) == 0x1ff && merged_low + 1 == 0
+            && (uint64_t)more + digits < digits)
+            return false;
+        high = merged_high;
+        low = merged_low;
+    }
+
+    int top = (int)(high >> 63);
+    uint64_t mantissa = high >> (top + 9);
+    e2 -= 1 ^ top;
+
+    // Exactly halfway between two doubles, as far as can be told.
+    if (low == 0 && (high & 0x1ff) == 0 && (mantissa & 3) == 1)
+        return false;
+
+    mantissa += mantissa & 1;
+    mantissa >>= 1;
+    if (mantissa >> 53) {
+        mantissa >>= 1;
+        e2++;
+    }
+    if (e2 <= 0 || e2 >= 0x7ff)
+        return false;
+
+    uint64_t bits = (uint64_t)e2 << MANTISSA_BITS
+                    | (mantissa & ((1ull << MANTISSA_BITS) - 1));
+    memcpy(value, &bits, sizeof(bits));
+    return true;
+}
+
+// strtod() wants a terminated string, and the text may run on into more.
+static double parse_slow(const char* chars, int length) {
+    char small[64];
+    char* text = small;
+    if (length >= (int)sizeof(small)) {
+        text = (char*)malloc(length + 1);
+        if (text == NULL)
+            exit(1);
+    }
+    memcpy(text, chars, length);
+    text[length] = '\0';
+
+    double value = strtod(text, NULL);
+    if (text != small)
+        free(text);
+    return value;
+}
+
+static bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static bool matches(const char* chars, int length, const char* word) {
+    return length == (int)strlen(word) && memcmp(chars, word, length) == 0;
+}
+
+bool parse_number(const char* chars, int length, double* value) {
+    const char* end = chars + length;
+    const char* current = chars;
+    bool negative = false;
+    if (current < end && (*current == '-' || *current == '+')) {
+        negative = *current == '-';
+        current++;
+    }
+
+    int rest = (int)(end - current);
+    if (matches(current, rest, "inf") || matches(current, rest, "nan")) {
+        double special = current[0] == 'i' ? INFINITY : NAN;
+        *value = negative ? -special : special;
+        return true;
+    }
+
+    // The digits before and after the point go into one number, and the
+    // ones after it come off the exponent.
+    uint64_t digits = 0;
+    int significant = 0;
+    int exponent = 0;
+    bool any_digits = false;
+    for (; current < end && is_digit(*current); current++) {
+        any_digits = true;
+        if (significant > 0 || *current != '0') {
+            digits = digits * 10 + (uint64_t)(*current - '0');
+            significant++;
+        }
+    }
+    if (current < end && *current == '.') {
+        for (current++; current < end && is_digit(*current); current++) {
+            any_digits = true;
+            if (significant > 0 || *current != '0') {
+                digits = digits * 10 + (uint64_t)(*current - '0');
+                significant++;
+            }
+            exponent--;
+        }
+    }
+    if (!any_digits)
+        return false;
+
+    if (current < end && (*current == 'e' || *current == 'E')) {
+        current++;
+        bool negative_exponent = false;
+        if (current < end && (*current == '-' || *current == '+')) {
+            negative_exponent = *current == '-';
+            current++;
+        }
+        if (current == end || !is_digit(*current))
+            return false;
+
+        // Past this much it is zero or infinity either way.
+        int power = 0;
+        for (; current < end && is_digit(*current); current++) {
+            if (power < 100000)
+                power = power * 10 + (*current - '0');
+        }
+        exponent += negative_exponent ? -power : power;
+    }
+    if (current != end)
+        return false;
+
+    // Too many digits to hold, which is rare enough to leave to strtod().
+    if (significant > FAST_DIGITS) {
+        *value = parse_slow(chars, length);
+        return true;
+    }
+
+    double result;
+    if (digits == 0)
+        result = 0;
+    else if (digits < (1ull << 53) && exponent >= -22 && exponent <= 22) {
+        // Both are exact, so one rounding gives the right answer.
+        result = (double)digits;
+        if (exponent < 0)
+            result /= exact_pow10[-exponent];
+        else
+            result *= exact_pow10[exponent];
+    } else {
+        pthread_once(&tables_once, build_tables);
+        if (!eisel_lemire(digits, exponent, &result)) {
+            *value = parse_slow(chars, length);
+            return true;
+        }
+    }
+    *value = negative ? -result : result;
+    return true;
+}
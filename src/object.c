@@ -1,22 +1,26 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "intern.h"
 #include "memory.h"
 #include "object.h"
+#include "pool.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
 
-#define ALLOCATE_OBJ(type, object_type) \
-    (type*)allocate_object(sizeof(type), object_type)
+#define ALLOCATE_OBJ(vm, type, object_type) \
+    (type*)allocate_object(vm, sizeof(type), object_type)
 
-static Obj* allocate_object(size_t size, Obj_type type) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+static Obj* allocate_object(VM* vm, size_t size, Obj_type type) {
+    Obj* object = (Obj*)reallocate(vm, NULL, 0, size);
     object->type = type;
     object->is_marked = false;
+    object->is_shared = false;
 
-    object->next = vm.objects;
-    vm.objects = object;
+    object->next = vm->objects;
+    vm->objects = object;
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %ld for %d\n", (void*)object, size, type);
@@ -25,65 +29,143 @@ static Obj* allocate_object(size_t size, Obj_type type) {
     return object;
 }
 
-Obj_bound_method* new_bound_method(Value receiver, Obj_closure *method) {
-    Obj_bound_method* bound = ALLOCATE_OBJ(Obj_bound_method, OBJ_BOUND_METHOD);
+Obj_bound_method* new_bound_method(VM* vm, Value receiver,
+                                   Obj_closure *method) {
+    Obj_bound_method* bound = ALLOCATE_OBJ(vm, Obj_bound_method,
+                                           OBJ_BOUND_METHOD);
     bound->receiver = receiver;
     bound->method = method;
     return bound;
 }
 
-Obj_class* new_class(Obj_string *name) {
-    Obj_class* klass = ALLOCATE_OBJ(Obj_class, OBJ_CLASS);
+Obj_channel* new_channel(VM* vm, Channel* channel) {
+    Obj_channel* handle = ALLOCATE_OBJ(vm, Obj_channel, OBJ_CHANNEL);
+    handle->channel = channel;
+    retain_channel(channel);
+    return handle;
+}
+
+Obj_class* new_class(VM* vm, Obj_string *name) {
+    Obj_class* klass = ALLOCATE_OBJ(vm, Obj_class, OBJ_CLASS);
     klass->name = name;
     init_table(&klass->methods);
     return klass;
 }
 
-Obj_closure* new_closure(Obj_function *function) {
-    Obj_upvalue** upvalues = ALLOCATE(Obj_upvalue*, function->upvalue_count);
+Obj_closure* new_closure(VM* vm, Obj_function *function) {
+    Obj_upvalue** upvalues = ALLOCATE(vm, Obj_upvalue*,
+                                      function->upvalue_count);
     for (int i = 0; i < function->upvalue_count; i++)
         upvalues[i] = NULL;
 
-    Obj_closure* closure = ALLOCATE_OBJ(Obj_closure, OBJ_CLOSURE);
+    Obj_closure* closure = ALLOCATE_OBJ(vm, Obj_closure, OBJ_CLOSURE);
     closure->function = function;
     closure->upvalues = upvalues;
     closure->upvalue_count = function->upvalue_count;
     return closure;
 }
 
-Obj_function* new_function() {
-    Obj_function* function = ALLOCATE_OBJ(Obj_function, OBJ_FUNCTION);
+// The stack starts out holding the closure, ready to be called by the
+// first resume().
+Obj_fiber* new_fiber(VM* vm, Obj_closure* closure) {
+    Call_frame* frames
+            = (Call_frame*)malloc(sizeof(Call_frame) * FIBER_FRAMES_INITIAL);
+    Value* stack = (Value*)malloc(sizeof(Value) * FIBER_STACK_INITIAL);
+    if (frames == NULL || stack == NULL)
+        exit(1);
+
+    Obj_fiber* fiber = ALLOCATE_OBJ(vm, Obj_fiber, OBJ_FIBER);
+    fiber->status = FIBER_NEW;
+    fiber->closure = closure;
+    fiber->caller = NULL;
+    fiber->native_depth = 0;
+    fiber->frames = frames;
+    fiber->frame_count = 0;
+    fiber->frame_capacity = FIBER_FRAMES_INITIAL;
+    fiber->stack = stack;
+    fiber->stack[0] = OBJ_VAL(closure);
+    fiber->stack_top = stack + 1;
+    fiber->stack_capacity = FIBER_STACK_INITIAL;
+    fiber->open_upvalues = NULL;
+    return fiber;
+}
+
+// The values start out as zero.
+Obj_float_array* new_float_array(VM* vm, int count) {
+    double* values = ALLOCATE(vm, double, count);
+    for (int i = 0; i < count; i++)
+        values[i] = 0;
+
+    Obj_float_array* array = ALLOCATE_OBJ(vm, Obj_float_array,
+                                          OBJ_FLOAT_ARRAY);
+    array->count = count;
+    array->values = values;
+    array->base = NULL;
+    return array;
+}
+
+// A view of a view shares the values of the array that owns them.
+Obj_float_array* new_float_view(VM* vm, Obj_float_array* array, int start,
+                                int count) {
+    Obj_float_array* view = ALLOCATE_OBJ(vm, Obj_float_array,
+                                         OBJ_FLOAT_ARRAY);
+    view->count = count;
+    view->values = array->values + start;
+    view->base = array->base != NULL ? array->base : array;
+    return view;
+}
+
+Obj_function* new_function(VM* vm) {
+    Obj_function* function = ALLOCATE_OBJ(vm, Obj_function, OBJ_FUNCTION);
 
     function->arity = 0;
     function->upvalue_count = 0;
     function->name = NULL;
+    function->image = NULL;
+    function->image_index = 0;
     init_chunk(&function->chunk);
     return function;
 }
 
-Obj_instance* new_instance(Obj_class *klass) {
-    Obj_instance* instance = ALLOCATE_OBJ(Obj_instance, OBJ_INSTANCE);
+Obj_instance* new_instance(VM* vm, Obj_class *klass) {
+    Obj_instance* instance = ALLOCATE_OBJ(vm, Obj_instance, OBJ_INSTANCE);
     instance->klass = klass;
     init_table(&instance->fields);
     return instance;
 }
 
-Obj_native* new_native(Native_fn function) {
-    Obj_native* native = ALLOCATE_OBJ(Obj_native, OBJ_NATIVE);
+Obj_list* new_list(VM* vm) {
+    Obj_list* list = ALLOCATE_OBJ(vm, Obj_list, OBJ_LIST);
+    init_value_array(&list->items);
+    return list;
+}
+
+Obj_map* new_map(VM* vm) {
+    Obj_map* map = ALLOCATE_OBJ(vm, Obj_map, OBJ_MAP);
+    map->count = 0;
+    map->live = 0;
+    map->capacity = 0;
+    map->entries = NULL;
+    return map;
+}
+
+Obj_native* new_native(VM* vm, Obj_string* name, int arity,
+                       Native_fn function) {
+    Obj_native* native = ALLOCATE_OBJ(vm, Obj_native, OBJ_NATIVE);
+    native->name = name;
+    native->arity = arity;
     native->function = function;
     return native;
 }
 
-static Obj_string* allocate_string(char* chars, int length,
-                                   uint32_t hash) {
-    Obj_string* string = ALLOCATE_OBJ(Obj_string, OBJ_STRING);
+static Obj_string* allocate_string(VM* vm, char* chars, int length,
+                                   uint32_t hash, int intern_index) {
+    Obj_string* string = ALLOCATE_OBJ(vm, Obj_string, OBJ_STRING);
     string->length = length;
     string->chars = chars;
     string->hash = hash;
 
-    push(OBJ_VAL(string));
-    table_set(&vm.strings, string, NIL_VAL);
-    pop();
+    intern_set_insert(&vm->strings, intern_index, string);
 
     return string;
 }
@@ -99,71 +181,158 @@ static uint32_t hash_string(const char* key, int length) {
     return hash;
 }
 
-Obj_string* take_string(char *chars, int length) {
+Obj_string* take_string(VM* vm, char *chars, int length) {
     uint32_t hash = hash_string(chars, length);
-    Obj_string* interned = table_find_string(&vm.strings, chars, length, hash);
+    int index;
+    Obj_string* interned = intern_set_find(vm, &vm->strings, chars, length,
+                                           hash, &index);
     if (interned) {
-        FREE_ARRAY(char, chars, length + 1);
+        FREE_ARRAY(vm, char, chars, length + 1);
         return interned;
     }
 
-    return allocate_string(chars, length, hash);
+    return allocate_string(vm, chars, length, hash, index);
 }
 
-Obj_string* copy_string(const char *chars, int length) {
+Obj_string* copy_string(VM* vm, const char *chars, int length) {
     uint32_t hash = hash_string(chars, length);
-    Obj_string* interned = table_find_string(&vm.strings, chars, length, hash);
+    int index;
+    Obj_string* interned = intern_set_find(vm, &vm->strings, chars, length,
+                                           hash, &index);
     if (interned)
         return interned;
 
-    char* heap_chars = ALLOCATE(char, length + 1);
+    char* heap_chars = ALLOCATE(vm, char, length + 1);
     memcpy(heap_chars, chars, length);
     heap_chars[length] = '\0';
 
-    return allocate_string(heap_chars, length, hash);
+    return allocate_string(vm, heap_chars, length, hash, index);
 }
 
-Obj_upvalue* new_upvalue(Value *slot) {
-    Obj_upvalue* upvalue = ALLOCATE_OBJ(Obj_upvalue, OBJ_UPVALUE);
+Obj_upvalue* new_upvalue(VM* vm, Value *slot) {
+    Obj_upvalue* upvalue = ALLOCATE_OBJ(vm, Obj_upvalue, OBJ_UPVALUE);
     upvalue->closed = NIL_VAL;
     upvalue->location = slot;
     upvalue->next = NULL;
+    upvalue->fiber = NULL;
     return upvalue;
 }
 
-static void print_function(Obj_function* function) {
+static void write_function(Output* output, Obj_function* function) {
     if (function->name == NULL) {
-        printf("<script>");
+        write_string(output, "<script>");
         return;
     }
-    printf("<fn %s>", function->name->chars);
+    write_string(output, "<fn ");
+    write_string(output, function->name->chars);
+    write_chars(output, ">", 1);
 }
 
-void print_object(Value value) {
+// Lists and maps nested deeper than this, which includes any that hold
+// themselves, are cut short.
+#define PRINT_MAX_DEPTH 16
+
+static void write_nested(Output* output, Value value, int depth);
+
+static void write_list(Output* output, Obj_list* list, int depth) {
+    if (depth == PRINT_MAX_DEPTH) {
+        write_string(output, "[...]");
+        return;
+    }
+
+    write_chars(output, "[", 1);
+    for (int i = 0; i < list->items.count; i++) {
+        if (i > 0)
+            write_chars(output, ", ", 2);
+        write_nested(output, list->items.values[i], depth + 1);
+    }
+    write_chars(output, "]", 1);
+}
+
+static void write_map(Output* output, Obj_map* map, int depth) {
+    if (depth == PRINT_MAX_DEPTH) {
+        write_string(output, "{...}");
+        return;
+    }
+
+    write_chars(output, "{", 1);
+    bool first = true;
+    for (int i = 0; i < map->capacity; i++) {
+        Map_entry* entry = &map->entries[i];
+        if (IS_OBJ(entry->key) && AS_OBJ(entry->key) == NULL)
+            continue;
+
+        if (!first)
+            write_chars(output, ", ", 2);
+        first = false;
+        write_nested(output, entry->key, depth + 1);
+        write_chars(output, ": ", 2);
+        write_nested(output, entry->value, depth + 1);
+    }
+    write_chars(output, "}", 1);
+}
+
+static void write_float_array(Output* output, Obj_float_array* array) {
+    write_string(output, "Float64Array[");
+    for (int i = 0; i < array->count; i++) {
+        if (i > 0)
+            write_chars(output, ", ", 2);
+        write_number(output, array->values[i]);
+    }
+    write_chars(output, "]", 1);
+}
+
+static void write_nested(Output* output, Value value, int depth) {
+    if (IS_LIST(value))
+        write_list(output, AS_LIST(value), depth);
+    else if (IS_MAP(value))
+        write_map(output, AS_MAP(value), depth);
+    else
+        output_value(output, value);
+}
+
+// Strings are written up to their first null character, as printf would.
+void output_object(Output* output, Value value) {
     switch (OBJ_TYPE(value)) {
     case OBJ_BOUND_METHOD:
-        print_function(AS_BOUND_METHOD(value)->method->function);
+        write_function(output, AS_BOUND_METHOD(value)->method->function);
+        break;
+    case OBJ_CHANNEL:
+        write_string(output, "<channel>");
         break;
     case OBJ_CLASS:
-        printf("%s", AS_CLASS(value)->name->chars);
+        write_string(output, AS_CLASS(value)->name->chars);
         break;
     case OBJ_CLOSURE:
-        print_function(AS_CLOSURE(value)->function);
+        write_function(output, AS_CLOSURE(value)->function);
+        break;
+    case OBJ_FIBER:
+        write_string(output, "<fiber>");
+        break;
+    case OBJ_FLOAT_ARRAY:
+        write_float_array(output, AS_FLOAT_ARRAY(value));
         break;
     case OBJ_FUNCTION:
-        print_function(AS_FUNCTION(value));
+        write_function(output, AS_FUNCTION(value));
         break;
     case OBJ_INSTANCE:
-        printf("%s instance", AS_INSTANCE(value)->klass->name->chars);
+        write_string(output, AS_INSTANCE(value)->klass->name->chars);
+        write_string(output, " instance");
+        break;
+    case OBJ_LIST:
+        write_list(output, AS_LIST(value), 0);
+        break;
+    case OBJ_MAP:
+        write_map(output, AS_MAP(value), 0);
         break;
     case OBJ_NATIVE:
-        printf("<native fn>");
+        write_string(output, "<native fn>");
         break;
     case OBJ_STRING:
-        printf("%s", AS_CSTRING(value));
+        write_string(output, AS_CSTRING(value));
         break;
     case OBJ_UPVALUE:
-        printf("upvalue");
+        write_string(output, "upvalue");
         break;
     }
 }
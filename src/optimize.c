@@ -0,0 +1,1260 @@
+#include <string.h>
+
+#include "memory.h"
+#include "optimize.h"
+#include "table.h"
+#include "vm.h"
+
+#ifdef DEBUG_PRINT_CODE
+#include "debug.h"
+#endif
+
+// The optimizer lifts a finished chunk into a list of decoded instructions
+// grouped into basic blocks, with jump targets resolved to instructions and
+// the stack depth known before every instruction. Passes rewrite that form
+// and it is then lowered back into bytecode, recomputing every jump. Since
+// locals are just stack slots, the passes track stack slots rather than
+// variables. A function whose code can't be lifted is left as it is.
+
+#define SLOT_WORDS (UINT8_COUNT / 64)
+#define MAX_THREADING 16
+#define MAX_INLINE_LENGTH 32
+
+typedef struct {
+    uint8_t op;
+    uint8_t operand;
+    uint8_t extra;
+    bool removed;
+    int line;
+    int offset;         // In the original code, where OP_CLOSURE's operands
+                        // are copied from.
+    int length;
+    int target;         // Instruction a jump goes to.
+    int block;
+    int depth;          // Stack depth before the instruction.
+    uint8_t* expansion; // Code that replaces the instruction when lowered.
+} Ir_instruction;
+
+typedef struct {
+    int start;
+    int end;
+    int successors[2];
+    int successor_count;
+    int depth;          // Stack depth on entry, -1 if unreachable.
+    uint64_t live_in[SLOT_WORDS];
+    uint64_t live_out[SLOT_WORDS];
+} Ir_block;
+
+typedef struct {
+    Obj_function* function;
+    Chunk* chunk;
+
+    int capacity;
+    int count;
+    Ir_instruction* instructions;
+    int block_capacity;
+    int block_count;
+    Ir_block* blocks;
+    int max_depth;
+
+    // Slots captured by closures can change behind the function's back.
+    uint64_t captured[SLOT_WORDS];
+} Ir_function;
+
+static bool slot_in(const uint64_t* set, int slot) {
+    return slot < UINT8_COUNT && (set[slot / 64] >> (slot % 64)) & 1;
+}
+
+static void slot_add(uint64_t* set, int slot) {
+    if (slot < UINT8_COUNT)
+        set[slot / 64] |= (uint64_t)1 << (slot % 64);
+}
+
+static void slot_remove(uint64_t* set, int slot) {
+    if (slot < UINT8_COUNT)
+        set[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+}
+
+static bool is_conditional(uint8_t op) {
+    return op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE;
+}
+
+static bool is_jump(uint8_t op) {
+    return op == OP_JUMP || op == OP_LOOP || is_conditional(op);
+}
+
+static bool ends_block(uint8_t op) {
+    return is_jump(op) || op == OP_RETURN;
+}
+
+// How many values the instruction pops and pushes.
+static void instruction_effect(Ir_instruction* instruction, int* pops,
+                               int* pushes) {
+    uint8_t code[] = { instruction->op, instruction->operand,
+                       instruction->extra };
+    stack_effect(code, pops, pushes);
+}
+
+// The first instruction at or after index that is still there.
+static int resolve(Ir_function* ir, int index) {
+    while (index < ir->count && ir->instructions[index].removed)
+        index++;
+    return index;
+}
+
+static bool lift(VM* vm, Ir_function* ir) {
+    Chunk* chunk = ir->chunk;
+
+    // Instructions can't outnumber bytes.
+    ir->capacity = chunk->count;
+    ir->instructions = ALLOCATE(vm, Ir_instruction, ir->capacity);
+    int* indices = ALLOCATE(vm, int, chunk->count + 1);
+    for (int i = 0; i <= chunk->count; i++)
+        indices[i] = -1;
+
+    ir->count = 0;
+    for (int offset = 0; offset < chunk->count; ) {
+        Ir_instruction* instruction = &ir->instructions[ir->count];
+        instruction->op = chunk->code[offset];
+        instruction->length = instruction_length(chunk, offset);
+        instruction->operand = instruction->length > 1
+                                   ? chunk->code[offset + 1]
+                                   : 0;
+        instruction->extra = instruction->length > 2
+                                 ? chunk->code[offset + 2]
+                                 : 0;
+        instruction->removed = false;
+        instruction->line = chunk->lines[offset];
+        instruction->offset = offset;
+        instruction->target = -1;
+        instruction->block = -1;
+        instruction->depth = -1;
+        instruction->expansion = NULL;
+
+        if (instruction->length == 0) {
+            ir->count = 0;
+            break;
+        }
+
+        if (instruction->op == OP_CLOSURE) {
+            for (int i = 0; i < instruction->length - 2; i += 2) {
+                if (chunk->code[offset + 2 + i])
+                    slot_add(ir->captured, chunk->code[offset + 3 + i]);
+            }
+        }
+
+        indices[offset] = ir->count++;
+        offset += instruction->length;
+    }
+
+    bool lifted = ir->count > 0;
+    for (int i = 0; lifted && i < ir->count; i++) {
+        Ir_instruction* instruction = &ir->instructions[i];
+        if (is_jump(instruction->op)) {
+            int jump = (instruction->operand << 8) | instruction->extra;
+            int target = instruction->offset + 3
+                         + (instruction->op == OP_LOOP ? -jump : jump);
+            if (target < 0 || target >= chunk->count
+                || indices[target] == -1)
+                lifted = false;
+            else
+                instruction->target = indices[target];
+        }
+    }
+
+    FREE_ARRAY(vm, int, indices, chunk->count + 1);
+    return lifted;
+}
+
+static int add_block(VM* vm, Ir_function* ir, int start) {
+    if (ir->block_capacity < ir->block_count + 1) {
+        int old_capacity = ir->block_capacity;
+        ir->block_capacity = GROW_CAPACITY(old_capacity);
+        ir->blocks = GROW_ARRAY(vm, Ir_block, ir->blocks, old_capacity,
+                                ir->block_capacity);
+    }
+
+    Ir_block* block = &ir->blocks[ir->block_count];
+    block->start = start;
+    block->end = start;
+    block->successor_count = 0;
+    block->depth = -1;
+    return ir->block_count++;
+}
+
+static bool propagate_depth(Ir_function* ir, int* worklist, int* pending,
+                            int block, int depth) {
+    Ir_block* successor = &ir->blocks[block];
+    if (successor->depth == -1) {
+        successor->depth = depth;
+        worklist[(*pending)++] = block;
+        return true;
+    }
+
+    // Every path into a block has to agree on the stack.
+    return successor->depth == depth;
+}
+
+// Splits the remaining instructions into basic blocks, links them up and
+// works out the stack depth before each instruction. Blocks that can't be
+// reached keep a depth of -1.
+static bool build_blocks(VM* vm, Ir_function* ir) {
+    bool* leaders = ALLOCATE(vm, bool, ir->count + 1);
+    for (int i = 0; i <= ir->count; i++)
+        leaders[i] = false;
+
+    leaders[resolve(ir, 0)] = true;
+    for (int i = 0; i < ir->count; i++) {
+        Ir_instruction* instruction = &ir->instructions[i];
+        if (instruction->removed)
+            continue;
+        if (is_jump(instruction->op))
+            leaders[resolve(ir, instruction->target)] = true;
+        if (ends_block(instruction->op))
+            leaders[resolve(ir, i + 1)] = true;
+    }
+
+    ir->block_count = 0;
+    for (int i = 0; i < ir->count; i++) {
+        Ir_instruction* instruction = &ir->instructions[i];
+        if (instruction->removed)
+            continue;
+        if (leaders[i])
+            add_block(vm, ir, i);
+        instruction->block = ir->block_count - 1;
+        instruction->depth = -1;
+        ir->blocks[ir->block_count - 1].end = i + 1;
+    }
+    FREE_ARRAY(vm, bool, leaders, ir->count + 1);
+
+    for (int b = 0; b < ir->block_count; b++) {
+        Ir_block* block = &ir->blocks[b];
+        Ir_instruction* last = &ir->instructions[block->end - 1];
+
+        if (is_jump(last->op)) {
+            int target = resolve(ir, last->target);
+            if (target >= ir->count)
+                return false;
+            block->successors[block->successor_count++]
+                    = ir->instructions[target].block;
+        }
+
+        if (last->op != OP_RETURN && last->op != OP_JUMP
+            && last->op != OP_LOOP) {
+            // Falling off the end of the code would be a bug.
+            if (b + 1 == ir->block_count)
+                return false;
+            block->successors[block->successor_count++] = b + 1;
+        }
+    }
+
+    int* worklist = ALLOCATE(vm, int, ir->block_count);
+    int pending = 0;
+    bool consistent = propagate_depth(ir, worklist, &pending, 0,
+                                      ir->function->arity + 1);
+    ir->max_depth = ir->function->arity + 1;
+
+    while (consistent && pending > 0) {
+        Ir_block* block = &ir->blocks[worklist[--pending]];
+        int depth = block->depth;
+
+        for (int i = block->start; i < block->end; i++) {
+            Ir_instruction* instruction = &ir->instructions[i];
+            if (instruction->removed)
+                continue;
+
+            int pops, pushes;
+            instruction_effect(instruction, &pops, &pushes);
+            instruction->depth = depth;
+            if (depth < pops) {
+                consistent = false;
+                break;
+            }
+            depth += pushes - pops;
+            if (depth > ir->max_depth)
+                ir->max_depth = depth;
+        }
+
+        for (int s = 0; consistent && s < block->successor_count; s++)
+            consistent = propagate_depth(ir, worklist, &pending,
+                                         block->successors[s], depth);
+    }
+    FREE_ARRAY(vm, int, worklist, ir->block_count);
+
+    return consistent;
+}
+
+// Jump threading: a jump that lands on another jump goes straight to where
+// that one goes, and a jump that lands on a return becomes the return.
+static void thread_jumps(Ir_function* ir) {
+    for (int i = 0; i < ir->count; i++) {
+        Ir_instruction* instruction = &ir->instructions[i];
+        if (instruction->removed || !is_jump(instruction->op))
+            continue;
+
+        bool conditional = is_conditional(instruction->op);
+        int target = resolve(ir, instruction->target);
+        for (int step = 0; step < MAX_THREADING && target < ir->count;
+             step++) {
+            Ir_instruction* landing = &ir->instructions[target];
+            int next = -1;
+
+            if (landing->op == OP_JUMP || landing->op == OP_LOOP)
+                next = resolve(ir, landing->target);
+            else if (landing->op == instruction->op && conditional)
+                // The same value is still on the stack and still decides
+                // the same way.
+                next = resolve(ir, landing->target);
+            else if (!conditional && landing->op == OP_RETURN) {
+                instruction->op = OP_RETURN;
+                instruction->length = 1;
+                break;
+            }
+
+            // A conditional jump can only go forward.
+            if (next == -1 || (conditional && next <= i))
+                break;
+            target = next;
+        }
+
+        if (is_jump(instruction->op)) {
+            instruction->target = target;
+
+            // Jumping to the next instruction does nothing.
+            if (target == resolve(ir, i + 1))
+                instruction->removed = true;
+        }
+    }
+}
+
+static void remove_unreachable(Ir_function* ir) {
+    for (int b = 0; b < ir->block_count; b++) {
+        Ir_block* block = &ir->blocks[b];
+        if (block->depth != -1)
+            continue;
+
+        for (int i = block->start; i < block->end; i++)
+            ir->instructions[i].removed = true;
+    }
+}
+
+typedef struct {
+    uint8_t op;
+    int left;
+    int right;
+    Value constant;
+    int number;
+} Ir_expression;
+
+typedef struct {
+    int count;
+    int capacity;
+    Ir_expression* expressions;
+    int next_number;
+    int* numbers;       // Value number held by each stack slot.
+    int* starts;        // Where the pure code computing each slot starts,
+                        // -1 if it isn't pure.
+} Value_numbering;
+
+static bool same_constant(Value a, Value b) {
+    if (a.type != b.type)
+        return false;
+    if (IS_NUMBER(a)) {
+        // 0 and -0 are equal but print differently.
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        return memcmp(&x, &y, sizeof(double)) == 0;
+    }
+    return values_equal(a, b);
+}
+
+// The value number of the expression, shared with every earlier
+// occurrence of it in the block.
+static int number_expression(VM* vm, Value_numbering* numbering, uint8_t op,
+                             int left, int right, Value constant) {
+    for (int i = 0; i < numbering->count; i++) {
+        Ir_expression* expression = &numbering->expressions[i];
+        if (expression->op == op && expression->left == left
+            && expression->right == right
+            && same_constant(expression->constant, constant))
+            return expression->number;
+    }
+
+    if (numbering->capacity < numbering->count + 1) {
+        int old_capacity = numbering->capacity;
+        numbering->capacity = GROW_CAPACITY(old_capacity);
+        numbering->expressions = GROW_ARRAY(vm, Ir_expression,
+                                            numbering->expressions,
+                                            old_capacity,
+                                            numbering->capacity);
+    }
+
+    Ir_expression* expression = &numbering->expressions[numbering->count++];
+    expression->op = op;
+    expression->left = left;
+    expression->right = right;
+    expression->constant = constant;
+    expression->number = numbering->next_number++;
+    return expression->number;
+}
+
+// Common subexpression elimination: if the pure code that just computed
+// the value in result has already left the same value in a lower slot,
+// the code is replaced by a read of that slot.
+static void eliminate_common(Ir_function* ir, Value_numbering* numbering,
+                             int index, int result, int barrier) {
+    int start = numbering->starts[result];
+    if (start <= barrier || start == index)
+        return;
+
+    for (int slot = 0; slot < result && slot < UINT8_COUNT; slot++) {
+        if (numbering->numbers[slot] != numbering->numbers[result]
+            || slot_in(ir->captured, slot))
+            continue;
+
+        Ir_instruction* first = &ir->instructions[start];
+        first->op = OP_GET_LOCAL;
+        first->operand = (uint8_t)slot;
+        first->length = 2;
+        for (int i = start + 1; i <= index; i++)
+            ir->instructions[i].removed = true;
+        return;
+    }
+}
+
+// Value numbering within one block, driving common subexpression
+// elimination and copy propagation. Nothing is known about the slots on
+// entry.
+static void number_block(VM* vm, Ir_function* ir, Ir_block* block,
+                         Value_numbering* numbering) {
+    int* numbers = numbering->numbers;
+    int* starts = numbering->starts;
+
+    numbering->count = 0;
+    for (int slot = 0; slot < block->depth; slot++) {
+        numbers[slot] = numbering->next_number++;
+        starts[slot] = -1;
+    }
+
+    // The last instruction with an effect besides its result.
+    int barrier = block->start - 1;
+
+    for (int i = block->start; i < block->end; i++) {
+        Ir_instruction* instruction = &ir->instructions[i];
+        if (instruction->removed)
+            continue;
+
+        int depth = instruction->depth;
+        int pops, pushes;
+        instruction_effect(instruction, &pops, &pushes);
+        int result = depth - pops;
+
+        switch (instruction->op) {
+        case OP_CONSTANT:
+            numbers[result] = number_expression(
+                    vm, numbering, OP_CONSTANT, 0, 0,
+                    ir->chunk->constants.values[instruction->operand]);
+            starts[result] = i;
+            break;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            numbers[result] = number_expression(vm, numbering, instruction->op,
+                                                0, 0, NIL_VAL);
+            starts[result] = i;
+            break;
+        case OP_GET_LOCAL:
+        {
+            int slot = instruction->operand;
+            if (slot_in(ir->captured, slot)) {
+                numbers[result] = numbering->next_number++;
+                starts[result] = -1;
+                break;
+            }
+
+            // Copy propagation: read the value from the lowest slot that
+            // holds it, which may leave stores to this one dead.
+            for (int copy = 0; copy < slot; copy++) {
+                if (numbers[copy] == numbers[slot]
+                    && !slot_in(ir->captured, copy)) {
+                    instruction->operand = (uint8_t)copy;
+                    break;
+                }
+            }
+
+            numbers[result] = numbers[slot];
+            starts[result] = i;
+            break;
+        }
+        case OP_SET_LOCAL:
+        {
+            int slot = instruction->operand;
+            numbers[slot] = slot_in(ir->captured, slot)
+                                ? numbering->next_number++
+                                : numbers[depth - 1];
+            starts[slot] = -1;
+            barrier = i;
+            break;
+        }
+        case OP_NOT:
+        case OP_NEGATE:
+            numbers[result] = number_expression(vm, numbering, instruction->op,
+                                                numbers[depth - 1], 0,
+                                                NIL_VAL);
+            eliminate_common(ir, numbering, i, result, barrier);
+            break;
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            numbers[result] = number_expression(vm, numbering, instruction->op,
+                                                numbers[depth - 2],
+                                                numbers[depth - 1],
+                                                NIL_VAL);
+            starts[result] = starts[depth - 2] > barrier
+                             && starts[depth - 1] > barrier
+                                 ? starts[depth - 2]
+                                 : -1;
+            eliminate_common(ir, numbering, i, result, barrier);
+            break;
+        default:
+            for (int slot = result; slot < result + pushes; slot++) {
+                numbers[slot] = numbering->next_number++;
+                starts[slot] = -1;
+            }
+            barrier = i;
+            break;
+        }
+    }
+}
+
+static void number_values(VM* vm, Ir_function* ir) {
+    Value_numbering numbering;
+    numbering.count = 0;
+    numbering.capacity = 0;
+    numbering.expressions = NULL;
+    numbering.next_number = 0;
+    numbering.numbers = ALLOCATE(vm, int, ir->max_depth + 1);
+    numbering.starts = ALLOCATE(vm, int, ir->max_depth + 1);
+
+    for (int b = 0; b < ir->block_count; b++) {
+        if (ir->blocks[b].depth != -1)
+            number_block(vm, ir, &ir->blocks[b], &numbering);
+    }
+
+    FREE_ARRAY(vm, Ir_expression, numbering.expressions, numbering.capacity);
+    FREE_ARRAY(vm, int, numbering.numbers, ir->max_depth + 1);
+    FREE_ARRAY(vm, int, numbering.starts, ir->max_depth + 1);
+}
+
+// Steps liveness of the slots backwards over one instruction.
+static void transfer_liveness(Ir_function* ir, Ir_instruction* instruction,
+                              uint64_t* live) {
+    int depth = instruction->depth;
+    int pops, pushes;
+    instruction_effect(instruction, &pops, &pushes);
+    if (pushes > 0)
+        slot_remove(live, depth - pops);
+
+    // Besides locals, the values an instruction takes off the stack or
+    // looks at on top of it are read, since those slots may have been
+    // stored to as well.
+    switch (instruction->op) {
+    case OP_GET_LOCAL:
+        slot_add(live, instruction->operand);
+        break;
+    case OP_SET_LOCAL:
+        slot_remove(live, instruction->operand);
+        slot_add(live, depth - 1);
+        break;
+    case OP_POP:
+        break;
+    case OP_SET_GLOBAL:
+    case OP_SET_UPVALUE:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+        slot_add(live, depth - 1);
+        break;
+    case OP_METHOD:
+        slot_add(live, depth - 2);
+        slot_add(live, depth - 1);
+        break;
+    default:
+        for (int slot = depth - pops; slot < depth; slot++)
+            slot_add(live, slot);
+        break;
+    }
+}
+
+static void block_liveness(Ir_function* ir, Ir_block* block,
+                           uint64_t* live) {
+    for (int w = 0; w < SLOT_WORDS; w++) {
+        live[w] = 0;
+        for (int s = 0; s < block->successor_count; s++)
+            live[w] |= ir->blocks[block->successors[s]].live_in[w];
+        block->live_out[w] = live[w];
+    }
+
+    for (int i = block->end - 1; i >= block->start; i--) {
+        if (!ir->instructions[i].removed)
+            transfer_liveness(ir, &ir->instructions[i], live);
+    }
+}
+
+// Dead store elimination: a store to a slot that is never read again
+// before being overwritten or popped is dropped. Captured slots are left
+// alone since closures may read them at any time.
+static void eliminate_dead_stores(Ir_function* ir) {
+    for (int b = 0; b < ir->block_count; b++) {
+        for (int w = 0; w < SLOT_WORDS; w++)
+            ir->blocks[b].live_in[w] = 0;
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int b = ir->block_count - 1; b >= 0; b--) {
+            Ir_block* block = &ir->blocks[b];
+            if (block->depth == -1)
+                continue;
+
+            uint64_t live[SLOT_WORDS];
+            block_liveness(ir, block, live);
+            if (memcmp(live, block->live_in, sizeof(live)) != 0) {
+                memcpy(block->live_in, live, sizeof(live));
+                changed = true;
+            }
+        }
+    }
+
+    for (int b = 0; b < ir->block_count; b++) {
+        Ir_block* block = &ir->blocks[b];
+        if (block->depth == -1)
+            continue;
+
+        uint64_t live[SLOT_WORDS];
+        memcpy(live, block->live_out, sizeof(live));
+        for (int i = block->end - 1; i >= block->start; i--) {
+            Ir_instruction* instruction = &ir->instructions[i];
+            if (instruction->removed)
+                continue;
+
+            if (instruction->op == OP_SET_LOCAL
+                && !slot_in(ir->captured, instruction->operand)
+                && !slot_in(live, instruction->operand)) {
+                instruction->removed = true;
+                continue;
+            }
+
+            transfer_liveness(ir, instruction, live);
+        }
+    }
+}
+
+// Writes the instructions back into the chunk. Gives up, leaving the chunk
+// untouched, if a jump no longer fits in its operand.
+static bool lower(VM* vm, Ir_function* ir) {
+    Chunk* chunk = ir->chunk;
+
+    // Removed instructions take the offset of the next remaining one, which
+    // is where jumps to them now land.
+    int* offsets = ALLOCATE(vm, int, ir->count + 1);
+    int count = 0;
+    for (int i = 0; i < ir->count; i++) {
+        offsets[i] = count;
+        if (!ir->instructions[i].removed)
+            count += ir->instructions[i].length;
+    }
+    offsets[ir->count] = count;
+
+    uint8_t* code = ALLOCATE(vm, uint8_t, count);
+    int* lines = ALLOCATE(vm, int, count);
+    bool fits = true;
+
+    for (int i = 0; i < ir->count; i++) {
+        Ir_instruction* instruction = &ir->instructions[i];
+        if (instruction->removed)
+            continue;
+
+        int offset = offsets[i];
+        uint8_t op = instruction->op;
+        for (int j = 0; j < instruction->length; j++)
+            lines[offset + j] = instruction->line;
+
+        if (instruction->expansion != NULL) {
+            memcpy(code + offset, instruction->expansion,
+                   instruction->length);
+            continue;
+        }
+
+        if (is_jump(op)) {
+            int target = offsets[instruction->target];
+            if (!is_conditional(op))
+                op = target <= offset ? OP_LOOP : OP_JUMP;
+
+            int jump = op == OP_LOOP ? offset + 3 - target
+                                     : target - (offset + 3);
+            if (jump < 0 || jump > UINT16_MAX)
+                fits = false;
+
+            code[offset + 1] = (jump >> 8) & 0xff;
+            code[offset + 2] = jump & 0xff;
+        } else if (op == OP_CLOSURE) {
+            memcpy(code + offset + 1, chunk->code + instruction->offset + 1,
+                   instruction->length - 1);
+        } else {
+            if (instruction->length > 1)
+                code[offset + 1] = instruction->operand;
+            if (instruction->length > 2)
+                code[offset + 2] = instruction->extra;
+        }
+        code[offset] = op;
+    }
+    FREE_ARRAY(vm, int, offsets, ir->count + 1);
+
+    if (!fits) {
+        FREE_ARRAY(vm, uint8_t, code, count);
+        FREE_ARRAY(vm, int, lines, count);
+        return false;
+    }
+
+    FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(vm, int, chunk->lines, chunk->capacity);
+    chunk->code = code;
+    chunk->lines = lines;
+    chunk->count = count;
+    chunk->capacity = count;
+    return true;
+}
+
+static bool is_pure_push(Ir_instruction* instruction) {
+    switch (instruction->op) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// The instruction after index if it is still in the same block.
+static Ir_instruction* next_in_block(Ir_function* ir, int index) {
+    int next = resolve(ir, index + 1);
+    if (next >= ir->count
+        || ir->instructions[next].block != ir->instructions[index].block)
+        return NULL;
+    return &ir->instructions[next];
+}
+
+// Applies the enabled rewrites at index, reporting whether anything
+// changed.
+static bool rewrite_at(Ir_function* ir, int index, int rewrites) {
+    Ir_instruction* instruction = &ir->instructions[index];
+    Ir_instruction* next = next_in_block(ir, index);
+    if (next == NULL)
+        return false;
+    Ir_instruction* after = next_in_block(ir, next - ir->instructions);
+
+    // OP_NOT, OP_JUMP_IF_FALSE becomes OP_JUMP_IF_TRUE as long as both
+    // ways pop the condition without looking at it.
+    if ((rewrites & PEEPHOLE_NOT_JUMP) && instruction->op == OP_NOT
+        && next->op == OP_JUMP_IF_FALSE) {
+        int fallthrough = resolve(ir, next - ir->instructions + 1);
+        int target = resolve(ir, next->target);
+        if (fallthrough < ir->count && target < ir->count
+            && ir->instructions[fallthrough].op == OP_POP
+            && ir->instructions[target].op == OP_POP) {
+            instruction->removed = true;
+            next->op = OP_JUMP_IF_TRUE;
+            return true;
+        }
+    }
+
+    // A value that is pushed only to be popped.
+    if ((rewrites & PEEPHOLE_PUSH_POP) && next->op == OP_POP) {
+        if (is_pure_push(instruction)) {
+            instruction->removed = true;
+            next->removed = true;
+            return true;
+        }
+        if (instruction->op == OP_NOT) {
+            instruction->removed = true;
+            return true;
+        }
+    }
+
+    if ((rewrites & PEEPHOLE_LOCALS) && after != NULL) {
+        // Storing a local and reading it straight back.
+        if (instruction->op == OP_SET_LOCAL && next->op == OP_POP
+            && after->op == OP_GET_LOCAL
+            && after->operand == instruction->operand) {
+            next->removed = true;
+            after->removed = true;
+            return true;
+        }
+
+        // Assigning a local to itself.
+        if (instruction->op == OP_GET_LOCAL && next->op == OP_SET_LOCAL
+            && next->operand == instruction->operand
+            && after->op == OP_POP) {
+            instruction->removed = true;
+            next->removed = true;
+            after->removed = true;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void init_ir(Ir_function* ir, Obj_function* function) {
+    ir->function = function;
+    ir->chunk = &function->chunk;
+    ir->capacity = 0;
+    ir->count = 0;
+    ir->instructions = NULL;
+    ir->block_capacity = 0;
+    ir->block_count = 0;
+    ir->blocks = NULL;
+    ir->max_depth = 0;
+    for (int w = 0; w < SLOT_WORDS; w++)
+        ir->captured[w] = 0;
+}
+
+static void free_ir(VM* vm, Ir_function* ir) {
+    for (int i = 0; i < ir->count; i++) {
+        Ir_instruction* instruction = &ir->instructions[i];
+        if (instruction->expansion != NULL)
+            FREE_ARRAY(vm, uint8_t, instruction->expansion,
+                       instruction->length);
+    }
+    FREE_ARRAY(vm, Ir_instruction, ir->instructions, ir->capacity);
+    FREE_ARRAY(vm, Ir_block, ir->blocks, ir->block_capacity);
+}
+
+void optimize_function(VM* vm, Obj_function* function) {
+    Ir_function ir;
+    init_ir(&ir, function);
+
+    if (ir.chunk->count > 0 && lift(vm, &ir) && build_blocks(vm, &ir)) {
+        remove_unreachable(&ir);
+        thread_jumps(&ir);
+
+        // Threading can leave code behind that nothing jumps to anymore.
+        if (build_blocks(vm, &ir)) {
+            remove_unreachable(&ir);
+            number_values(vm, &ir);
+            eliminate_dead_stores(&ir);
+            lower(vm, &ir);
+        }
+    }
+
+    free_ir(vm, &ir);
+}
+
+void peephole_function(VM* vm, Obj_function* function, int rewrites) {
+    Ir_function ir;
+    init_ir(&ir, function);
+
+    if (rewrites != 0 && ir.chunk->count > 0 && lift(vm, &ir)
+        && build_blocks(vm, &ir)) {
+        bool valid = true;
+        if (rewrites & PEEPHOLE_JUMPS) {
+            thread_jumps(&ir);
+            valid = build_blocks(vm, &ir);
+            if (valid)
+                remove_unreachable(&ir);
+        }
+
+        // One rewrite can expose another, as with OP_CONSTANT, OP_NOT,
+        // OP_POP.
+        bool changed = valid;
+        while (changed) {
+            changed = false;
+            for (int i = 0; i < ir.count; i++) {
+                if (!ir.instructions[i].removed
+                    && rewrite_at(&ir, i, rewrites))
+                    changed = true;
+            }
+        }
+
+        if (valid)
+            lower(vm, &ir);
+    }
+
+    free_ir(vm, &ir);
+}
+
+// Inlining replaces a call with the callee's body when the callee is known
+// for certain at the call site: a function declared once at the top level
+// and never assigned, if the VM lets globals be inlined at all, or a local
+// function that is never assigned. Only
+// callees without upvalues whose body is a single returned expression,
+// without calls or jumps, are inlined.
+
+typedef struct {
+    int defines;
+    bool assigned;
+    int offset;             // Where the script defines it.
+    Obj_function* function; // The function declared, if it is one.
+} Inline_global;
+
+typedef struct {
+    Obj_function* script;
+    Table names;            // Index of each global's Inline_global.
+    int count;
+    int capacity;
+    Inline_global* globals;
+} Inliner;
+
+static Inline_global* find_global(VM* vm, Inliner* inliner, Obj_string* name) {
+    Value index;
+    if (table_get(&inliner->names, name, &index))
+        return &inliner->globals[(int)AS_NUMBER(index)];
+
+    if (inliner->capacity < inliner->count + 1) {
+        int old_capacity = inliner->capacity;
+        inliner->capacity = GROW_CAPACITY(old_capacity);
+        inliner->globals = GROW_ARRAY(vm, Inline_global, inliner->globals,
+                                      old_capacity, inliner->capacity);
+    }
+    table_set(vm, &inliner->names, name, NUMBER_VAL(inliner->count));
+
+    Inline_global* global = &inliner->globals[inliner->count++];
+    global->defines = 0;
+    global->assigned = false;
+    global->offset = -1;
+    global->function = NULL;
+    return global;
+}
+
+static Obj_function* closure_function(Chunk* chunk, int offset) {
+    return AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+}
+
+// Globals can only be defined by the script, outside any block, so every
+// definition runs at most once and before anything after it.
+static void collect_globals(VM* vm, Inliner* inliner, Obj_function* function) {
+    Chunk* chunk = &function->chunk;
+    int previous = -1;
+    for (int offset = 0; offset < chunk->count;
+         offset += instruction_length(chunk, offset)) {
+        uint8_t op = chunk->code[offset];
+        if (op == OP_DEFINE_GLOBAL || op == OP_SET_GLOBAL) {
+            Value name = chunk->constants.values[chunk->code[offset + 1]];
+            Inline_global* global = find_global(vm, inliner, AS_STRING(name));
+            if (op == OP_SET_GLOBAL) {
+                global->assigned = true;
+            } else {
+                global->defines++;
+                global->offset = offset;
+                global->function = previous != -1
+                                   && chunk->code[previous] == OP_CLOSURE
+                                       ? closure_function(chunk, previous)
+                                       : NULL;
+            }
+        } else if (op == OP_CLOSURE) {
+            collect_globals(vm, inliner, closure_function(chunk, offset));
+        }
+        previous = offset;
+    }
+}
+
+// Whether the function, or a closure nested in it, can assign the upvalue.
+static bool upvalue_assigned(Obj_function* function, int index) {
+    Chunk* chunk = &function->chunk;
+    for (int offset = 0; offset < chunk->count;
+         offset += instruction_length(chunk, offset)) {
+        uint8_t op = chunk->code[offset];
+        if (op == OP_SET_UPVALUE && chunk->code[offset + 1] == index)
+            return true;
+        if (op != OP_CLOSURE)
+            continue;
+
+        Obj_function* child = closure_function(chunk, offset);
+        for (int i = 0; i < child->upvalue_count; i++) {
+            if (chunk->code[offset + 2 + 2 * i] == 0
+                && chunk->code[offset + 3 + 2 * i] == index
+                && upvalue_assigned(child, i))
+                return true;
+        }
+    }
+    return false;
+}
+
+// Length of the callee's body up to its return, or -1 if it can't be
+// inlined into a call with the given number of arguments. The body must be
+// a single expression computed straight on top of the arguments, since a
+// local it declares would be left behind on the caller's stack.
+static int inline_length(Obj_function* callee, int arg_count) {
+    if (callee->arity != arg_count || callee->upvalue_count != 0)
+        return -1;
+
+    Chunk* chunk = &callee->chunk;
+    // Values above the arguments.
+    int depth = 0;
+    for (int offset = 0; offset < chunk->count && offset <= MAX_INLINE_LENGTH;
+         offset += fixed_instruction_length(chunk->code[offset])) {
+        int pops, pushes;
+        stack_effect(chunk->code + offset, &pops, &pushes);
+        if (pops > depth)
+            return -1;
+        depth += pushes - pops;
+
+        switch (chunk->code[offset]) {
+        case OP_RETURN:
+            return depth == 0 ? offset : -1;
+        case OP_GET_LOCAL:
+            // Slot zero holds the callee itself.
+            if (chunk->code[offset + 1] == 0
+                || chunk->code[offset + 1] > callee->arity)
+                return -1;
+            break;
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL:
+        case OP_GET_PROPERTY:
+        case OP_GET_INDEX:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_BUILD_LIST:
+            break;
+        default:
+            return -1;
+        }
+    }
+    return -1;
+}
+
+// Index of the value in the chunk's constants, adding it if needed, or -1
+// if there is no room.
+static int inline_constant(VM* vm, Chunk* chunk, Value value) {
+    for (int i = 0; i < chunk->constants.count; i++) {
+        if (same_constant(chunk->constants.values[i], value))
+            return i;
+    }
+
+    if (chunk->constants.count >= UINT8_COUNT)
+        return -1;
+    return add_constant(vm, chunk, value);
+}
+
+// Replaces the call with the callee's body. The slot at base holds a
+// placeholder for the callee, so the body's slots line up with the
+// caller's, and is where the result is stored before the arguments are
+// popped.
+static bool expand_call(VM* vm, Ir_function* ir, Ir_instruction* call,
+                        Obj_function* callee, int base) {
+    int length = inline_length(callee, call->operand);
+    if (length == -1 || base + callee->arity > UINT8_MAX)
+        return false;
+
+    int arg_count = call->operand;
+    int size = length + 3 + arg_count;
+    uint8_t* expansion = ALLOCATE(vm, uint8_t, size);
+    uint8_t* code = callee->chunk.code;
+
+    for (int offset = 0; offset < length;
+         offset += fixed_instruction_length(code[offset])) {
+        expansion[offset] = code[offset];
+        switch (code[offset]) {
+        case OP_GET_LOCAL:
+            expansion[offset + 1] = (uint8_t)(base + code[offset + 1]);
+            break;
+        case OP_CONSTANT:
+        case OP_GET_GLOBAL:
+        case OP_GET_PROPERTY:
+        {
+            Value value = callee->chunk.constants.values[code[offset + 1]];
+            int constant = inline_constant(vm, ir->chunk, value);
+            if (constant == -1) {
+                FREE_ARRAY(vm, uint8_t, expansion, size);
+                return false;
+            }
+            expansion[offset + 1] = (uint8_t)constant;
+            break;
+        }
+        }
+    }
+
+    expansion[length] = OP_SET_LOCAL;
+    expansion[length + 1] = (uint8_t)base;
+    for (int i = 0; i <= arg_count; i++)
+        expansion[length + 2 + i] = OP_POP;
+
+    call->expansion = expansion;
+    call->length = size;
+    return true;
+}
+
+// The instruction in the call's block that pushed the callee.
+static int find_callee(Ir_function* ir, int call) {
+    Ir_instruction* instruction = &ir->instructions[call];
+    int slot = instruction->depth - instruction->operand - 1;
+
+    for (int i = call - 1; i >= 0; i--) {
+        Ir_instruction* candidate = &ir->instructions[i];
+        if (candidate->removed)
+            continue;
+        if (candidate->block != instruction->block)
+            return -1;
+
+        int pops, pushes;
+        instruction_effect(candidate, &pops, &pushes);
+        if (pushes > 0 && candidate->depth - pops == slot)
+            return i;
+    }
+    return -1;
+}
+
+static Obj_function* global_callee(Inliner* inliner, Ir_function* ir,
+                                   Ir_instruction* push, int position) {
+    Value name = ir->chunk->constants.values[push->operand];
+    Value index;
+    if (!table_get(&inliner->names, AS_STRING(name), &index))
+        return NULL;
+
+    // Calling it before the definition has run must still fail.
+    Inline_global* global = &inliner->globals[(int)AS_NUMBER(index)];
+    int site = ir->function == inliner->script ? push->offset : position;
+    if (global->defines != 1 || global->assigned || global->offset >= site)
+        return NULL;
+    return global->function;
+}
+
+// A local is in scope from the instruction that pushes it until the stack
+// drops back below it, so the scope is found by walking the depths.
+static Obj_function* local_callee(Ir_function* ir, int push) {
+    int slot = ir->instructions[push].operand;
+
+    int definition = -1;
+    for (int i = push - 1; i >= 0 && definition == -1; i--) {
+        Ir_instruction* instruction = &ir->instructions[i];
+        if (instruction->removed)
+            continue;
+        if (instruction->depth < slot)
+            return NULL;
+        if (instruction->depth == slot) {
+            if (instruction->op != OP_CLOSURE)
+                return NULL;
+            definition = i;
+        }
+    }
+    if (definition == -1)
+        return NULL;
+
+    for (int i = definition + 1; i < ir->count; i++) {
+        Ir_instruction* instruction = &ir->instructions[i];
+        if (instruction->removed)
+            continue;
+        if (instruction->depth != -1 && instruction->depth <= slot)
+            break;
+
+        if (instruction->op == OP_SET_LOCAL && instruction->operand == slot)
+            return NULL;
+        if (instruction->op != OP_CLOSURE)
+            continue;
+
+        uint8_t* code = ir->chunk->code + instruction->offset;
+        Obj_function* child = closure_function(ir->chunk,
+                                               instruction->offset);
+        for (int u = 0; u < child->upvalue_count; u++) {
+            if (code[2 + 2 * u] == 1 && code[3 + 2 * u] == slot
+                && upvalue_assigned(child, u))
+                return NULL;
+        }
+    }
+
+    return closure_function(ir->chunk, ir->instructions[definition].offset);
+}
+
+// Functions nested in the script are positioned by the offset of the
+// closure that creates them, since none of their code can run before it.
+static void inline_calls(VM* vm, Inliner* inliner, Obj_function* function,
+                         int position) {
+    Chunk* chunk = &function->chunk;
+    for (int offset = 0; offset < chunk->count;
+         offset += instruction_length(chunk, offset)) {
+        if (chunk->code[offset] == OP_CLOSURE)
+            inline_calls(vm, inliner, closure_function(chunk, offset),
+                         function == inliner->script ? offset : position);
+    }
+
+    Ir_function ir;
+    init_ir(&ir, function);
+
+    bool changed = false;
+    if (chunk->count > 0 && lift(vm, &ir) && build_blocks(vm, &ir)) {
+        for (int i = 0; i < ir.count; i++) {
+            Ir_instruction* call = &ir.instructions[i];
+            if ((call->op != OP_CALL && call->op != OP_TAIL_CALL)
+                || call->depth == -1)
+                continue;
+
+            int index = find_callee(&ir, i);
+            if (index == -1)
+                continue;
+
+            Ir_instruction* push = &ir.instructions[index];
+            Obj_function* callee = NULL;
+            if (push->op == OP_GET_GLOBAL && vm->inline_globals)
+                callee = global_callee(inliner, &ir, push, position);
+            else if (push->op == OP_GET_LOCAL)
+                callee = local_callee(&ir, index);
+
+            if (callee != NULL && expand_call(vm, &ir, call, callee,
+                                              push->depth)) {
+                push->op = OP_NIL;
+                push->length = 1;
+                changed = true;
+            }
+        }
+
+        if (changed)
+            changed = lower(vm, &ir);
+    }
+    free_ir(vm, &ir);
+
+    // The inlined code gets the same treatment as the rest.
+    if (changed) {
+        optimize_function(vm, function);
+        if (vm->peephole != 0)
+            peephole_function(vm, function, vm->peephole);
+#ifdef DEBUG_PRINT_CODE
+        disassemble_chunk(chunk, function->name != NULL
+                                     ? function->name->chars
+                                     : "<script> (inlined)");
+#endif
+    }
+}
+
+void inline_functions(VM* vm, Obj_function* script) {
+    Inliner inliner;
+    inliner.script = script;
+    init_table(&inliner.names);
+    inliner.count = 0;
+    inliner.capacity = 0;
+    inliner.globals = NULL;
+
+    collect_globals(vm, &inliner, script);
+    inline_calls(vm, &inliner, script, script->chunk.count);
+
+    free_table(vm, &inliner.names);
+    FREE_ARRAY(vm, Inline_global, inliner.globals, inliner.capacity);
+}
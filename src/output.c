@@ -0,0 +1,78 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "number.h"
+#include "output.h"
+
+static void allocate(Output* output, int capacity) {
+    output->chars = (char*)malloc(capacity);
+    if (output->chars == NULL)
+        exit(1);
+    output->count = 0;
+    output->capacity = capacity;
+}
+
+void init_output(Output* output) {
+    allocate(output, OUTPUT_DEFAULT_CAPACITY);
+    output->mode = isatty(STDOUT_FILENO) ? FLUSH_LINE : FLUSH_FULL;
+}
+
+void free_output(Output* output) {
+    flush_output(output);
+    free(output->chars);
+    output->chars = NULL;
+    output->capacity = 0;
+}
+
+void set_output(Output* output, int capacity, Flush_mode mode) {
+    free_output(output);
+    allocate(output, capacity);
+    output->mode = mode;
+}
+
+// Going through stdio keeps the order with anything else printed there.
+void flush_output(Output* output) {
+    if (output->count > 0) {
+        fwrite(output->chars, 1, output->count, stdout);
+        output->count = 0;
+    }
+    fflush(stdout);
+}
+
+void write_chars(Output* output, const char* chars, int length) {
+    if (output->count + length > output->capacity) {
+        flush_output(output);
+        // Too big to buffer at all.
+        if (length > output->capacity) {
+            fwrite(chars, 1, length, stdout);
+            return;
+        }
+    }
+
+    memcpy(output->chars + output->count, chars, length);
+    output->count += length;
+}
+
+void write_string(Output* output, const char* string) {
+    write_chars(output, string, (int)strlen(string));
+}
+
+void write_number(Output* output, double value) {
+    if (output->count + NUMBER_MAX_LENGTH > output->capacity) {
+        char buffer[NUMBER_MAX_LENGTH];
+        write_chars(output, buffer, format_number(buffer, value));
+        return;
+    }
+
+    output->count += format_number(output->chars + output->count, value);
+}
+
+void end_line(Output* output) {
+    write_chars(output, "\n", 1);
+    if (output->mode == FLUSH_LINE)
+        flush_output(output);
+}
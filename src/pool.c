@@ -0,0 +1,477 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "message.h"
+#include "object.h"
+#include "pool.h"
+#include "vm.h"
+
+// Spawned tasks run on a fixed set of worker threads, each in a fresh VM
+// of its own, so they share nothing but what passes through channels.
+// Every worker keeps a deque of tasks: the ones it spawns go on the bottom
+// and it takes work from the bottom as well, while a thread that runs dry
+// steals the oldest task from the top of another worker's deque. Threads
+// with nothing to run, including any blocked in receive(), sleep until the
+// pool's generation moves on, which happens whenever a task is queued or
+// finished and whenever a message is sent.
+
+typedef struct Queued_message {
+    struct Queued_message* next;
+    Message message;
+} Queued_message;
+
+struct Channel {
+    pthread_mutex_t lock;
+    int references;
+    Queued_message* head;
+    Queued_message* tail;
+};
+
+typedef struct {
+    Message message;    // The callee, its arguments and the globals it uses.
+    Channel* result;
+    int max_frames;
+    int output_capacity;
+    Flush_mode flush_mode;
+} Task;
+
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+
+    // Ring buffer of tasks, oldest first.
+    Task** tasks;
+    int head;
+    int count;
+    int capacity;
+} Worker;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    unsigned long generation;
+    int pending;        // Tasks spawned but not finished yet.
+    bool stopping;
+
+    int size;
+    int next;           // Worker to hand the next outside task to.
+    Worker* workers;
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t current_worker;
+
+Channel* create_channel(void) {
+    Channel* channel = (Channel*)malloc(sizeof(Channel));
+    if (channel == NULL)
+        exit(1);
+    pthread_mutex_init(&channel->lock, NULL);
+    channel->references = 1;
+    channel->head = NULL;
+    channel->tail = NULL;
+    return channel;
+}
+
+void retain_channel(Channel* channel) {
+    pthread_mutex_lock(&channel->lock);
+    channel->references++;
+    pthread_mutex_unlock(&channel->lock);
+}
+
+void release_channel(Channel* channel) {
+    pthread_mutex_lock(&channel->lock);
+    int references = --channel->references;
+    pthread_mutex_unlock(&channel->lock);
+    if (references > 0)
+        return;
+
+    while (channel->head != NULL) {
+        Queued_message* queued = channel->head;
+        channel->head = queued->next;
+        free_message(&queued->message);
+        free(queued);
+    }
+    pthread_mutex_destroy(&channel->lock);
+    free(channel);
+}
+
+static unsigned long generation(void) {
+    pthread_mutex_lock(&pool.lock);
+    unsigned long seen = pool.generation;
+    pthread_mutex_unlock(&pool.lock);
+    return seen;
+}
+
+static void notify(void) {
+    pthread_mutex_lock(&pool.lock);
+    pool.generation++;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static void push_task(Worker* worker, Task* task) {
+    pthread_mutex_lock(&worker->lock);
+    if (worker->count == worker->capacity) {
+        int capacity = GROW_CAPACITY(worker->capacity);
+        Task** tasks = (Task**)malloc(sizeof(Task*) * capacity);
+        if (tasks == NULL)
+            exit(1);
+        for (int i = 0; i < worker->count; i++)
+            tasks[i] = worker->tasks[(worker->head + i) % worker->capacity];
+        free(worker->tasks);
+        worker->tasks = tasks;
+        worker->head = 0;
+        worker->capacity = capacity;
+    }
+
+    worker->tasks[(worker->head + worker->count) % worker->capacity] = task;
+    worker->count++;
+    pthread_mutex_unlock(&worker->lock);
+}
+
+// Owners take their newest task, thieves the oldest.
+static Task* pop_task(Worker* worker, bool newest) {
+    Task* task = NULL;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->count > 0) {
+        worker->count--;
+        if (newest)
+            task = worker->tasks[(worker->head + worker->count)
+                                 % worker->capacity];
+        else {
+            task = worker->tasks[worker->head];
+            worker->head = (worker->head + 1) % worker->capacity;
+        }
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return task;
+}
+
+static Task* take_task(void) {
+    pthread_mutex_lock(&pool.lock);
+    Worker* workers = pool.workers;
+    int size = pool.size;
+    pthread_mutex_unlock(&pool.lock);
+    if (workers == NULL)
+        return NULL;
+
+    Worker* self = (Worker*)pthread_getspecific(current_worker);
+    if (self != NULL) {
+        Task* task = pop_task(self, true);
+        if (task != NULL)
+            return task;
+    }
+
+    int start = self != NULL ? (int)(self - workers) + 1 : 0;
+    for (int i = 0; i < size; i++) {
+        Worker* victim = &workers[(start + i) % size];
+        if (victim == self)
+            continue;
+        Task* task = pop_task(victim, false);
+        if (task != NULL)
+            return task;
+    }
+    return NULL;
+}
+
+void channel_send(Channel* channel, Message* message) {
+    Queued_message* queued = (Queued_message*)malloc(sizeof(Queued_message));
+    if (queued == NULL)
+        exit(1);
+    queued->next = NULL;
+    queued->message = *message;
+    init_message(message);
+
+    pthread_mutex_lock(&channel->lock);
+    if (channel->tail == NULL)
+        channel->head = queued;
+    else
+        channel->tail->next = queued;
+    channel->tail = queued;
+    pthread_mutex_unlock(&channel->lock);
+    notify();
+}
+
+static bool try_receive(Channel* channel, Message* message) {
+    pthread_mutex_lock(&channel->lock);
+    Queued_message* queued = channel->head;
+    if (queued != NULL) {
+        channel->head = queued->next;
+        if (channel->head == NULL)
+            channel->tail = NULL;
+    }
+    pthread_mutex_unlock(&channel->lock);
+
+    if (queued == NULL)
+        return false;
+    *message = queued->message;
+    free(queued);
+    return true;
+}
+
+static void run_task(Task* task) {
+    VM vm;
+    init_shared_VM(&vm, task->message.segment);
+    vm.max_frames = task->max_frames;
+    set_output(&vm.output, task->output_capacity, task->flush_mode);
+    read_message(&vm, &task->message);
+
+    // A failed task answers nil; its error has been reported already.
+    Message result;
+    init_message(&result);
+    Interpret_result status = interpret_call(&vm,
+                                             task->message.value_count - 1);
+    if (status == INTERPRET_OK && !write_message(&vm, &result, 1)) {
+        fprintf(stderr, "Task result can't be copied to another VM!\n");
+        status = INTERPRET_RUNTIME_ERROR;
+    }
+    if (status != INTERPRET_OK) {
+        free_message(&result);
+        push(&vm, NIL_VAL);
+        write_message(&vm, &result, 1);
+    }
+    channel_send(task->result, &result);
+
+    free_VM(&vm);
+    free_message(&task->message);
+    release_channel(task->result);
+    free(task);
+
+    pthread_mutex_lock(&pool.lock);
+    pool.pending--;
+    pthread_mutex_unlock(&pool.lock);
+    notify();
+}
+
+// Runs a queued task on the calling thread, or sleeps until the pool moves
+// past the generation seen if there is nothing to run.
+static void help(unsigned long seen) {
+    Task* task = take_task();
+    if (task != NULL) {
+        run_task(task);
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.generation == seen)
+        pthread_cond_wait(&pool.wake, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Fails only when nothing could ever send to the channel: it's empty and
+// no task is left running.
+bool channel_receive(Channel* channel, Message* message) {
+    for (;;) {
+        unsigned long seen = generation();
+        if (try_receive(channel, message))
+            return true;
+
+        pthread_mutex_lock(&pool.lock);
+        bool idle = pool.pending == 0;
+        pthread_mutex_unlock(&pool.lock);
+        if (idle)
+            return try_receive(channel, message);
+
+        help(seen);
+    }
+}
+
+static void* run_worker(void* argument) {
+    pthread_setspecific(current_worker, argument);
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        unsigned long seen = pool.generation;
+        bool stopping = pool.stopping;
+        pthread_mutex_unlock(&pool.lock);
+        if (stopping)
+            break;
+
+        help(seen);
+    }
+    return NULL;
+}
+
+static void create_key(void) {
+    pthread_key_create(&current_worker, NULL);
+}
+
+static void start_pool(void) {
+    pthread_once(&key_once, create_key);
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.workers == NULL) {
+        if (pool.size <= 0) {
+            long online = sysconf(_SC_NPROCESSORS_ONLN);
+            pool.size = online > 0 ? (int)online : 1;
+        }
+
+        pool.workers = (Worker*)malloc(sizeof(Worker) * pool.size);
+        if (pool.workers == NULL)
+            exit(1);
+        for (int i = 0; i < pool.size; i++) {
+            Worker* worker = &pool.workers[i];
+            pthread_mutex_init(&worker->lock, NULL);
+            worker->tasks = NULL;
+            worker->head = 0;
+            worker->count = 0;
+            worker->capacity = 0;
+        }
+        for (int i = 0; i < pool.size; i++) {
+            if (pthread_create(&pool.workers[i].thread, NULL, run_worker,
+                               &pool.workers[i]) != 0)
+                exit(1);
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static void queue_task(Task* task) {
+    start_pool();
+
+    Worker* worker = (Worker*)pthread_getspecific(current_worker);
+    pthread_mutex_lock(&pool.lock);
+    pool.pending++;
+    if (worker == NULL) {
+        worker = &pool.workers[pool.next];
+        pool.next = (pool.next + 1) % pool.size;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    push_task(worker, task);
+    notify();
+}
+
+void set_pool_size(int threads) {
+    pthread_mutex_lock(&pool.lock);
+    if (pool.workers == NULL)
+        pool.size = threads;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Waits for every spawned task to finish, running some on the calling
+// thread meanwhile, and then stops the workers.
+void finish_pool(void) {
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        unsigned long seen = pool.generation;
+        bool done = pool.pending == 0;
+        pthread_mutex_unlock(&pool.lock);
+        if (done)
+            break;
+
+        help(seen);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    Worker* workers = pool.workers;
+    pool.stopping = true;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+    if (workers == NULL)
+        return;
+
+    for (int i = 0; i < pool.size; i++) {
+        pthread_join(workers[i].thread, NULL);
+        pthread_mutex_destroy(&workers[i].lock);
+        free(workers[i].tasks);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    free(pool.workers);
+    pool.workers = NULL;
+    pool.stopping = false;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static bool channel_native(VM* vm, int arg_count, Value* args,
+                           Value* result) {
+    Channel* channel = create_channel();
+    *result = OBJ_VAL(new_channel(vm, channel));
+    release_channel(channel);
+    return true;
+}
+
+static bool is_callable(Value value) {
+    return IS_BOUND_METHOD(value) || IS_CLASS(value) || IS_CLOSURE(value)
+           || IS_NATIVE(value);
+}
+
+// spawn(fn, args...) calls fn in a new VM on the pool and returns a channel
+// that receives its result.
+static bool spawn_native(VM* vm, int arg_count, Value* args, Value* result) {
+    if (arg_count == 0 || !is_callable(args[0])) {
+        runtime_error(vm, "Can only spawn functions and classes!");
+        return false;
+    }
+
+    Task* task = (Task*)malloc(sizeof(Task));
+    if (task == NULL)
+        exit(1);
+    init_message(&task->message);
+    if (!write_message(vm, &task->message, arg_count)) {
+        free_message(&task->message);
+        free(task);
+        runtime_error(vm, "Can't copy arguments to another VM!");
+        return false;
+    }
+
+    task->result = create_channel();
+    task->max_frames = vm->max_frames;
+    task->output_capacity = vm->output.capacity;
+    task->flush_mode = vm->output.mode;
+    *result = OBJ_VAL(new_channel(vm, task->result));
+    queue_task(task);
+    return true;
+}
+
+static bool send_native(VM* vm, int arg_count, Value* args, Value* result) {
+    if (!IS_CHANNEL(args[0])) {
+        runtime_error(vm, "Can only send to channels!");
+        return false;
+    }
+
+    Channel* channel = AS_CHANNEL(args[0])->channel;
+    Message message;
+    init_message(&message);
+    if (!write_message(vm, &message, 1)) {
+        free_message(&message);
+        runtime_error(vm, "Can't copy value to another VM!");
+        return false;
+    }
+
+    channel_send(channel, &message);
+    *result = NIL_VAL;
+    return true;
+}
+
+static bool receive_native(VM* vm, int arg_count, Value* args,
+                           Value* result) {
+    if (!IS_CHANNEL(args[0])) {
+        runtime_error(vm, "Can only receive from channels!");
+        return false;
+    }
+
+    Message message;
+    if (!channel_receive(AS_CHANNEL(args[0])->channel, &message)) {
+        runtime_error(vm, "Channel is empty and no task is left to fill it!");
+        return false;
+    }
+
+    read_message(vm, &message);
+    *result = pop(vm);
+    free_message(&message);
+    return true;
+}
+
+void define_pool_natives(VM* vm) {
+    define_native(vm, "channel", 0, channel_native);
+    define_native(vm, "receive", 1, receive_native);
+    define_native(vm, "send", 2, send_native);
+    define_native(vm, "spawn", NATIVE_VARIADIC, spawn_native);
+}
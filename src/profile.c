@@ -0,0 +1,350 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "object.h"
+#include "profile.h"
+#include "vm.h"
+
+// The signal handler copies the running stack into a ring buffer. The
+// VM's own thread empties it before every sweep, and on a loop's back edge
+// once it is half full, turning function pointers into names while those
+// are certain to be alive, which a handler can't, and adding each sample
+// up. Only the handler moves the head and only the drain moves the tail,
+// so neither needs a lock.
+
+// Frames kept from the top of a deeper stack.
+#define PROFILE_MAX_DEPTH 64
+// A power of two, so that the counters can wrap.
+#define PROFILE_RING_SIZE 1024
+
+typedef struct {
+    Obj_function* function;
+    int line;
+} Sample_frame;
+
+typedef struct {
+    int depth;
+    bool truncated;
+    Sample_frame frames[PROFILE_MAX_DEPTH];     // Innermost first.
+} Sample;
+
+// Hash table from a stack or a line to how often it was sampled.
+typedef struct {
+    char* key;
+    long count;
+} Counter;
+
+typedef struct {
+    Counter* entries;
+    int count;
+    int capacity;
+} Counters;
+
+volatile sig_atomic_t profile_pending = 0;
+
+static struct {
+    VM* vm;
+    const char* path;
+    Sample* ring;
+    unsigned head;
+    unsigned tail;
+    long dropped;           // Samples that found the ring full.
+    long elsewhere;         // Samples that landed on other threads.
+    long total;
+
+    Counters stacks;
+    Counters lines;
+    char* key;
+    int key_capacity;
+} profile;
+
+static __thread bool on_profiled_thread = false;
+
+static void take_sample(int signal) {
+    int saved_errno = errno;
+    if (!on_profiled_thread) {
+        __atomic_fetch_add(&profile.elsewhere, 1, __ATOMIC_RELAXED);
+        errno = saved_errno;
+        return;
+    }
+
+    unsigned head = profile.head;
+    unsigned tail = __atomic_load_n(&profile.tail, __ATOMIC_ACQUIRE);
+    if (head - tail == PROFILE_RING_SIZE) {
+        profile.dropped++;
+        profile_pending = 1;
+        errno = saved_errno;
+        return;
+    }
+
+    // The VM fills in a frame before counting it and never frees a frame
+    // array it is still using, so whatever is counted can be read.
+    Sample* sample = &profile.ring[head % PROFILE_RING_SIZE];
+    VM* vm = profile.vm;
+    Call_frame* frames = vm->frames;
+    int frame_count = vm->frame_count;
+    int depth = 0;
+    for (int i = frame_count - 1; i >= 0 && depth < PROFILE_MAX_DEPTH; i--) {
+        Obj_function* function = frames[i].closure->function;
+        Chunk* chunk = &function->chunk;
+        // The IP is past the instruction running, or at the first one.
+        long offset = (long)(frames[i].ip - chunk->code) - 1;
+        if (offset < 0)
+            offset = 0;
+        sample->frames[depth].function = function;
+        sample->frames[depth].line = offset < chunk->count
+                                     ? chunk->lines[offset] : 0;
+        depth++;
+    }
+    sample->depth = depth;
+    sample->truncated = depth < frame_count;
+
+    __atomic_store_n(&profile.head, head + 1, __ATOMIC_RELEASE);
+    if (head + 1 - tail >= PROFILE_RING_SIZE / 2)
+        profile_pending = 1;
+    errno = saved_errno;
+}
+
+static uint32_t hash_key(const char* key, int length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static Counter* find_counter(Counter* entries, int capacity, const char* key,
+                             int length) {
+    uint32_t index = hash_key(key, length) & (capacity - 1);
+    for (;;) {
+        Counter* entry = &entries[index];
+        if (entry->key == NULL
+            || (strncmp(entry->key, key, length) == 0
+                && entry->key[length] == '\0'))
+            return entry;
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static void count_key(Counters* counters, const char* key, int length) {
+    if (counters->count + 1 > counters->capacity * 3 / 4) {
+        int capacity = counters->capacity < 64 ? 64 : counters->capacity * 2;
+        Counter* entries = (Counter*)calloc(capacity, sizeof(Counter));
+        if (entries == NULL)
+            exit(1);
+        for (int i = 0; i < counters->capacity; i++) {
+            Counter* entry = &counters->entries[i];
+            if (entry->key != NULL)
+                *find_counter(entries, capacity, entry->key,
+                              (int)strlen(entry->key)) = *entry;
+        }
+        free(counters->entries);
+        counters->entries = entries;
+        counters->capacity = capacity;
+    }
+
+    Counter* entry = find_counter(counters->entries, counters->capacity, key,
+                                  length);
+    if (entry->key == NULL) {
+        entry->key = (char*)malloc(length + 1);
+        if (entry->key == NULL)
+            exit(1);
+        memcpy(entry->key, key, length);
+        entry->key[length] = '\0';
+        counters->count++;
+    }
+    entry->count++;
+}
+
+static void free_counters(Counters* counters) {
+    for (int i = 0; i < counters->capacity; i++)
+        free(counters->entries[i].key);
+    free(counters->entries);
+    counters->entries = NULL;
+    counters->count = 0;
+    counters->capacity = 0;
+}
+
+// Appends to the key being built.
+static void add_to_key(int* length, const char* chars, int count) {
+    if (*length + count + 1 > profile.key_capacity) {
+        int capacity = (*length + count + 1) * 2;
+        profile.key = (char*)realloc(profile.key, capacity);
+        if (profile.key == NULL)
+            exit(1);
+        profile.key_capacity = capacity;
+    }
+    memcpy(profile.key + *length, chars, count);
+    *length += count;
+}
+
+static const char* function_name(Obj_function* function) {
+    return function->name == NULL ? "script" : function->name->chars;
+}
+
+static void add_sample(Sample* sample) {
+    profile.total++;
+
+    // Compiling, for one, runs no frames at all.
+    int length = 0;
+    if (sample->depth == 0)
+        add_to_key(&length, "[no frames]", 11);
+    if (sample->truncated)
+        add_to_key(&length, "...;", 4);
+    for (int i = sample->depth - 1; i >= 0; i--) {
+        const char* name = function_name(sample->frames[i].function);
+        add_to_key(&length, name, (int)strlen(name));
+        if (i > 0)
+            add_to_key(&length, ";", 1);
+    }
+    count_key(&profile.stacks, profile.key, length);
+
+    if (sample->depth > 0) {
+        char line[32];
+        int count = snprintf(line, sizeof(line), ":%d",
+                             sample->frames[0].line);
+        length = 0;
+        const char* name = function_name(sample->frames[0].function);
+        add_to_key(&length, name, (int)strlen(name));
+        add_to_key(&length, line, count);
+        count_key(&profile.lines, profile.key, length);
+    }
+}
+
+void drain_profile() {
+    if (profile.ring == NULL || !on_profiled_thread)
+        return;
+
+    profile_pending = 0;
+    unsigned head = __atomic_load_n(&profile.head, __ATOMIC_ACQUIRE);
+    while (profile.tail != head) {
+        add_sample(&profile.ring[profile.tail % PROFILE_RING_SIZE]);
+        __atomic_store_n(&profile.tail, profile.tail + 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void set_timer(long interval) {
+    struct itimerval timer;
+    timer.it_interval.tv_sec = interval / 1000000;
+    timer.it_interval.tv_usec = interval % 1000000;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+bool start_profile(VM* vm, const char* path, int rate) {
+    if (profile.ring != NULL)
+        return false;
+
+    profile.ring = (Sample*)malloc(sizeof(Sample) * PROFILE_RING_SIZE);
+    if (profile.ring == NULL)
+        exit(1);
+    profile.vm = vm;
+    profile.path = path;
+    on_profiled_thread = true;
+
+    // Restarting calls the signal cuts short keeps it out of the way of
+    // everything else the VM does.
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = take_sample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, NULL);
+
+    long interval = 1000000 / rate;
+    set_timer(interval > 0 ? interval : 1);
+    return true;
+}
+
+static int compare_keys(const void* a, const void* b) {
+    return strcmp(((const Counter*)a)->key, ((const Counter*)b)->key);
+}
+
+static int compare_counts(const void* a, const void* b) {
+    long x = ((const Counter*)a)->count;
+    long y = ((const Counter*)b)->count;
+    return (x < y) - (x > y);
+}
+
+// Moves the entries to the front, in order.
+static int sort_counters(Counters* counters,
+                         int (*compare)(const void*, const void*)) {
+    int count = 0;
+    for (int i = 0; i < counters->capacity; i++) {
+        if (counters->entries[i].key != NULL)
+            counters->entries[count++] = counters->entries[i];
+    }
+    for (int i = count; i < counters->capacity; i++)
+        counters->entries[i].key = NULL;
+    if (count > 0)
+        qsort(counters->entries, count, sizeof(Counter), compare);
+    return count;
+}
+
+static bool write_stacks(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL)
+        return false;
+
+    int count = sort_counters(&profile.stacks, compare_keys);
+    for (int i = 0; i < count; i++)
+        fprintf(file, "%s %ld\n", profile.stacks.entries[i].key,
+                profile.stacks.entries[i].count);
+    if (profile.elsewhere > 0)
+        fprintf(file, "[other threads] %ld\n", profile.elsewhere);
+    return fclose(file) == 0;
+}
+
+static bool write_lines(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL)
+        return false;
+
+    fprintf(file, "# %ld samples, %ld dropped, %ld on other threads\n",
+            profile.total, profile.dropped, profile.elsewhere);
+    int count = sort_counters(&profile.lines, compare_counts);
+    for (int i = 0; i < count; i++) {
+        Counter* entry = &profile.lines.entries[i];
+        fprintf(file, "%8ld %6.2f%%  %s\n", entry->count,
+                100.0 * entry->count / profile.total, entry->key);
+    }
+    return fclose(file) == 0;
+}
+
+bool finish_profile() {
+    if (profile.ring == NULL)
+        return true;
+
+    // A signal already on its way mustn't find the default action, which
+    // ends the process.
+    set_timer(0);
+    signal(SIGPROF, SIG_IGN);
+    drain_profile();
+
+    char* lines_path = (char*)malloc(strlen(profile.path) + 7);
+    if (lines_path == NULL)
+        exit(1);
+    strcpy(lines_path, profile.path);
+    strcat(lines_path, ".lines");
+
+    bool written = write_stacks(profile.path) && write_lines(lines_path);
+    if (!written)
+        fprintf(stderr, "Could not write profile \"%s\".\n", profile.path);
+
+    free(lines_path);
+    free_counters(&profile.stacks);
+    free_counters(&profile.lines);
+    free(profile.key);
+    free(profile.ring);
+    profile.key = NULL;
+    profile.key_capacity = 0;
+    profile.ring = NULL;
+    on_profiled_thread = false;
+    return written;
+}
@@ -0,0 +1,163 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "image.h"
+#include "intern.h"
+#include "memory.h"
+#include "object.h"
+#include "segment.h"
+#include "vm.h"
+
+struct Segment {
+    pthread_mutex_t lock;
+    int references;
+
+    int count;
+    int capacity;
+    Obj** objects;
+
+    // Images the functions borrow their code from.
+    Mapped_image* images;
+};
+
+// Functions loaded from an image link their constants when first called,
+// which a shared function never may, so the whole tree is linked up front.
+static bool link_functions(VM* vm, Obj_function* function) {
+    if (function->image != NULL && !link_image_function(vm, function))
+        return false;
+
+    Value_array* constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (IS_FUNCTION(constants->values[i])
+            && !link_functions(vm, AS_FUNCTION(constants->values[i])))
+            return false;
+    }
+    return true;
+}
+
+// Shared objects stay marked for good, so collectors stop at them without
+// writing to them.
+static void add_object(Segment* segment, Obj* object) {
+    if (object == NULL || object->is_shared)
+        return;
+    object->is_shared = true;
+    object->is_marked = true;
+
+    if (segment->count == segment->capacity) {
+        segment->capacity = GROW_CAPACITY(segment->capacity);
+        segment->objects = (Obj**)realloc(segment->objects,
+                                          sizeof(Obj*) * segment->capacity);
+        if (segment->objects == NULL)
+            exit(1);
+    }
+    segment->objects[segment->count++] = object;
+
+    if (object->type == OBJ_FUNCTION) {
+        Obj_function* function = (Obj_function*)object;
+        add_object(segment, (Obj*)function->name);
+        Value_array* constants = &function->chunk.constants;
+        for (int i = 0; i < constants->count; i++) {
+            if (IS_OBJ(constants->values[i]))
+                add_object(segment, AS_OBJ(constants->values[i]));
+        }
+    }
+}
+
+static size_t object_size(Obj* object) {
+    if (object->type == OBJ_STRING)
+        return sizeof(Obj_string) + ((Obj_string*)object)->length + 1;
+
+    Chunk* chunk = &((Obj_function*)object)->chunk;
+    return sizeof(Obj_function)
+           + (sizeof(uint8_t) + sizeof(int)) * chunk->capacity
+           + sizeof(Value) * chunk->constants.capacity;
+}
+
+// Moves the function, the functions nested in it and all of their strings
+// out of the VM's heap into a new segment, which the VM then holds along
+// with its mapped images. The caller keeps the function reachable. Returns
+// NULL, leaving the heap as it was, if an image turns out to be corrupt.
+Segment* share_function(VM* vm, Obj_function* function) {
+    if (!link_functions(vm, function))
+        return NULL;
+
+    Segment* segment = (Segment*)malloc(sizeof(Segment));
+    if (segment == NULL)
+        exit(1);
+    pthread_mutex_init(&segment->lock, NULL);
+    segment->references = 1;
+    segment->count = 0;
+    segment->capacity = 0;
+    segment->objects = NULL;
+    add_object(segment, (Obj*)function);
+
+    Obj** link = &vm->objects;
+    while (*link != NULL) {
+        if ((*link)->is_shared) {
+            vm->bytes_allocated -= object_size(*link);
+            *link = (*link)->next;
+        } else
+            link = &(*link)->next;
+    }
+
+    segment->images = vm->images;
+    for (Mapped_image* mapped = vm->images; mapped != NULL;
+         mapped = mapped->next)
+        vm->bytes_allocated -= sizeof(Mapped_image);
+    vm->images = NULL;
+
+    vm->segment = segment;
+    return segment;
+}
+
+void retain_segment(Segment* segment) {
+    pthread_mutex_lock(&segment->lock);
+    segment->references++;
+    pthread_mutex_unlock(&segment->lock);
+}
+
+void release_segment(Segment* segment) {
+    pthread_mutex_lock(&segment->lock);
+    int references = --segment->references;
+    pthread_mutex_unlock(&segment->lock);
+    if (references > 0)
+        return;
+
+    for (int i = 0; i < segment->count; i++) {
+        Obj* object = segment->objects[i];
+        if (object->type == OBJ_STRING)
+            free(((Obj_string*)object)->chars);
+        else {
+            Chunk* chunk = &((Obj_function*)object)->chunk;
+            if (chunk->capacity > 0) {
+                free(chunk->code);
+                free(chunk->lines);
+            }
+            free(chunk->constants.values);
+        }
+        free(object);
+    }
+    unmap_images(segment->images);
+
+    free(segment->objects);
+    pthread_mutex_destroy(&segment->lock);
+    free(segment);
+}
+
+// Adds the segment's strings to a VM that hasn't made any of its own yet,
+// so that it finds them instead of making copies.
+void intern_segment(VM* vm, Segment* segment) {
+    intern_set_reserve(vm, &vm->strings, segment->count);
+    for (int i = 0; i < segment->count; i++) {
+        if (segment->objects[i]->type != OBJ_STRING)
+            continue;
+
+        Obj_string* string = (Obj_string*)segment->objects[i];
+        int index;
+        if (intern_set_find(vm, &vm->strings, string->chars, string->length,
+                            string->hash, &index) == NULL)
+            intern_set_insert(&vm->strings, index, string);
+    }
+}
@@ -0,0 +1,234 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "object.h"
+#include "pool.h"
+#include "server.h"
+#include "vm.h"
+
+static volatile sig_atomic_t stopping = false;
+
+static void stop(int signal) {
+    (void)signal;
+    stopping = true;
+}
+
+static bool send_all(int fd, const char* bytes, size_t count) {
+    while (count > 0) {
+        ssize_t sent = send(fd, bytes, count, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+        bytes += sent;
+        count -= sent;
+    }
+    return true;
+}
+
+// Runs the handler on one request and sends back its answer. A runtime
+// error has been reported by the time this returns false.
+static bool handle_request(VM* vm, int fd, Obj_string* handler,
+                           const char* request, int length) {
+    Value function;
+    if (!table_get(&vm->globals, handler, &function)) {
+        fprintf(stderr, "Undefined handler '%s'!\n", handler->chars);
+        return false;
+    }
+
+    push(vm, function);
+    push(vm, OBJ_VAL(copy_string(vm, request, length)));
+    bool handled = interpret_call(vm, 1) == INTERPRET_OK;
+    flush_output(&vm->output);
+    if (!handled)
+        return false;
+
+    Value response = pop(vm);
+    if (!IS_STRING(response) && !IS_NIL(response)) {
+        fprintf(stderr, "Handler '%s' must return a string or nil!\n",
+                handler->chars);
+        return false;
+    }
+
+    return (!IS_STRING(response)
+            || send_all(fd, AS_CSTRING(response), AS_STRING(response)->length))
+           && send_all(fd, "\n", 1);
+}
+
+// Answers the lines a client sends until it hangs up, taking whatever
+// follows the last newline as a request too. The connection is dropped if
+// a request fails.
+static void handle_connection(VM* vm, int fd, Obj_string* handler) {
+    size_t capacity = 1024;
+    size_t count = 0;
+    char* buffer = (char*)malloc(capacity);
+    if (buffer == NULL)
+        exit(1);
+
+    bool connected = true;
+    while (connected) {
+        if (count == capacity) {
+            capacity *= 2;
+            buffer = (char*)realloc(buffer, capacity);
+            if (buffer == NULL)
+                exit(1);
+        }
+
+        ssize_t received = recv(fd, buffer + count, capacity - count, 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received <= 0) {
+            if (count > 0)
+                handle_request(vm, fd, handler, buffer, (int)count);
+            break;
+        }
+        count += received;
+
+        size_t start = 0;
+        char* end;
+        while (connected && (end = memchr(buffer + start, '\n',
+                                     count - start)) != NULL) {
+            size_t length = end - (buffer + start);
+            if (length > 0 && buffer[start + length - 1] == '\r')
+                length--;
+            connected = handle_request(vm, fd, handler, buffer + start,
+                                       (int)length);
+            start = end - buffer + 1;
+        }
+        memmove(buffer, buffer + start, count - start);
+        count -= start;
+    }
+
+    free(buffer);
+    close(fd);
+}
+
+static void run_worker(VM* vm, int listener, Obj_string* handler) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_DFL;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    for (;;) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            exit(74);
+        }
+        handle_connection(vm, fd, handler);
+    }
+}
+
+static pid_t start_worker(VM* vm, int listener, Obj_string* handler) {
+    pid_t pid = fork();
+    if (pid == 0)
+        run_worker(vm, listener, handler);
+    else if (pid < 0)
+        perror("fork");
+    return pid;
+}
+
+static int open_socket(const char* path) {
+    struct sockaddr_un address;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path \"%s\" is too long.\n", path);
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0
+        || listen(fd, SOMAXCONN) != 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Workers share the warm heap with this process until they write to it.
+// Spawned tasks are finished first, since threads don't survive a fork,
+// and the heap is frozen so that collecting in a worker leaves its pages
+// alone. Workers that die are replaced until SIGINT or SIGTERM comes, and
+// then they are stopped too.
+bool serve(VM* vm, const char* path, int workers, const char* handler) {
+    if (workers <= 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = online > 0 ? (int)online : 1;
+    }
+
+    Obj_string* name = copy_string(vm, handler, (int)strlen(handler));
+    Value function;
+    if (!table_get(&vm->globals, name, &function)) {
+        fprintf(stderr, "Undefined handler '%s'!\n", handler);
+        return false;
+    }
+
+    int listener = open_socket(path);
+    if (listener < 0)
+        return false;
+
+    finish_pool();
+    freeze_heap(vm);
+    flush_output(&vm->output);
+    fflush(stderr);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    pid_t* pids = (pid_t*)malloc(sizeof(pid_t) * workers);
+    if (pids == NULL)
+        exit(1);
+    for (int i = 0; i < workers; i++)
+        pids[i] = start_worker(vm, listener, name);
+
+    while (!stopping) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (int i = 0; i < workers; i++) {
+            if (pids[i] == pid)
+                pids[i] = stopping ? -1 : start_worker(vm, listener, name);
+        }
+    }
+
+    for (int i = 0; i < workers; i++) {
+        if (pids[i] > 0)
+            kill(pids[i], SIGTERM);
+    }
+    while (wait(NULL) > 0 || errno == EINTR)
+        ;
+
+    free(pids);
+    close(listener);
+    unlink(path);
+    return true;
+}
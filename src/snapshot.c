@@ -0,0 +1,112 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "message.h"
+#include "snapshot.h"
+#include "vm.h"
+
+// A snapshot is a header followed by a portable message of the VM's
+// globals. Objects in the message refer to each other by index rather
+// than by address, so loading one relocates every pointer as the objects
+// are rebuilt. Snapshots share the instruction set version and byte order
+// check of images, and a checksum turns away damaged files, since the
+// bytecode in them is trusted.
+
+#define SNAPSHOT_MAGIC "LOXS"
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t checksum;
+    uint64_t size;
+} Snapshot_header;
+
+// FNV-1a, as for strings.
+static uint32_t checksum(const uint8_t* bytes, size_t size) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+bool write_snapshot(VM* vm, const char* path) {
+    Message message;
+    init_message(&message);
+    bool success = write_globals(vm, &message);
+
+    FILE* file = success ? fopen(path, "wb") : NULL;
+    if (file != NULL) {
+        Snapshot_header header;
+        memcpy(header.magic, SNAPSHOT_MAGIC, 4);
+        header.version = IMAGE_VERSION;
+        header.byte_order = SNAPSHOT_BYTE_ORDER;
+        header.checksum = checksum(message.bytes, message.count);
+        header.size = message.count;
+
+        fwrite(&header, sizeof(header), 1, file);
+        fwrite(message.bytes, 1, message.count, file);
+        success = !ferror(file);
+        if (fclose(file) != 0)
+            success = false;
+    } else
+        success = false;
+
+    free_message(&message);
+    return success;
+}
+
+static bool validate_header(const uint8_t* snapshot, size_t size) {
+    if (size < sizeof(Snapshot_header))
+        return false;
+
+    const Snapshot_header* header = (const Snapshot_header*)snapshot;
+    const uint8_t* bytes = snapshot + sizeof(Snapshot_header);
+    return memcmp(header->magic, SNAPSHOT_MAGIC, 4) == 0
+           && header->version == IMAGE_VERSION
+           && header->byte_order == SNAPSHOT_BYTE_ORDER
+           && header->size == size - sizeof(Snapshot_header)
+           && header->checksum == checksum(bytes, header->size);
+}
+
+// Defines the snapshot's globals in the VM, in place of any it has by the
+// same names. The file is only mapped while the objects are rebuilt.
+bool read_snapshot(VM* vm, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat snapshot_stat;
+    if (fstat(fd, &snapshot_stat) != 0 || snapshot_stat.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = (size_t)snapshot_stat.st_size;
+    uint8_t* snapshot = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (snapshot == MAP_FAILED)
+        return false;
+
+    bool valid = validate_header(snapshot, size);
+    if (valid) {
+        Message message;
+        init_message(&message);
+        message.bytes = snapshot + sizeof(Snapshot_header);
+        message.count = size - sizeof(Snapshot_header);
+        read_globals(vm, &message);
+    }
+
+    munmap(snapshot, size);
+    return valid;
+}
@@ -14,8 +14,8 @@ void init_table(Table *table) {
     table->entries = NULL;
 }
 
-void free_table(Table *table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+void free_table(VM* vm, Table *table) {
+    FREE_ARRAY(vm, Entry, table->entries, table->capacity);
     init_table(table);
 }
 
@@ -44,8 +44,8 @@ static Entry* find_entry(Entry* entries, int capacity, Obj_string* key) {
     }
 }
 
-static void adjust_capacity(Table* table, int capacity) {
-    Entry* entries = ALLOCATE(Entry, capacity);
+static void adjust_capacity(VM* vm, Table* table, int capacity) {
+    Entry* entries = ALLOCATE(vm, Entry, capacity);
     for (int i = 0; i < capacity; i++) {
         entries[i].key = NULL;
         entries[i].value = NIL_VAL;
@@ -63,7 +63,7 @@ static void adjust_capacity(Table* table, int capacity) {
         table->count++;
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(vm, Entry, table->entries, table->capacity);
     table->entries = entries;
     table->capacity = capacity;
 }
@@ -80,10 +80,10 @@ bool table_get(Table *table, Obj_string *key, Value *value) {
     return true;
 }
 
-bool table_set(Table *table, Obj_string *key, Value value) {
+bool table_set(VM* vm, Table *table, Obj_string *key, Value value) {
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
         int capacity = GROW_CAPACITY(table->capacity);
-        adjust_capacity(table, capacity);
+        adjust_capacity(vm, table, capacity);
     }
 
     Entry* entry = find_entry(table->entries, table->capacity, key);
@@ -113,51 +113,18 @@ bool table_delete(Table *table, Obj_string *key) {
     return true;
 }
 
-void table_add_all(Table *from, Table *to) {
+void table_add_all(VM* vm, Table *from, Table *to) {
     for (int i = 0; i < from->capacity; i++) {
         Entry* entry = &from->entries[i];
         if (entry->key != NULL)
-            table_set(to, entry->key, entry->value);
+            table_set(vm, to, entry->key, entry->value);
     }
 }
 
-Obj_string* table_find_string(Table *table, const char *chars, int length,
-                              uint32_t hash) {
-    if (table->count == 0)
-        return NULL;
-
-    uint32_t index = hash % table->capacity;
-
-    for (;;) {
-        Entry* entry = &table->entries[index];
-
-        if (entry->key == NULL) {
-            // Stop if we find an empty non-tombstone entry.
-            if (IS_NIL(entry->value))
-                return NULL;
-        } else if (entry->key->length == length
-                   && entry->key->hash == hash
-                   && memcmp(entry->key->chars, chars, length) == 0) {
-            // Found it.
-            return entry->key;
-        }
-
-        index = (index + 1) % table->capacity;
-    }
-}
-
-void table_remove_white(Table *table) {
-    for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.is_marked)
-            table_delete(table, entry->key);
-    }
-}
-
-void mark_table(Table* table) {
+void mark_table(VM* vm, Table* table) {
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
-        mark_object((Obj*)entry->key);
-        mark_value(entry->value);
+        mark_object(vm, (Obj*)entry->key);
+        mark_value(vm, entry->value);
     }
 }
@@ -0,0 +1,133 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "map.h"
+#include "object.h"
+#include "timing.h"
+#include "vm.h"
+
+// Calls bench() makes before it starts timing, for every ten it times.
+#define BENCH_WARMUP_RATIO 10
+
+static struct timespec start;
+static pthread_once_t start_once = PTHREAD_ONCE_INIT;
+
+static void record_start() {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+}
+
+// Counted from the first reading rather than from boot, so that the count
+// stays well inside the whole numbers a double holds exactly.
+static double monotonic_ns() {
+    pthread_once(&start_once, record_start);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start.tv_sec) * 1e9
+           + (double)(now.tv_nsec - start.tv_nsec);
+}
+
+static bool clock_native(VM* vm, int arg_count, Value* args,
+                         Value* result) {
+    *result = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    return true;
+}
+
+// clock_ns() reads a monotonic clock in nanoseconds, which only means
+// something as the difference between two readings.
+static bool clock_ns_native(VM* vm, int arg_count, Value* args,
+                            Value* result) {
+    *result = NUMBER_VAL(monotonic_ns());
+    return true;
+}
+
+// cpu_time() is the CPU time the process has used, in seconds, at the
+// clock's full resolution.
+static bool cpu_time_native(VM* vm, int arg_count, Value* args,
+                            Value* result) {
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    *result = NUMBER_VAL((double)now.tv_sec + (double)now.tv_nsec * 1e-9);
+    return true;
+}
+
+static int compare_times(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void set_field(VM* vm, Obj_map* map, const char* name,
+                      double value) {
+    push(vm, OBJ_VAL(copy_string(vm, name, (int)strlen(name))));
+    map_set(vm, map, vm->stack_top[-1], NUMBER_VAL(value));
+    pop(vm);
+}
+
+// bench(fn, iterations) calls fn with no arguments a tenth as many times
+// again to warm up, then times each of the iterations calls on its own.
+// It returns a map of their min, median, mean and stddev in nanoseconds,
+// which include the clock's own cost of some tens of nanoseconds.
+static bool bench_native(VM* vm, int arg_count, Value* args,
+                         Value* result) {
+    Value function = args[0];
+    double number = IS_NUMBER(args[1]) ? AS_NUMBER(args[1]) : 0;
+    if (!(number >= 1 && number <= INT32_MAX) || (int)number != number) {
+        runtime_error(vm, "Iterations must be a positive whole number!");
+        return false;
+    }
+    int iterations = (int)number;
+
+    double* times = (double*)malloc(sizeof(double) * iterations);
+    if (times == NULL)
+        exit(1);
+
+    int warmup = iterations / BENCH_WARMUP_RATIO;
+    for (int i = -warmup; i < iterations; i++) {
+        push(vm, function);
+        double before = monotonic_ns();
+        if (interpret_call(vm, 0) != INTERPRET_OK) {
+            free(times);
+            return false;
+        }
+        double after = monotonic_ns();
+        pop(vm);
+        if (i >= 0)
+            times[i] = after - before;
+    }
+
+    double total = 0;
+    for (int i = 0; i < iterations; i++)
+        total += times[i];
+    double mean = total / iterations;
+    double squares = 0;
+    for (int i = 0; i < iterations; i++)
+        squares += (times[i] - mean) * (times[i] - mean);
+
+    qsort(times, iterations, sizeof(double), compare_times);
+    double median = iterations % 2 == 1
+                    ? times[iterations / 2]
+                    : (times[iterations / 2 - 1] + times[iterations / 2]) / 2;
+
+    Obj_map* report = new_map(vm);
+    push(vm, OBJ_VAL(report));
+    set_field(vm, report, "iterations", iterations);
+    set_field(vm, report, "min", times[0]);
+    set_field(vm, report, "median", median);
+    set_field(vm, report, "mean", mean);
+    set_field(vm, report, "stddev", sqrt(squares / iterations));
+    *result = pop(vm);
+    free(times);
+    return true;
+}
+
+void define_timing_natives(VM* vm) {
+    define_native(vm, "bench", 2, bench_native);
+    define_native(vm, "clock", 0, clock_native);
+    define_native(vm, "clock_ns", 0, clock_ns_native);
+    define_native(vm, "cpu_time", 0, cpu_time_native);
+}
@@ -11,11 +11,11 @@ void init_value_array(Value_array *array) {
     array->count = 0;
 }
 
-void write_value_array(Value_array *array, Value value) {
+void write_value_array(VM* vm, Value_array *array, Value value) {
     if (array->capacity < array->count + 1) {
         int old_capacity = array->capacity;
         array->capacity = GROW_CAPACITY(old_capacity);
-        array->values = GROW_ARRAY(Value, array->values, old_capacity,
+        array->values = GROW_ARRAY(vm, Value, array->values, old_capacity,
                                    array->capacity);
     }
 
@@ -23,28 +23,36 @@ void write_value_array(Value_array *array, Value value) {
     array->count++;
 }
 
-void free_value_array(Value_array *array) {
-    FREE_ARRAY(Value, array->values, array->capacity);
+void free_value_array(VM* vm, Value_array *array) {
+    FREE_ARRAY(vm, Value, array->values, array->capacity);
     init_value_array(array);
 }
 
-void print_value(Value value) {
+void output_value(Output* output, Value value) {
     switch (value.type) {
     case VAL_BOOL:
-        printf(AS_BOOL(value) ? "true" : "false");
+        write_string(output, AS_BOOL(value) ? "true" : "false");
         break;
     case VAL_NIL:
-        printf("nil");
+        write_chars(output, "nil", 3);
         break;
     case VAL_NUMBER:
-        printf("%g", AS_NUMBER(value));
+        write_number(output, AS_NUMBER(value));
         break;
     case VAL_OBJ:
-        print_object(value);
+        output_object(output, value);
         break;
     }
 }
 
+// Debugging output skips the VM's buffer and goes to stdio as it comes.
+void print_value(Value value) {
+    char chars[256];
+    Output output = {chars, 0, sizeof(chars), FLUSH_FULL};
+    output_value(&output, value);
+    fwrite(output.chars, 1, output.count, stdout);
+}
+
 bool values_equal(Value a, Value b) {
     if (a.type != b.type)
         return false;
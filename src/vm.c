@@ -1,36 +1,133 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <time.h>
 
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "event.h"
+#include "float_array.h"
+#include "image.h"
+#include "list.h"
+#include "map.h"
 #include "object.h"
 #include "memory.h"
+#include "number.h"
+#include "pool.h"
+#include "profile.h"
+#include "segment.h"
+#include "timing.h"
 #include "vm.h"
 
-VM vm;
+static bool flush_native(VM* vm, int arg_count, Value* args,
+                         Value* result) {
+    flush_output(&vm->output);
+    *result = NIL_VAL;
+    return true;
+}
+
+// num(string) reads a number, or gives nil when the string isn't one.
+// str(number) writes it in as few digits as read back the same.
+static bool num_native(VM* vm, int arg_count, Value* args, Value* result) {
+    if (IS_NUMBER(args[0])) {
+        *result = args[0];
+        return true;
+    }
+    if (!IS_STRING(args[0])) {
+        runtime_error(vm, "Can only convert strings to numbers!");
+        return false;
+    }
+
+    Obj_string* string = AS_STRING(args[0]);
+    double value;
+    if (parse_number(string->chars, string->length, &value))
+        *result = NUMBER_VAL(value);
+    else
+        *result = NIL_VAL;
+    return true;
+}
+
+static bool str_native(VM* vm, int arg_count, Value* args, Value* result) {
+    if (IS_STRING(args[0])) {
+        *result = args[0];
+        return true;
+    }
+    if (!IS_NUMBER(args[0])) {
+        runtime_error(vm, "Can only convert numbers to strings!");
+        return false;
+    }
 
-static Value clock_native(int arg_count, Value* args) {
-    return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    char buffer[NUMBER_MAX_LENGTH];
+    int length = format_shortest(buffer, AS_NUMBER(args[0]));
+    *result = OBJ_VAL(copy_string(vm, buffer, length));
+    return true;
 }
 
-static void reset_stack() {
-    vm.stack_top = vm.stack;
-    vm.frame_count = 0;
-    vm.open_upvalues = NULL;
+static void reset_stack(VM* vm) {
+    vm->stack_top = vm->stack;
+    vm->frame_count = 0;
+    vm->open_upvalues = NULL;
 }
 
-static void runtime_error(const char* format, ...) {
-    va_list args;
-    va_start(args, format);
-    vfprintf(stderr, format, args);
-    va_end(args);
-    fputs("\n", stderr);
+static void close_upvalues(VM* vm, Value* last);
+static void define_fiber_natives(VM* vm);
+
+// Trades the VM's stacks for the ones the fiber holds. The profiler can
+// look at the frames in between any two steps, so there are none to see
+// while the arrays change hands.
+static void swap_stacks(VM* vm, Obj_fiber* fiber) {
+#define SWAP(type, field) \
+    do { \
+        type swapped = vm->field; \
+        vm->field = fiber->field; \
+        fiber->field = swapped; \
+    } while (false)
+
+    int frame_count = vm->frame_count;
+    vm->frame_count = 0;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    SWAP(Call_frame*, frames);
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    vm->frame_count = fiber->frame_count;
+    fiber->frame_count = frame_count;
+    SWAP(int, frame_capacity);
+    SWAP(Value*, stack);
+    SWAP(Value*, stack_top);
+    SWAP(int, stack_capacity);
+    SWAP(Obj_upvalue*, open_upvalues);
 
-    for (int i = vm.frame_count - 1; i >= 0; i--) {
-        Call_frame* frame = &vm.frames[i];
+#undef SWAP
+}
+
+// Hands the VM back to whatever resumed the running fiber, which is left
+// holding its own stacks.
+static Obj_fiber* leave_fiber(VM* vm, Fiber_status status) {
+    Obj_fiber* fiber = vm->fiber;
+    fiber->status = status;
+    swap_stacks(vm, fiber);
+    vm->fiber = fiber->caller;
+    fiber->caller = NULL;
+    return fiber;
+}
+
+// Frees the stacks of a fiber that has left them for good, once nothing
+// points into them.
+static void free_fiber_stacks(Obj_fiber* fiber) {
+    free(fiber->frames);
+    free(fiber->stack);
+    fiber->frames = NULL;
+    fiber->frame_count = 0;
+    fiber->frame_capacity = 0;
+    fiber->stack = NULL;
+    fiber->stack_top = NULL;
+    fiber->stack_capacity = 0;
+    fiber->open_upvalues = NULL;
+}
+
+static void print_stack_trace(VM* vm) {
+    for (int i = vm->frame_count - 1; i >= 0; i--) {
+        Call_frame* frame = &vm->frames[i];
         Obj_function* function = frame->closure->function;
         // -1 because the IP is sitting in the next insn to be executed.
         size_t instruction = frame->ip - function->chunk.code - 1;
@@ -40,108 +137,274 @@ static void runtime_error(const char* format, ...) {
         else
             fprintf(stderr, "%s()\n", function->name->chars);
     }
+}
+
+// An error in a fiber ends it and every fiber waiting on it, and the trace
+// runs on through each of them.
+void runtime_error(VM* vm, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputs("\n", stderr);
+
+    print_stack_trace(vm);
+    while (vm->fiber != NULL) {
+        close_upvalues(vm, vm->stack);
+        free_fiber_stacks(leave_fiber(vm, FIBER_DONE));
+        print_stack_trace(vm);
+    }
+
+    reset_stack(vm);
+}
+
+void define_native(VM* vm, const char* name, int arity,
+                   Native_fn function) {
+    push(vm, OBJ_VAL(copy_string(vm, name, (int)strlen(name))));
+    Obj_string* key = AS_STRING(vm->stack_top[-1]);
+    push(vm, OBJ_VAL(new_native(vm, key, arity, function)));
+    table_set(vm, &vm->globals, key, vm->stack_top[-1]);
+    pop(vm);
+    pop(vm);
+}
+
+bool get_global(VM* vm, const char* name, Value* value) {
+    Obj_string* key = copy_string(vm, name, (int)strlen(name));
+    return table_get(&vm->globals, key, value);
+}
+
+void set_global(VM* vm, const char* name, Value value) {
+    push(vm, value);
+    push(vm, OBJ_VAL(copy_string(vm, name, (int)strlen(name))));
+    table_set(vm, &vm->globals, AS_STRING(vm->stack_top[-1]),
+              vm->stack_top[-2]);
+    pop(vm);
+    pop(vm);
+}
 
-    reset_stack();
+void init_VM(VM* vm) {
+    init_shared_VM(vm, NULL);
 }
 
-static void define_native(const char* name, Native_fn function) {
-    push(OBJ_VAL(copy_string(name, (int)strlen(name))));
-    push(OBJ_VAL(new_native(function)));
-    table_set(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-    pop();
-    pop();
+// The segment's strings go in before the VM makes any of its own, so that
+// there is only ever one of each.
+void init_shared_VM(VM* vm, Segment* segment) {
+    vm->frames = (Call_frame*)malloc(sizeof(Call_frame) * FRAMES_INITIAL);
+    vm->frame_capacity = FRAMES_INITIAL;
+    vm->max_frames = FRAMES_MAX;
+    vm->stack = (Value*)malloc(sizeof(Value) * STACK_INITIAL);
+    vm->stack_capacity = STACK_INITIAL;
+    if (vm->frames == NULL || vm->stack == NULL)
+        exit(1);
+
+    reset_stack(vm);
+    init_output(&vm->output);
+    vm->fiber = NULL;
+    vm->native_depth = 0;
+    vm->loop = NULL;
+    vm->objects = NULL;
+    vm->frozen = NULL;
+    vm->images = NULL;
+    vm->compiler = NULL;
+    vm->bytes_allocated = 0;
+    vm->next_GC = 1024 * 1024;
+
+    vm->gray_count = 0;
+    vm->gray_capacity = 0;
+    vm->gray_stack = NULL;
+    vm->optimize = false;
+    vm->peephole = 0;
+    vm->inline_globals = false;
+
+    init_table(&vm->globals);
+    init_intern_set(&vm->strings);
+
+    vm->init_string = NULL;
+    vm->segment = segment;
+    if (segment != NULL) {
+        retain_segment(segment);
+        intern_segment(vm, segment);
+    }
+    vm->init_string = copy_string(vm, "init", 4);
+
+    define_native(vm, "flush", 0, flush_native);
+    define_native(vm, "num", 1, num_native);
+    define_native(vm, "str", 1, str_native);
+    define_list_natives(vm);
+    define_float_array_natives(vm);
+    define_map_natives(vm);
+    define_pool_natives(vm);
+    define_fiber_natives(vm);
+    define_event_natives(vm);
+    define_timing_natives(vm);
 }
 
-void init_VM() {
-    reset_stack();
-    vm.objects = NULL;
-    vm.bytes_allocated = 0;
-    vm.next_GC = 1024 * 1024;
+void free_VM(VM* vm) {
+    free_table(vm, &vm->globals);
+    free_intern_set(vm, &vm->strings);
+    vm->init_string = NULL;
+    free_event_loop(vm);
+    free_objects(vm);
+    free_images(vm);
+    if (vm->segment != NULL)
+        release_segment(vm->segment);
+    vm->segment = NULL;
 
-    vm.gray_count = 0;
-    vm.gray_capacity = 0;
-    vm.gray_stack = NULL;
+    free_output(&vm->output);
+    free(vm->frames);
+    free(vm->stack);
+    vm->frames = NULL;
+    vm->stack = NULL;
+}
 
-    init_table(&vm.globals);
-    init_table(&vm.strings);
+// The stacks live outside the GC's accounting, like the gray stack, so
+// that growing them never starts a collection halfway through a push.
+static void grow_stack(VM* vm) {
+    int capacity = GROW_CAPACITY(vm->stack_capacity);
+    Value* stack = (Value*)malloc(sizeof(Value) * capacity);
+    if (stack == NULL)
+        exit(1);
+    memcpy(stack, vm->stack, sizeof(Value) * vm->stack_capacity);
 
-    vm.init_string = NULL;
-    vm.init_string = copy_string("init", 4);
+    // Everything pointing into the old stack has to follow it.
+    for (int i = 0; i < vm->frame_count; i++)
+        vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+    for (Obj_upvalue* upvalue = vm->open_upvalues; upvalue != NULL;
+         upvalue = upvalue->next)
+        upvalue->location = stack + (upvalue->location - vm->stack);
+    vm->stack_top = stack + (vm->stack_top - vm->stack);
 
-    define_native("clock", clock_native);
+    free(vm->stack);
+    vm->stack = stack;
+    vm->stack_capacity = capacity;
 }
 
-void free_VM() {
-    free_table(&vm.globals);
-    free_table(&vm.strings);
-    vm.init_string = NULL;
-    free_objects();
+static void grow_frames(VM* vm) {
+    int capacity = GROW_CAPACITY(vm->frame_capacity);
+    if (capacity > vm->max_frames)
+        capacity = vm->max_frames;
+
+    // Not realloc(), which could free the old frames while the profiler
+    // is still reading them.
+    Call_frame* frames = (Call_frame*)malloc(sizeof(Call_frame) * capacity);
+    if (frames == NULL)
+        exit(1);
+    memcpy(frames, vm->frames, sizeof(Call_frame) * vm->frame_count);
+
+    Call_frame* old_frames = vm->frames;
+    vm->frames = frames;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    free(old_frames);
+    vm->frame_capacity = capacity;
 }
 
-void push(Value value) {
-    *vm.stack_top = value;
-    vm.stack_top++;
+void push(VM* vm, Value value) {
+    if (vm->stack_top == vm->stack + vm->stack_capacity)
+        grow_stack(vm);
+    *vm->stack_top = value;
+    vm->stack_top++;
 }
 
-Value pop() {
-    vm.stack_top--;
-    return *vm.stack_top;
+Value pop(VM* vm) {
+    vm->stack_top--;
+    return *vm->stack_top;
 }
 
-static Value peek(int distance) {
-    return vm.stack_top[-1 - distance];
+static Value peek(VM* vm, int distance) {
+    return vm->stack_top[-1 - distance];
 }
 
-static bool call(Obj_closure* closure, int arg_count) {
+static bool check_call(VM* vm, Obj_closure* closure, int arg_count) {
     if (arg_count != closure->function->arity) {
-        runtime_error("Expected %d arguments, but got %d!",
+        runtime_error(vm, "Expected %d arguments, but got %d!",
                       closure->function->arity, arg_count);
         return false;
     }
 
-    if (vm.frame_count == FRAMES_MAX) {
-        runtime_error("Stack overflow!");
+    if (closure->function->image != NULL
+        && !link_image_function(vm, closure->function)) {
+        runtime_error(vm, "Corrupt bytecode image!");
+        return false;
+    }
+    return true;
+}
+
+static bool call(VM* vm, Obj_closure* closure, int arg_count) {
+    if (vm->frame_count >= vm->max_frames) {
+        runtime_error(vm, "Stack overflow!");
         return false;
     }
+    if (vm->frame_count == vm->frame_capacity)
+        grow_frames(vm);
+
+    if (!check_call(vm, closure, arg_count))
+        return false;
 
-    Call_frame* frame = &vm.frames[vm.frame_count++];
+    // The frame is counted only once it is filled in, for the profiler.
+    Call_frame* frame = &vm->frames[vm->frame_count];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
-
-    frame->slots = vm.stack_top - arg_count - 1;
+    frame->slots = vm->stack_top - arg_count - 1;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    vm->frame_count++;
     return true;
 }
 
-static bool call_value(Value callee, int arg_count) {
+static bool call_value(VM* vm, Value callee, int arg_count) {
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee)) {
         case OBJ_BOUND_METHOD:
         {
             Obj_bound_method* bound = AS_BOUND_METHOD(callee);
-            vm.stack_top[-arg_count - 1] = bound->receiver;
-            return call(bound->method, arg_count);
+            vm->stack_top[-arg_count - 1] = bound->receiver;
+            return call(vm, bound->method, arg_count);
         }
         case OBJ_CLASS:
         {
             Obj_class* klass = AS_CLASS(callee);
-            vm.stack_top[-arg_count - 1] = OBJ_VAL(new_instance(klass));
+            vm->stack_top[-arg_count - 1] = OBJ_VAL(new_instance(vm, klass));
             Value initializer;
-            if (table_get(&klass->methods, vm.init_string, &initializer))
-                return call(AS_CLOSURE(initializer), arg_count);
+            if (table_get(&klass->methods, vm->init_string, &initializer))
+                return call(vm, AS_CLOSURE(initializer), arg_count);
             else if (arg_count != 0) {
-                runtime_error("Expected 0 arguments but got %d!", arg_count);
+                runtime_error(vm, "Expected 0 arguments but got %d!",
+                              arg_count);
                 return false;
             }
             return true;
         }
         case OBJ_CLOSURE:
-            return call(AS_CLOSURE(callee), arg_count);
+            return call(vm, AS_CLOSURE(callee), arg_count);
         case OBJ_NATIVE:
         {
-            Native_fn native = AS_NATIVE(callee);
-            Value result = native(arg_count, vm.stack_top - arg_count);
-            vm.stack_top -= arg_count + 1;
-            push(result);
+            Obj_native* native = AS_NATIVE(callee);
+            if (native->arity != NATIVE_VARIADIC
+                && arg_count != native->arity) {
+                runtime_error(vm, "Expected %d arguments, but got %d!",
+                              native->arity, arg_count);
+                return false;
+            }
+
+            // The stack mustn't move under the arguments while the native
+            // roots its temporaries.
+            while (vm->stack_top + NATIVE_STACK_SLOTS
+                   > vm->stack + vm->stack_capacity)
+                grow_stack(vm);
+
+            // A native that switches fibers leaves both stacks as they
+            // should be.
+            Obj_fiber* fiber = vm->fiber;
+            Value result;
+            vm->native_depth++;
+            bool ok = native->function(vm, arg_count,
+                                       vm->stack_top - arg_count, &result);
+            vm->native_depth--;
+            if (!ok)
+                return false;
+            if (vm->fiber != fiber)
+                return true;
+            vm->stack_top -= arg_count + 1;
+            push(vm, result);
             return true;
         }
         default:
@@ -150,26 +413,57 @@ static bool call_value(Value callee, int arg_count) {
         }
     }
 
-    runtime_error("Can only call functions and classes");
+    runtime_error(vm, "Can only call functions and classes");
     return false;
 }
 
-static bool invoke_from_class(Obj_class* klass, Obj_string* name,
-                              int arg_count) {
+// Calls a closure in place of the current frame: its captured locals are
+// closed and the callee and arguments slide down over it. Anything else is
+// called as usual.
+static bool tail_call(VM* vm, Value callee, int arg_count) {
+    Obj_closure* closure;
+    if (IS_BOUND_METHOD(callee)) {
+        Obj_bound_method* bound = AS_BOUND_METHOD(callee);
+        vm->stack_top[-arg_count - 1] = bound->receiver;
+        closure = bound->method;
+    } else if (IS_CLOSURE(callee)) {
+        closure = AS_CLOSURE(callee);
+    } else
+        return call_value(vm, callee, arg_count);
+
+    if (!check_call(vm, closure, arg_count))
+        return false;
+
+    Call_frame* frame = &vm->frames[vm->frame_count - 1];
+    close_upvalues(vm, frame->slots);
+    memmove(frame->slots, vm->stack_top - arg_count - 1,
+            sizeof(Value) * (arg_count + 1));
+    vm->stack_top = frame->slots + arg_count + 1;
+
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code;
+    return true;
+}
+
+// A tail invocation reuses the frame the way tail_call() does.
+static bool invoke_from_class(VM* vm, Obj_class* klass, Obj_string* name,
+                              int arg_count, bool tail) {
     Value method;
     if (!table_get(&klass->methods, name, &method)) {
-        runtime_error("Undefined property '%s'!", name->chars);
+        runtime_error(vm, "Undefined property '%s'!", name->chars);
         return false;
     }
 
-    return call(AS_CLOSURE(method), arg_count);
+    if (tail)
+        return tail_call(vm, method, arg_count);
+    return call(vm, AS_CLOSURE(method), arg_count);
 }
 
-static bool invoke(Obj_string* name, int arg_count) {
-    Value receiver = peek(arg_count);
+static bool invoke(VM* vm, Obj_string* name, int arg_count, bool tail) {
+    Value receiver = peek(vm, arg_count);
 
     if (!IS_INSTANCE(receiver)) {
-        runtime_error("Only instances have methods!");
+        runtime_error(vm, "Only instances have methods!");
         return false;
     }
 
@@ -177,29 +471,32 @@ static bool invoke(Obj_string* name, int arg_count) {
 
     Value value;
     if (table_get(&instance->fields, name, &value)) {
-        vm.stack_top[-arg_count - 1] = value;
-        return call_value(value, arg_count);
+        vm->stack_top[-arg_count - 1] = value;
+        if (tail)
+            return tail_call(vm, value, arg_count);
+        return call_value(vm, value, arg_count);
     }
 
-    return invoke_from_class(instance->klass, name, arg_count);
+    return invoke_from_class(vm, instance->klass, name, arg_count, tail);
 }
 
-static bool bind_method(Obj_class* klass, Obj_string* name) {
+static bool bind_method(VM* vm, Obj_class* klass, Obj_string* name) {
     Value method;
     if (!table_get(&klass->methods, name, &method)) {
-        runtime_error("Undefined property '%s'!", name->chars);
+        runtime_error(vm, "Undefined property '%s'!", name->chars);
         return false;
     }
 
-    Obj_bound_method* bound = new_bound_method(peek(0), AS_CLOSURE(method));
-    pop();
-    push(OBJ_VAL(bound));
+    Obj_bound_method* bound = new_bound_method(vm, peek(vm, 0),
+                                               AS_CLOSURE(method));
+    pop(vm);
+    push(vm, OBJ_VAL(bound));
     return true;
 }
 
-static Obj_upvalue* capture_upvalue(Value* local) {
+static Obj_upvalue* capture_upvalue(VM* vm, Value* local) {
     Obj_upvalue* prev_upvalue = NULL;
-    Obj_upvalue* upvalue = vm.open_upvalues;
+    Obj_upvalue* upvalue = vm->open_upvalues;
 
     while (upvalue != NULL && upvalue->location > local) {
         prev_upvalue = upvalue;
@@ -209,56 +506,286 @@ static Obj_upvalue* capture_upvalue(Value* local) {
     if (upvalue != NULL && upvalue->location == local)
         return upvalue;
 
-    Obj_upvalue* created_upvalue = new_upvalue(local);
+    Obj_upvalue* created_upvalue = new_upvalue(vm, local);
     created_upvalue->next = upvalue;
+    created_upvalue->fiber = vm->fiber;
 
     if (prev_upvalue == NULL)
-        vm.open_upvalues = created_upvalue;
+        vm->open_upvalues = created_upvalue;
     else
         prev_upvalue->next = created_upvalue;
 
     return created_upvalue;
 }
 
-static void close_upvalues(Value* last) {
-    while (vm.open_upvalues != NULL
-           && vm.open_upvalues->location >= last) {
-        Obj_upvalue* upvalue = vm.open_upvalues;
+static void close_upvalues(VM* vm, Value* last) {
+    while (vm->open_upvalues != NULL
+           && vm->open_upvalues->location >= last) {
+        Obj_upvalue* upvalue = vm->open_upvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
-        vm.open_upvalues = upvalue->next;
+        upvalue->fiber = NULL;
+        vm->open_upvalues = upvalue->next;
     }
 }
 
-static void define_method(Obj_string* name) {
-    Value method = peek(0);
-    Obj_class* klass = AS_CLASS(peek(1));
-    table_set(&klass->methods, name, method);
-    pop();
+// fiber(function) is a fiber that runs the function, which takes at most
+// one argument, when it is first resumed.
+static bool fiber_native(VM* vm, int arg_count, Value* args, Value* result) {
+    if (!IS_CLOSURE(args[0]) || AS_CLOSURE(args[0])->function->arity > 1) {
+        runtime_error(vm, "Fibers run functions of at most one argument!");
+        return false;
+    }
+
+    *result = OBJ_VAL(new_fiber(vm, AS_CLOSURE(args[0])));
+    return true;
+}
+
+// Switches to the fiber, handing it the value. Its result lands in the
+// slot on top of the resumer's stack, and natives it calls run depth deep.
+static bool enter_fiber(VM* vm, Obj_fiber* fiber, Value value, int depth) {
+    if (fiber->status == FIBER_RUNNING) {
+        runtime_error(vm, "Can't resume a running fiber!");
+        return false;
+    }
+    if (fiber->status == FIBER_DONE) {
+        runtime_error(vm, "Can't resume a finished fiber!");
+        return false;
+    }
+
+    bool is_new = fiber->status == FIBER_NEW;
+    fiber->status = FIBER_RUNNING;
+    fiber->caller = vm->fiber;
+    fiber->native_depth = depth;
+    swap_stacks(vm, fiber);
+    vm->fiber = fiber;
+
+    if (!is_new) {
+        vm->stack_top[-1] = value;
+        return true;
+    }
+
+    int arity = fiber->closure->function->arity;
+    if (arity == 1)
+        push(vm, value);
+    return call(vm, fiber->closure, arity);
+}
+
+// resume(fiber, value) runs the fiber until it yields or returns, and is
+// what it yielded or returned. The value, nil if left out, is the result
+// of the yield() the fiber stopped at, or its function's argument the
+// first time.
+static bool resume_native(VM* vm, int arg_count, Value* args,
+                          Value* result) {
+    if (arg_count < 1 || arg_count > 2) {
+        runtime_error(vm, "Expected 1 or 2 arguments, but got %d!",
+                      arg_count);
+        return false;
+    }
+    if (!IS_FIBER(args[0])) {
+        runtime_error(vm, "Can only resume fibers!");
+        return false;
+    }
+
+    // The callee's slot is where the result lands.
+    Obj_fiber* fiber = AS_FIBER(args[0]);
+    Value value = arg_count == 2 ? args[1] : NIL_VAL;
+    vm->stack_top -= arg_count;
+    return enter_fiber(vm, fiber, value, vm->native_depth);
+}
+
+bool yield_fiber(VM* vm, int arg_count, Value value) {
+    if (vm->fiber == NULL) {
+        runtime_error(vm, "Can only yield inside a fiber!");
+        return false;
+    }
+    if (vm->native_depth != vm->fiber->native_depth) {
+        runtime_error(vm, "Can't yield across a native call!");
+        return false;
+    }
+
+    vm->stack_top -= arg_count;
+    leave_fiber(vm, FIBER_SUSPENDED);
+    vm->stack_top[-1] = value;
+    return true;
+}
+
+// yield(value) suspends the running fiber, and makes the value, nil if
+// left out, the result of the resume() that ran it. Only the run loop
+// that resumed the fiber can carry on from there, so a fiber can't yield
+// from inside a callback of a native.
+static bool yield_native(VM* vm, int arg_count, Value* args,
+                         Value* result) {
+    if (arg_count > 1) {
+        runtime_error(vm, "Expected 0 or 1 arguments, but got %d!",
+                      arg_count);
+        return false;
+    }
+
+    return yield_fiber(vm, arg_count, arg_count == 1 ? args[0] : NIL_VAL);
+}
+
+static bool is_done_native(VM* vm, int arg_count, Value* args,
+                           Value* result) {
+    if (!IS_FIBER(args[0])) {
+        runtime_error(vm, "Expected a fiber!");
+        return false;
+    }
+
+    *result = BOOL_VAL(AS_FIBER(args[0])->status == FIBER_DONE);
+    return true;
+}
+
+static void define_fiber_natives(VM* vm) {
+    define_native(vm, "fiber", 1, fiber_native);
+    define_native(vm, "is_done", 1, is_done_native);
+    define_native(vm, "resume", NATIVE_VARIADIC, resume_native);
+    define_native(vm, "yield", NATIVE_VARIADIC, yield_native);
+}
+
+// The function of the running fiber has returned, leaving its result on
+// top of the stack. That goes to whatever resumed the fiber.
+static void finish_fiber(VM* vm) {
+    Value result = pop(vm);
+    free_fiber_stacks(leave_fiber(vm, FIBER_DONE));
+    vm->stack_top[-1] = result;
+}
+
+static void define_method(VM* vm, Obj_string* name) {
+    Value method = peek(vm, 0);
+    Obj_class* klass = AS_CLASS(peek(vm, 1));
+    table_set(vm, &klass->methods, name, method);
+    pop(vm);
+}
+
+// Checks that an index into a list or array of count items is a whole
+// number within it. The kind names the container in errors.
+static bool check_index(VM* vm, const char* kind, int count, Value position,
+                        int* index) {
+    if (!IS_NUMBER(position)) {
+        runtime_error(vm, "%s index must be a number!", kind);
+        return false;
+    }
+
+    double number = AS_NUMBER(position);
+    if (!(number >= 0 && number < count)) {
+        runtime_error(vm, "%s index %g out of bounds!", kind, number);
+        return false;
+    }
+    *index = (int)number;
+    if (*index != number) {
+        runtime_error(vm, "%s index must be an integer!", kind);
+        return false;
+    }
+    return true;
+}
+
+// Replaces the container and index on top of the stack with the item at
+// that index. A key a map doesn't have reads as nil.
+static bool get_index(VM* vm) {
+    Value container = peek(vm, 1);
+    Value item = NIL_VAL;
+    int index;
+    if (IS_LIST(container)) {
+        Obj_list* list = AS_LIST(container);
+        if (!check_index(vm, "List", list->items.count, peek(vm, 0), &index))
+            return false;
+        item = list->items.values[index];
+    } else if (IS_FLOAT_ARRAY(container)) {
+        Obj_float_array* array = AS_FLOAT_ARRAY(container);
+        if (!check_index(vm, "Array", array->count, peek(vm, 0), &index))
+            return false;
+        item = NUMBER_VAL(array->values[index]);
+    } else if (IS_MAP(container))
+        map_get(AS_MAP(container), peek(vm, 0), &item);
+    else {
+        runtime_error(vm, "Can only index lists, arrays and maps!");
+        return false;
+    }
+
+    vm->stack_top -= 2;
+    push(vm, item);
+    return true;
+}
+
+// Stores the value on top of the stack at the index below it, leaving just
+// the value.
+static bool set_index(VM* vm) {
+    Value container = peek(vm, 2);
+    Value key = peek(vm, 1);
+    Value item = peek(vm, 0);
+    int index;
+    if (IS_LIST(container)) {
+        Obj_list* list = AS_LIST(container);
+        if (!check_index(vm, "List", list->items.count, key, &index))
+            return false;
+        list->items.values[index] = item;
+    } else if (IS_FLOAT_ARRAY(container)) {
+        Obj_float_array* array = AS_FLOAT_ARRAY(container);
+        if (!check_index(vm, "Array", array->count, key, &index))
+            return false;
+        if (!IS_NUMBER(item)) {
+            runtime_error(vm, "Arrays can only hold numbers!");
+            return false;
+        }
+        array->values[index] = AS_NUMBER(item);
+    } else if (IS_MAP(container)) {
+        if (IS_NUMBER(key) && AS_NUMBER(key) != AS_NUMBER(key)) {
+            runtime_error(vm, "Map keys can't be NaN!");
+            return false;
+        }
+        map_set(vm, AS_MAP(container), key, item);
+    } else {
+        runtime_error(vm, "Can only index lists, arrays and maps!");
+        return false;
+    }
+
+    vm->stack_top -= 3;
+    push(vm, item);
+    return true;
+}
+
+// Replaces the top count values with a list of them.
+static void build_list(VM* vm, int count) {
+    Obj_list* list = new_list(vm);
+    push(vm, OBJ_VAL(list));
+    if (count > 0) {
+        list->items.values = GROW_ARRAY(vm, Value, NULL, 0, count);
+        list->items.capacity = count;
+        memcpy(list->items.values, vm->stack_top - 1 - count,
+               sizeof(Value) * count);
+        list->items.count = count;
+    }
+
+    vm->stack_top -= count + 1;
+    push(vm, OBJ_VAL(list));
 }
 
 static bool is_falsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
-    Obj_string* b = AS_STRING(peek(0));
-    Obj_string* a = AS_STRING(peek(1));
+static void concatenate(VM* vm) {
+    Obj_string* b = AS_STRING(peek(vm, 0));
+    Obj_string* a = AS_STRING(peek(vm, 1));
 
     int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
+    char* chars = ALLOCATE(vm, char, length + 1);
     memcpy(chars, a->chars, a->length);
     memcpy(chars + a->length, b->chars, b->length);
     chars[length] = '\0';
 
-    Obj_string* result = take_string(chars, length);
-    pop();
-    pop();
-    push(OBJ_VAL(result));
+    Obj_string* result = take_string(vm, chars, length);
+    pop(vm);
+    pop(vm);
+    push(vm, OBJ_VAL(result));
 }
 
-static Interpret_result run() {
-    Call_frame* frame = &vm.frames[vm.frame_count - 1];
+// Runs until the frame count of the given fiber drops back to base, which
+// is above zero when a native has called back into Lox. Switching fibers
+// can get it there by way of a call as well as a return.
+static Interpret_result run(VM* vm, Obj_fiber* fiber, int base) {
+    Call_frame* frame = &vm->frames[vm->frame_count - 1];
 
 #define READ_BYTE() (*frame->ip++)
 #define READ_SHORT() \
@@ -266,22 +793,23 @@ static Interpret_result run() {
 #define READ_CONSTANT() \
     (frame->closure->function->chunk.constants.values[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define AT_BASE() (vm->frame_count == base && vm->fiber == fiber)
 
 #define BINARY_OP(value_type, op) \
     do { \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-            runtime_error("Operands must be numbers!"); \
+        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) { \
+            runtime_error(vm, "Operands must be numbers!"); \
             return INTERPRET_RUNTIME_ERROR; \
         } \
-        double b = AS_NUMBER(pop()); \
-        double a = AS_NUMBER(pop()); \
-        push(value_type(a op b)); \
+        double b = AS_NUMBER(pop(vm)); \
+        double a = AS_NUMBER(pop(vm)); \
+        push(vm, value_type(a op b)); \
     } while (false)
 
     for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
         printf("          ");
-        for (Value* slot = vm.stack; slot < vm.stack_top; slot++) {
+        for (Value* slot = vm->stack; slot < vm->stack_top; slot++) {
             printf("[ ");
             print_value(*slot);
             printf(" ]");
@@ -295,57 +823,57 @@ static Interpret_result run() {
         switch (instruction = READ_BYTE()) {
         case OP_CONSTANT: {
             Value constant = READ_CONSTANT();
-            push(constant);
+            push(vm, constant);
             break;
         }
         case OP_NIL:
-            push(NIL_VAL);
+            push(vm, NIL_VAL);
             break;
         case OP_TRUE:
-            push(BOOL_VAL(true));
+            push(vm, BOOL_VAL(true));
             break;
         case OP_FALSE:
-            push(BOOL_VAL(false));
+            push(vm, BOOL_VAL(false));
             break;
         case OP_POP:
-            pop();
+            pop(vm);
             break;
         case OP_GET_LOCAL:
         {
             uint8_t slot = READ_BYTE();
-            push(frame->slots[slot]);
+            push(vm, frame->slots[slot]);
             break;
         }
         case OP_SET_LOCAL:
         {
             uint8_t slot = READ_BYTE();
-            frame->slots[slot] = peek(0);
+            frame->slots[slot] = peek(vm, 0);
             break;
         }
         case OP_GET_GLOBAL:
         {
             Obj_string* name = READ_STRING();
             Value value;
-            if (!table_get(&vm.globals, name, &value)) {
-                runtime_error("Undefined variable '%s'", name->chars);
+            if (!table_get(&vm->globals, name, &value)) {
+                runtime_error(vm, "Undefined variable '%s'", name->chars);
                 return INTERPRET_RUNTIME_ERROR;
             }
-            push(value);
+            push(vm, value);
             break;
         }
         case OP_DEFINE_GLOBAL:
         {
             Obj_string* name = READ_STRING();
-            table_set(&vm.globals, name, peek(0));
-            pop();
+            table_set(vm, &vm->globals, name, peek(vm, 0));
+            pop(vm);
             break;
         }
         case OP_SET_GLOBAL:
         {
             Obj_string* name = READ_STRING();
-            if (table_set(&vm.globals, name, peek(0))) {
-                table_delete(&vm.globals, name);
-                runtime_error("Undefined variable '%s'!", name->chars);
+            if (table_set(vm, &vm->globals, name, peek(vm, 0))) {
+                table_delete(&vm->globals, name);
+                runtime_error(vm, "Undefined variable '%s'!", name->chars);
                 return INTERPRET_RUNTIME_ERROR;
             }
             break;
@@ -353,56 +881,67 @@ static Interpret_result run() {
         case OP_GET_UPVALUE:
         {
             uint8_t slot = READ_BYTE();
-            push(*frame->closure->upvalues[slot]->location);
+            push(vm, *frame->closure->upvalues[slot]->location);
             break;
         }
         case OP_SET_UPVALUE:
         {
             uint8_t slot = READ_BYTE();
-            *frame->closure->upvalues[slot]->location = peek(0);
+            *frame->closure->upvalues[slot]->location = peek(vm, 0);
             break;
         }
         case OP_GET_PROPERTY:
         {
-            if (!IS_INSTANCE(peek(0))) {
-                runtime_error("Only instances have properties!");
+            if (!IS_INSTANCE(peek(vm, 0))) {
+                runtime_error(vm, "Only instances have properties!");
                 return INTERPRET_RUNTIME_ERROR;
             }
 
-            Obj_instance* instance = AS_INSTANCE(peek(0));
+            Obj_instance* instance = AS_INSTANCE(peek(vm, 0));
             Obj_string* name = READ_STRING();
 
             Value value;
             if (table_get(&instance->fields, name, &value)) {
-                pop(); // Instance.
-                push(value);
+                pop(vm); // Instance.
+                push(vm, value);
                 break;
             }
 
-            if (!bind_method(instance->klass, name))
+            if (!bind_method(vm, instance->klass, name))
                 return INTERPRET_RUNTIME_ERROR;
             break;
         }
         case OP_SET_PROPERTY:
         {
-            if (!IS_INSTANCE(peek(1))) {
-                runtime_error("Only instances have fields!");
+            if (!IS_INSTANCE(peek(vm, 1))) {
+                runtime_error(vm, "Only instances have fields!");
                 return INTERPRET_RUNTIME_ERROR;
             }
 
-            Obj_instance* instance = AS_INSTANCE(peek(1));
-            table_set(&instance->fields, READ_STRING(), peek(0));
+            Obj_instance* instance = AS_INSTANCE(peek(vm, 1));
+            table_set(vm, &instance->fields, READ_STRING(), peek(vm, 0));
 
-            Value value = pop();
-            pop();
-            push(value);
+            Value value = pop(vm);
+            pop(vm);
+            push(vm, value);
             break;
         }
+        case OP_GET_INDEX:
+            if (!get_index(vm))
+                return INTERPRET_RUNTIME_ERROR;
+            break;
+        case OP_SET_INDEX:
+            if (!set_index(vm))
+                return INTERPRET_RUNTIME_ERROR;
+            break;
+        case OP_BUILD_LIST:
+            build_list(vm, READ_BYTE());
+            break;
         case OP_EQUAL:
         {
-            Value b = pop();
-            Value a = pop();
-            push(BOOL_VAL(values_equal(a, b)));
+            Value b = pop(vm);
+            Value a = pop(vm);
+            push(vm, BOOL_VAL(values_equal(a, b)));
             break;
         }
         case OP_GREATER:
@@ -412,14 +951,15 @@ static Interpret_result run() {
             BINARY_OP(BOOL_VAL, <);
             break;
         case OP_ADD:
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                concatenate();
-            } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                double b = AS_NUMBER(pop());
-                double a = AS_NUMBER(pop());
-                push(NUMBER_VAL(a + b));
+            if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
+                concatenate(vm);
+            } else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+                double b = AS_NUMBER(pop(vm));
+                double a = AS_NUMBER(pop(vm));
+                push(vm, NUMBER_VAL(a + b));
             } else {
-                runtime_error("Operands must be two numbers or two strings!");
+                runtime_error(vm,
+                              "Operands must be two numbers or two strings!");
                 return INTERPRET_RUNTIME_ERROR;
             }
             break;
@@ -433,19 +973,19 @@ static Interpret_result run() {
             BINARY_OP(NUMBER_VAL, /);
             break;
         case OP_NOT:
-            push(BOOL_VAL(is_falsey(pop())));
+            push(vm, BOOL_VAL(is_falsey(pop(vm))));
             break;
         case OP_NEGATE:
-            if (!IS_NUMBER(peek(0))) {
-                runtime_error("Operand must be a number!");
+            if (!IS_NUMBER(peek(vm, 0))) {
+                runtime_error(vm, "Operand must be a number!");
                 return INTERPRET_RUNTIME_ERROR;
             }
-            push(NUMBER_VAL(-AS_NUMBER(pop())));
+            push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
             break;
         case OP_PRINT:
         {
-            print_value(pop());
-            printf("\n");
+            output_value(&vm->output, pop(vm));
+            end_line(&vm->output);
             break;
         }
         case OP_JUMP:
@@ -457,7 +997,14 @@ static Interpret_result run() {
         case OP_JUMP_IF_FALSE:
         {
             uint16_t offset = READ_SHORT();
-            if (is_falsey(peek(0)))
+            if (is_falsey(peek(vm, 0)))
+                frame->ip += offset;
+            break;
+        }
+        case OP_JUMP_IF_TRUE:
+        {
+            uint16_t offset = READ_SHORT();
+            if (!is_falsey(peek(vm, 0)))
                 frame->ip += offset;
             break;
         }
@@ -465,68 +1012,93 @@ static Interpret_result run() {
         {
             uint16_t offset = READ_SHORT();
             frame->ip -= offset;
+            PROFILE_CHECKPOINT();
             break;
         }
         case OP_CALL:
         {
             int arg_count = READ_BYTE();
-            if (!call_value(peek(arg_count), arg_count))
+            if (!call_value(vm, peek(vm, arg_count), arg_count))
+                return INTERPRET_RUNTIME_ERROR;
+            if (AT_BASE())
+                return INTERPRET_OK;
+            frame = &vm->frames[vm->frame_count - 1];
+            break;
+        }
+        case OP_TAIL_CALL:
+        {
+            int arg_count = READ_BYTE();
+            if (!tail_call(vm, peek(vm, arg_count), arg_count))
                 return INTERPRET_RUNTIME_ERROR;
-            frame = &vm.frames[vm.frame_count - 1];
+            if (AT_BASE())
+                return INTERPRET_OK;
+            frame = &vm->frames[vm->frame_count - 1];
             break;
         }
         case OP_INVOKE:
         {
             Obj_string* method = READ_STRING();
             int arg_count = READ_BYTE();
-            if (!invoke(method, arg_count))
+            if (!invoke(vm, method, arg_count, false))
                 return INTERPRET_RUNTIME_ERROR;
-            frame = &vm.frames[vm.frame_count - 1];
+            if (AT_BASE())
+                return INTERPRET_OK;
+            frame = &vm->frames[vm->frame_count - 1];
+            break;
+        }
+        case OP_TAIL_INVOKE:
+        {
+            Obj_string* method = READ_STRING();
+            int arg_count = READ_BYTE();
+            if (!invoke(vm, method, arg_count, true))
+                return INTERPRET_RUNTIME_ERROR;
+            if (AT_BASE())
+                return INTERPRET_OK;
+            frame = &vm->frames[vm->frame_count - 1];
             break;
         }
         case OP_CLOSURE:
         {
             Obj_function* function = AS_FUNCTION(READ_CONSTANT());
-            Obj_closure* closure = new_closure(function);
-            push(OBJ_VAL(closure));
+            Obj_closure* closure = new_closure(vm, function);
+            push(vm, OBJ_VAL(closure));
             for (int i = 0; i < closure->upvalue_count; i++) {
                 uint8_t is_local = READ_BYTE();
                 uint8_t index = READ_BYTE();
                 if (is_local)
                     closure->upvalues[i]
-                            = capture_upvalue(frame->slots + index);
+                            = capture_upvalue(vm, frame->slots + index);
                 else
                     closure->upvalues[i] = frame->closure->upvalues[index];
             }
             break;
         }
         case OP_CLOSE_UPVALUE:
-            close_upvalues(vm.stack_top - 1);
-            pop();
+            close_upvalues(vm, vm->stack_top - 1);
+            pop(vm);
             break;
         case OP_RETURN:
         {
-            Value result = pop();
+            Value result = pop(vm);
 
-            close_upvalues(frame->slots);
+            close_upvalues(vm, frame->slots);
 
-            vm.frame_count--;
-            if (vm.frame_count == 0) {
-                pop();
+            vm->frame_count--;
+            vm->stack_top = frame->slots;
+            push(vm, result);
+            if (vm->frame_count == 0 && vm->fiber != NULL)
+                finish_fiber(vm);
+            if (AT_BASE())
                 return INTERPRET_OK;
-            }
-
-            vm.stack_top = frame->slots;
-            push(result);
 
-            frame = &vm.frames[vm.frame_count - 1];
+            frame = &vm->frames[vm->frame_count - 1];
             break;
         }
         case OP_CLASS:
-            push(OBJ_VAL(new_class(READ_STRING())));
+            push(vm, OBJ_VAL(new_class(vm, READ_STRING())));
             break;
         case OP_METHOD:
-            define_method(READ_STRING());
+            define_method(vm, READ_STRING());
             break;
         }
     }
@@ -535,19 +1107,51 @@ static Interpret_result run() {
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef AT_BASE
 #undef BINARY_OP
 }
 
-Interpret_result interpret(const char* source) {
-    Obj_function* function = compile(source);
+Interpret_result interpret(VM* vm, const char* source) {
+    Obj_function* function = compile(vm, source);
     if (function == NULL)
         return INTERPRET_COMPILE_ERROR;
 
-    push(OBJ_VAL(function));
-    Obj_closure* closure = new_closure(function);
-    pop();
-    push(OBJ_VAL(closure));
-    call_value(OBJ_VAL(closure), 0);
+    return interpret_function(vm, function);
+}
+
+Interpret_result interpret_function(VM* vm, Obj_function* function) {
+    push(vm, OBJ_VAL(function));
+    Obj_closure* closure = new_closure(vm, function);
+    pop(vm);
+    push(vm, OBJ_VAL(closure));
+    if (!call_value(vm, OBJ_VAL(closure), 0))
+        return INTERPRET_RUNTIME_ERROR;
+
+    Interpret_result result = run(vm, vm->fiber, 0);
+    if (result == INTERPRET_OK)
+        pop(vm);
+    return result;
+}
+
+Interpret_result interpret_call(VM* vm, int arg_count) {
+    Obj_fiber* fiber = vm->fiber;
+    int base = vm->frame_count;
+    if (!call_value(vm, peek(vm, arg_count), arg_count))
+        return INTERPRET_RUNTIME_ERROR;
+
+    // Natives and classes without an initializer are done already.
+    if (vm->frame_count == base && vm->fiber == fiber)
+        return INTERPRET_OK;
+    return run(vm, fiber, base);
+}
+
+Interpret_result resume_fiber(VM* vm, Obj_fiber* fiber, Value value) {
+    Obj_fiber* caller = vm->fiber;
+    int base = vm->frame_count;
+    push(vm, NIL_VAL);
 
-    return run();
+    // The fiber runs under a new run(), one native call deeper.
+    if (!enter_fiber(vm, fiber, value, vm->native_depth + 1))
+        return INTERPRET_RUNTIME_ERROR;
+    return run(vm, caller, base);
 }